@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-bench.h>
+#include <kvm/builtin-run.h>
+#include <kvm/disk-image.h>
+#include <kvm/parse-options.h>
+#include <kvm/mutex.h>
+
+#include <linux/kernel.h>
+
+/*
+ * Drives a disk image the way virtio-blk does, from several threads each
+ * keeping a number of requests in flight, and completing them through the
+ * disk's request callback. No guest is involved, so backend changes can be
+ * measured on their own.
+ */
+
+#define BENCH_MAX_THREADS	64
+#define BENCH_MAX_DEPTH		1024
+
+/*
+ * Latency buckets: exact below 8ns, then 8 buckets per power of two, which
+ * keeps percentiles within 12.5%.
+ */
+#define BENCH_LAT_SUB		3
+#define BENCH_LAT_BUCKETS	(64 << BENCH_LAT_SUB)
+
+enum {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_NR,
+};
+
+struct bench_thread;
+
+struct bench_req {
+	/* Must come first, the disk accounts for the request through it */
+	struct disk_image_req		dreq;
+	struct bench_thread		*thread;
+	int				op;
+	u64				start;
+	struct iovec			iov;
+};
+
+struct bench_stats {
+	u64				ops;
+	u64				bytes;
+	u64				errors;
+	u64				lat_total;
+	u64				lat_max;
+	u64				lat[BENCH_LAT_BUCKETS];
+};
+
+struct bench_thread {
+	pthread_t			thread;
+	int				id;
+	unsigned int			seed;
+	u64				next;
+
+	pthread_mutex_t			mutex;
+	pthread_cond_t			cond;
+	struct bench_req		**free;
+	int				nr_free;
+
+	struct bench_req		*reqs;
+	struct bench_stats		stats[BENCH_NR];
+};
+
+static const char *image;
+static int nr_threads = 1;
+static int depth = 32;
+static int block_size = 4096;
+static int read_percent = 100;
+static bool random_io;
+static int seconds = 10;
+
+static struct disk_image *disk;
+static struct bench_thread *threads;
+static volatile bool stop;
+
+static const char * const bench_usage[] = {
+	"lkvm bench disk -i <image[,options]> [-t threads] [-q depth] [-b size] [-r percent] [--random]",
+	NULL
+};
+
+static const struct option bench_options[] = {
+	OPT_GROUP("Disk options:"),
+	OPT_STRING('i', "image", &image, "image", "Disk image, with the options of lkvm run"),
+	OPT_INTEGER('t', "threads", &nr_threads, "Number of submitting threads"),
+	OPT_INTEGER('q', "queue-depth", &depth, "Requests in flight per thread"),
+	OPT_INTEGER('b', "block-size", &block_size, "Request size in bytes"),
+	OPT_INTEGER('r', "read-percent", &read_percent, "Share of reads, the rest are writes"),
+	OPT_BOOLEAN('\0', "random", &random_io, "Random rather than sequential offsets"),
+	OPT_INTEGER('s', "seconds", &seconds, "How long to run for"),
+	OPT_END()
+};
+
+void kvm_bench_help(void)
+{
+	usage_with_options(bench_usage, bench_options);
+}
+
+static void parse_bench_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, bench_options, bench_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_bench_help();
+	}
+}
+
+static int bench_lat_bucket(u64 ns)
+{
+	int msb;
+
+	if (ns < (1 << BENCH_LAT_SUB))
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+
+	return ((msb - BENCH_LAT_SUB + 1) << BENCH_LAT_SUB) +
+		((ns >> (msb - BENCH_LAT_SUB)) & ((1 << BENCH_LAT_SUB) - 1));
+}
+
+/* The middle of a bucket */
+static u64 bench_lat_value(int bucket)
+{
+	int shift = (bucket >> BENCH_LAT_SUB) - 1;
+	u64 base;
+
+	if (shift < 0)
+		return bucket;
+
+	base = (u64)((1 << BENCH_LAT_SUB) + (bucket & ((1 << BENCH_LAT_SUB) - 1))) << shift;
+
+	return base + ((1ULL << shift) >> 1);
+}
+
+/* Called by the disk, possibly from the submitting thread itself */
+static void bench_complete(void *param, long len)
+{
+	struct bench_req *req = param;
+	struct bench_thread *t = req->thread;
+	struct bench_stats *stats = &t->stats[req->op];
+	u64 lat;
+
+	disk_image__req_done(disk, &req->dreq, len);
+
+	lat = disk_image__time_ns() - req->start;
+
+	mutex_lock(&t->mutex);
+
+	stats->ops++;
+	if (len < 0)
+		stats->errors++;
+	else
+		stats->bytes += len;
+	stats->lat_total += lat;
+	stats->lat_max = max(stats->lat_max, lat);
+	stats->lat[bench_lat_bucket(lat)]++;
+
+	t->free[t->nr_free++] = req;
+	pthread_cond_signal(&t->cond);
+
+	mutex_unlock(&t->mutex);
+}
+
+static u64 bench_next_sector(struct bench_thread *t)
+{
+	u64 blocks = disk->size / block_size;
+	u64 block;
+
+	if (random_io) {
+		block = ((u64)rand_r(&t->seed) << 31 | rand_r(&t->seed)) % blocks;
+	} else {
+		/* Each thread goes through its own slice of the disk */
+		block = (t->id * blocks / nr_threads + t->next++) % blocks;
+	}
+
+	return block * block_size >> SECTOR_SHIFT;
+}
+
+static void bench_submit(struct bench_thread *t, struct bench_req *req)
+{
+	u64 sector = bench_next_sector(t);
+
+	req->op		= (int)(rand_r(&t->seed) % 100) < read_percent ? BENCH_READ : BENCH_WRITE;
+	req->start	= disk_image__time_ns();
+
+	if (req->op == BENCH_READ)
+		disk_image__read(disk, sector, &req->iov, 1, req);
+	else
+		disk_image__write(disk, sector, &req->iov, 1, req);
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_req *batch[BENCH_MAX_DEPTH];
+	struct bench_thread *t = arg;
+	int i, nr;
+
+	while (1) {
+		mutex_lock(&t->mutex);
+		while (!t->nr_free)
+			pthread_cond_wait(&t->cond, &t->mutex);
+
+		/* Wait for whatever is still in flight before leaving */
+		if (stop) {
+			if (t->nr_free == depth) {
+				mutex_unlock(&t->mutex);
+				break;
+			}
+			pthread_cond_wait(&t->cond, &t->mutex);
+			mutex_unlock(&t->mutex);
+			continue;
+		}
+
+		nr = t->nr_free;
+		memcpy(batch, t->free, nr * sizeof(*batch));
+		t->nr_free = 0;
+		mutex_unlock(&t->mutex);
+
+		for (i = 0; i < nr; i++)
+			bench_submit(t, batch[i]);
+
+		disk_image__submit(disk);
+	}
+
+	return NULL;
+}
+
+static int bench_thread_init(struct bench_thread *t, int id)
+{
+	struct bench_req *req;
+	int i;
+
+	*t = (struct bench_thread) {
+		.id	= id,
+		.seed	= id + 1,
+	};
+
+	mutex_init(&t->mutex);
+	pthread_cond_init(&t->cond, NULL);
+
+	t->reqs = calloc(depth, sizeof(*t->reqs));
+	t->free = calloc(depth, sizeof(*t->free));
+	if (!t->reqs || !t->free)
+		return -ENOMEM;
+
+	for (i = 0; i < depth; i++) {
+		req = &t->reqs[i];
+		req->thread = t;
+
+		/* Aligned, in case the image is opened with cache=none */
+		req->iov.iov_len = block_size;
+		if (posix_memalign(&req->iov.iov_base, getpagesize(), block_size))
+			return -ENOMEM;
+		memset(req->iov.iov_base, 0x5a, block_size);
+
+		t->free[t->nr_free++] = req;
+	}
+
+	return 0;
+}
+
+static u64 bench_percentile(struct bench_stats *stats, double pct)
+{
+	u64 seen = 0, want;
+	int i;
+
+	want = (u64)(stats->ops * pct / 100);
+	for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+		seen += stats->lat[i];
+		if (seen > want)
+			return bench_lat_value(i);
+	}
+
+	return stats->lat_max;
+}
+
+static void bench_report(struct bench_stats *stats, const char *name, double secs)
+{
+	if (!stats->ops)
+		return;
+
+	printf("%-6s %10.0f IOPS %10.2f MiB/s %8llu errors\n", name,
+	       stats->ops / secs, stats->bytes / secs / (1024 * 1024), stats->errors);
+	printf("       latency (us): avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+	       (double)stats->lat_total / stats->ops / 1000,
+	       bench_percentile(stats, 50) / 1000.0,
+	       bench_percentile(stats, 90) / 1000.0,
+	       bench_percentile(stats, 99) / 1000.0,
+	       bench_percentile(stats, 99.9) / 1000.0,
+	       stats->lat_max / 1000.0);
+}
+
+static void bench_sum(struct bench_stats *total, struct bench_stats *stats)
+{
+	int i;
+
+	total->ops		+= stats->ops;
+	total->bytes		+= stats->bytes;
+	total->errors		+= stats->errors;
+	total->lat_total	+= stats->lat_total;
+	total->lat_max		= max(total->lat_max, stats->lat_max);
+
+	for (i = 0; i < BENCH_LAT_BUCKETS; i++)
+		total->lat[i] += stats->lat[i];
+}
+
+static int kvm_cmd_bench_disk(void)
+{
+	struct bench_stats total[BENCH_NR] = { };
+	struct disk_image_params params = { };
+	struct disk_image **disks;
+	u64 start;
+	double secs;
+	int i, op;
+
+	if (!image || nr_threads <= 0 || nr_threads > BENCH_MAX_THREADS ||
+	    depth <= 0 || depth > BENCH_MAX_DEPTH || seconds <= 0 ||
+	    block_size < (int)SECTOR_SIZE || block_size % SECTOR_SIZE ||
+	    read_percent < 0 || read_percent > 100)
+		kvm_bench_help();
+
+	kvm_run_set_disk_params(&params, image);
+
+	disks = disk_image__open_all(&params, 1);
+	if (IS_ERR(disks))
+		die("Unable to open disk image %s", params.filename);
+
+	disk = disks[0];
+	if (disk->size < (u64)block_size)
+		die("Disk image %s is smaller than a block", params.filename);
+
+	disk_image__set_callback(disk, bench_complete);
+
+	if (disk_image__set_depth(disk, nr_threads * depth) < 0)
+		die("Unable to keep %d requests in flight", nr_threads * depth);
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		die("Out of memory");
+
+	for (i = 0; i < nr_threads; i++)
+		if (bench_thread_init(&threads[i], i) < 0)
+			die("Out of memory");
+
+	printf("  # lkvm bench disk %s: %d thread(s), queue depth %d, %d byte %s requests, %d%% reads\n",
+	       params.filename, nr_threads, depth, block_size,
+	       random_io ? "random" : "sequential", read_percent);
+
+	start = disk_image__time_ns();
+
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]))
+			die("Unable to start benchmark thread");
+
+	sleep(seconds);
+	stop = true;
+
+	for (i = 0; i < nr_threads; i++) {
+		mutex_lock(&threads[i].mutex);
+		pthread_cond_signal(&threads[i].cond);
+		mutex_unlock(&threads[i].mutex);
+		pthread_join(threads[i].thread, NULL);
+	}
+
+	secs = (double)(disk_image__time_ns() - start) / 1000000000;
+
+	for (i = 0; i < nr_threads; i++)
+		for (op = 0; op < BENCH_NR; op++)
+			bench_sum(&total[op], &threads[i].stats[op]);
+
+	bench_report(&total[BENCH_READ], "read", secs);
+	bench_report(&total[BENCH_WRITE], "write", secs);
+
+	disk_image__close_all(disks, 1);
+
+	return 0;
+}
+
+int kvm_cmd_bench(int argc, const char **argv, const char *prefix)
+{
+	if (argc < 1 || strcmp(argv[0], "disk"))
+		kvm_bench_help();
+
+	parse_bench_options(argc - 1, argv + 1);
+
+	return kvm_cmd_bench_disk();
+}
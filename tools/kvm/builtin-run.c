@@ -70,7 +70,7 @@ struct kvm_cpu **kvm_cpus;
 __thread struct kvm_cpu *current_kvm_cpu;
 
 static u64 ram_size;
-static u8  image_count;
+static int image_count;
 static u8 num_net_devices;
 static bool virtio_rng;
 static const char *kernel_cmdline;
@@ -82,7 +82,6 @@ static const char *entry_addr_str;
 static const char *vmlinux_filename;
 static const char *initrd_filename;
 static const char *firmware_filename;
-static const char *image_filename[MAX_DISK_IMAGES];
 static const char *console;
 static const char *dev;
 static const char *network;
@@ -97,7 +96,7 @@ static const char *hugetlbfs_path;
 static const char *custom_rootfs_name = "default";
 static struct virtio_net_params *net_params;
 static bool single_step;
-static bool readonly_image[MAX_DISK_IMAGES];
+static struct disk_image_params disk_image[MAX_DISK_IMAGES];
 static bool vnc;
 static bool sdl;
 static bool balloon;
@@ -131,9 +130,75 @@ void kvm_run_set_wrapper_sandbox(void)
 	kvm_run_wrapper = KVM_RUN_SANDBOX;
 }
 
+static void set_disk_param(struct disk_image_params *p, const char *param,
+				const char *val)
+{
+	if (strcmp(param, "ro") == 0) {
+		p->readonly = true;
+	} else if (strcmp(param, "sqpoll") == 0) {
+		p->sqpoll = true;
+	} else if (strcmp(param, "cache") == 0 && val) {
+		if (strcmp(val, "none") == 0)
+			p->direct = true;
+		else if (strcmp(val, "writeback") == 0)
+			p->direct = false;
+		else
+			die("Unknown cache mode %s for disk %s", val, p->filename);
+	} else if (strcmp(param, "queues") == 0 && val) {
+		p->nr_queues = atoi(val);
+		if (p->nr_queues <= 0)
+			die("Invalid number of queues %s for disk %s", val, p->filename);
+	} else if (strcmp(param, "iops") == 0 && val) {
+		p->throttle.iops = strtoull(val, NULL, 10);
+	} else if (strcmp(param, "iops_burst") == 0 && val) {
+		p->throttle.iops_burst = strtoull(val, NULL, 10);
+	} else if (strcmp(param, "bps") == 0 && val) {
+		p->throttle.bps = strtoull(val, NULL, 10);
+	} else if (strcmp(param, "bps_burst") == 0 && val) {
+		p->throttle.bps_burst = strtoull(val, NULL, 10);
+	} else if (strcmp(param, "cow") == 0 && val) {
+		p->cow = val;
+		p->readonly = true;
+	} else if (strcmp(param, "record") == 0 && val) {
+		p->record = val;
+	} else if (strcmp(param, "record_time") == 0 && val) {
+		p->record_secs = atoi(val);
+		if (p->record_secs <= 0)
+			die("Invalid recording time %s for disk %s", val, p->filename);
+	} else if (strcmp(param, "prefetch") == 0 && val) {
+		p->prefetch = val;
+	} else if (strcmp(param, "qcow_cache") == 0 && val) {
+		p->qcow_cache = atoi(val);
+		if (p->qcow_cache <= 0)
+			die("Invalid QCOW cache size %s for disk %s", val, p->filename);
+	} else {
+		die("Unknown disk image option %s", param);
+	}
+}
+
+/* The image name may be followed by ",ro" and ",key=value" options */
+void kvm_run_set_disk_params(struct disk_image_params *p, const char *arg)
+{
+	char *sep, *cur, *val;
+
+	p->filename = arg;
+
+	sep = strstr(arg, ",");
+	if (!sep)
+		return;
+
+	*sep = 0;
+	for (cur = strtok(sep + 1, ","); cur; cur = strtok(NULL, ",")) {
+		val = strchr(cur, '=');
+		if (val)
+			*val++ = 0;
+		set_disk_param(p, cur, val);
+	}
+}
+
 static int img_name_parser(const struct option *opt, const char *arg, int unset)
 {
-	char *sep;
+	struct disk_image_params *p;
 	struct stat st;
 	char path[PATH_MAX];
 
@@ -172,15 +237,10 @@ static int img_name_parser(const struct option *opt, const char *arg, int unset)
 	}
 
 	if (image_count >= MAX_DISK_IMAGES)
-		die("Currently only 4 images are supported");
+		die("Currently only %d images are supported", MAX_DISK_IMAGES);
 
-	image_filename[image_count] = arg;
-	sep = strstr(arg, ",");
-	if (sep) {
-		if (strcmp(sep + 1, "ro") == 0)
-			readonly_image[image_count] = 1;
-		*sep = 0;
-	}
+	p = &disk_image[image_count];
+	kvm_run_set_disk_params(p, arg);
 
 	image_count++;
 
@@ -239,13 +299,17 @@ static int set_net_param(struct virtio_net_params *p, const char *param,
 			p->mode = NET_MODE_USER;
 		} else if (!strncmp(val, "tap", 3)) {
 			p->mode = NET_MODE_TAP;
+		} else if (!strncmp(val, "packet", 6)) {
+			p->mode = NET_MODE_PACKET;
 		} else if (!strncmp(val, "none", 4)) {
 			no_net = 1;
 			return -1;
 		} else
-			die("Unkown network mode %s, please use user, tap or none", network);
+			die("Unkown network mode %s, please use user, tap, packet or none", network);
 	} else if (strcmp(param, "script") == 0) {
 		p->script = strdup(val);
+	} else if (strcmp(param, "ifname") == 0) {
+		p->ifname = strdup(val);
 	} else if (strcmp(param, "guest_ip") == 0) {
 		p->guest_ip = strdup(val);
 	} else if (strcmp(param, "host_ip") == 0) {
@@ -254,6 +318,14 @@ static int set_net_param(struct virtio_net_params *p, const char *param,
 		p->vhost = atoi(val);
 	} else if (strcmp(param, "fd") == 0) {
 		p->fd = atoi(val);
+	} else if (strcmp(param, "queues") == 0) {
+		p->queues = atoi(val);
+	} else if (strcmp(param, "coalesce_usecs") == 0) {
+		p->coalesce_usecs = atoi(val);
+	} else if (strcmp(param, "coalesce_packets") == 0) {
+		p->coalesce_packets = atoi(val);
+	} else if (strcmp(param, "buffers") == 0) {
+		p->buffers = atoi(val);
 	}
 
 	return 0;
@@ -604,6 +676,50 @@ static void handle_sigalrm(int sig)
 	kvm__arch_periodic_poll(kvm);
 }
 
+static void handle_disk_throttle(int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_throttle_msg *params;
+
+	if (WARN_ON(type != KVM_IPC_DISK_THROTTLE || len != sizeof(*params)))
+		return;
+
+	params = (void *)msg;
+	if (params->disk >= (u32)kvm->nr_disks || !kvm->disks[params->disk]) {
+		pr_warning("No disk %u to throttle", params->disk);
+		return;
+	}
+
+	if (disk_throttle__set(kvm->disks[params->disk], &params->limits) < 0)
+		pr_warning("Unable to throttle disk %u", params->disk);
+}
+
+static void handle_disk_stat(int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_stats stats;
+	u32 nr, i;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len))
+		return;
+
+	nr = kvm->nr_disks;
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0)
+		goto error;
+
+	for (i = 0; i < nr; i++) {
+		memset(&stats, 0, sizeof(stats));
+		if (kvm->disks[i])
+			disk_image__get_stats(kvm->disks[i], &stats);
+
+		if (write_in_full(fd, &stats, sizeof(stats)) < 0)
+			goto error;
+	}
+
+	return;
+
+error:
+	pr_warning("Failed sending disk stats");
+}
+
 static void handle_stop(int fd, u32 type, u32 len, u8 *msg)
 {
 	if (WARN_ON(type != KVM_IPC_STOP || len))
@@ -926,6 +1042,8 @@ static int kvm_cmd_run_init(int argc, const char **argv)
 	kvm_ipc__register_handler(KVM_IPC_RESUME, handle_pause);
 	kvm_ipc__register_handler(KVM_IPC_STOP, handle_stop);
 	kvm_ipc__register_handler(KVM_IPC_VMSTATE, handle_vmstate);
+	kvm_ipc__register_handler(KVM_IPC_DISK_THROTTLE, handle_disk_throttle);
+	kvm_ipc__register_handler(KVM_IPC_DISK_STAT, handle_disk_stat);
 
 	nr_online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
@@ -1119,7 +1237,7 @@ static int kvm_cmd_run_init(int argc, const char **argv)
 	if (kernel_cmdline)
 		strlcat(real_cmdline, kernel_cmdline, sizeof(real_cmdline));
 
-	if (!using_rootfs && !image_filename[0] && !initrd_filename) {
+	if (!using_rootfs && !disk_image[0].filename && !initrd_filename) {
 		char tmp[PATH_MAX];
 
 		kvm_setup_create_new(custom_rootfs_name);
@@ -1151,7 +1269,7 @@ static int kvm_cmd_run_init(int argc, const char **argv)
 
 	if (image_count) {
 		kvm->nr_disks = image_count;
-		kvm->disks = disk_image__open_all(image_filename, readonly_image, image_count);
+		kvm->disks = disk_image__open_all(disk_image, image_count);
 		if (IS_ERR(kvm->disks)) {
 			r = PTR_ERR(kvm->disks);
 			pr_err("disk_image__open_all() failed with error %ld\n",
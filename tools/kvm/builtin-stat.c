@@ -4,6 +4,8 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
+#include <kvm/read-write.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,6 +15,7 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +27,7 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -97,6 +101,120 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static const char * const disk_stat_names[DISK_STAT_NR] = {
+	[DISK_STAT_READ]	= "read",
+	[DISK_STAT_WRITE]	= "write",
+	[DISK_STAT_FLUSH]	= "flush",
+};
+
+static const char * const disk_cache_names[DISK_CACHE_NR] = {
+	[DISK_CACHE_L2]		= "L2",
+	[DISK_CACHE_REFCOUNT]	= "refcount",
+};
+
+static void print_lat_bucket(int i)
+{
+	char range[48];
+
+	if (i == 0)
+		snprintf(range, sizeof(range), "< 1");
+	else if (i == DISK_STAT_BUCKETS - 1)
+		snprintf(range, sizeof(range), ">= %llu", 1ULL << (i - 1));
+	else
+		snprintf(range, sizeof(range), "%llu - %llu", 1ULL << (i - 1), 1ULL << i);
+
+	printf("%20s", range);
+}
+
+static void print_disk_stats(u32 nr, struct disk_stats *stats)
+{
+	struct disk_stats_op *op;
+	int i, j;
+
+	printf("\n\t*** Disk %u statistics ***\n\n", nr);
+	printf("Requests in flight: %llu (at most %llu)\n\n", stats->in_flight,
+	       stats->max_in_flight);
+
+	for (i = 0; i < DISK_STAT_NR; i++) {
+		op = &stats->op[i];
+		printf("%-6s %12llu ops %16llu bytes %8llu errors %10llu us avg\n",
+		       disk_stat_names[i], op->ops, op->bytes, op->errors,
+		       op->ops ? op->lat_total / op->ops : 0);
+	}
+	printf("%-6s %12llu ops %48llu us avg\n", "guest", stats->guest_ops,
+	       stats->guest_ops ? stats->guest_lat_total / stats->guest_ops : 0);
+
+	printf("\nLatency from submission to completion, and from guest kick to used ring:\n\n");
+	printf("%20s", "us");
+	for (i = 0; i < DISK_STAT_NR; i++)
+		printf("%12s", disk_stat_names[i]);
+	printf("%12s\n", "guest");
+
+	for (j = 0; j < DISK_STAT_BUCKETS; j++) {
+		bool used = stats->guest_lat[j] != 0;
+
+		for (i = 0; i < DISK_STAT_NR; i++)
+			used |= stats->op[i].lat[j] != 0;
+		if (!used)
+			continue;
+
+		print_lat_bucket(j);
+		for (i = 0; i < DISK_STAT_NR; i++)
+			printf("%12llu", stats->op[i].lat[j]);
+		printf("%12llu\n", stats->guest_lat[j]);
+	}
+
+	for (i = 0; i < DISK_CACHE_NR; i++) {
+		struct disk_stats_cache *c = &stats->cache[i];
+
+		if (!c->hits && !c->misses)
+			continue;
+
+		printf("\n%-8s cache %12llu hits %12llu misses\n", disk_cache_names[i],
+		       c->hits, c->misses);
+	}
+}
+
+static int do_diskstat(const char *name, int sock)
+{
+	struct disk_stats stats;
+	u32 nr, i;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STAT);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (read_in_full(sock, &stats, sizeof(stats)) != sizeof(stats)) {
+			pr_err("Could not retrieve disk stats from %s", name);
+			return -1;
+		}
+
+		print_disk_stats(i, &stats);
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+	if (disk && r >= 0)
+		r = do_diskstat(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -104,11 +222,11 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -118,8 +236,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-throttle.h>
+#include <kvm/disk-image.h>
+#include <kvm/parse-options.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-ipc.h>
+
+static const char *instance_name;
+static int disk;
+static struct disk_throttle_limits limits = {
+	.iops		= DISK_THROTTLE_KEEP,
+	.iops_burst	= DISK_THROTTLE_KEEP,
+	.bps		= DISK_THROTTLE_KEEP,
+	.bps_burst	= DISK_THROTTLE_KEEP,
+};
+
+static const char * const throttle_usage[] = {
+	"lkvm throttle [-n name] [-d disk] [--iops n] [--bps n]",
+	NULL
+};
+
+static const struct option throttle_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('d', "disk", &disk, "Disk number, in --disk order"),
+	OPT_GROUP("Throttle options:"),
+	OPT_U64('\0', "iops", &limits.iops, "Requests per second, 0 for no limit"),
+	OPT_U64('\0', "iops-burst", &limits.iops_burst, "Requests allowed in a burst"),
+	OPT_U64('\0', "bps", &limits.bps, "Bytes per second, 0 for no limit"),
+	OPT_U64('\0', "bps-burst", &limits.bps_burst, "Bytes allowed in a burst"),
+	OPT_END(),
+};
+
+void kvm_throttle_help(void)
+{
+	usage_with_options(throttle_usage, throttle_options);
+}
+
+static void parse_throttle_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, throttle_options, throttle_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_throttle_help();
+	}
+}
+
+int kvm_cmd_throttle(int argc, const char **argv, const char *prefix)
+{
+	struct disk_throttle_msg msg;
+	int instance;
+	int r;
+
+	parse_throttle_options(argc, argv);
+
+	if (instance_name == NULL || disk < 0)
+		kvm_throttle_help();
+
+	if (limits.iops == DISK_THROTTLE_KEEP && limits.iops_burst == DISK_THROTTLE_KEEP &&
+	    limits.bps == DISK_THROTTLE_KEEP && limits.bps_burst == DISK_THROTTLE_KEEP)
+		kvm_throttle_help();
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	msg = (struct disk_throttle_msg) {
+		.disk	= disk,
+		.limits	= limits,
+	};
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_DISK_THROTTLE,
+			sizeof(msg), (u8 *)&msg);
+
+	close(instance);
+
+	if (r < 0)
+		return -1;
+
+	return 0;
+}
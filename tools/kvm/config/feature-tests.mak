@@ -166,3 +166,15 @@ int main(void)
 	return 0;
 }
 endef
+
+define SOURCE_URING
+#include <liburing.h>
+
+int main(void)
+{
+	struct io_uring ring;
+
+	io_uring_queue_init(1, &ring, 0);
+	return 0;
+}
+endef
@@ -8,11 +8,21 @@
 static struct disk_image_operations blk_dev_ops = {
 	.read_sector		= raw_image__read_sector,
 	.write_sector		= raw_image__write_sector,
+	.discard		= raw_image__discard,
+	.write_zeroes		= raw_image__write_zeroes,
+	.prefetch		= raw_image__prefetch,
+};
+
+static struct disk_image_operations blk_dev_ro_ops = {
+	.read_sector		= raw_image__read_sector_mmap,
+	.write_sector		= raw_image__write_sector_mmap,
+	.prefetch		= raw_image__prefetch,
 	.close			= raw_image__close,
 };
 
-struct disk_image *blkdev__probe(const char *filename, struct stat *st)
+struct disk_image *blkdev__probe(struct disk_image_params *params, struct stat *st)
 {
+	struct disk_image *disk;
 	u64 size;
 	int fd, r;
 
@@ -20,12 +30,12 @@ struct disk_image *blkdev__probe(const char *filename, struct stat *st)
 		return ERR_PTR(-EINVAL);
 
 	/*
-	 * Be careful! We are opening host block device!
-	 * Open it readonly since we do not want to break user's data on disk.
+	 * Be careful! We are opening host block device! Guest writes only
+	 * reach it when it isn't read-only, nor behind an overlay.
 	 */
-	fd = open(filename, O_RDONLY);
+	fd = open(params->filename, params->readonly || params->cow ? O_RDONLY : O_RDWR);
 	if (fd < 0)
-		return ERR_PTR(fd);
+		return ERR_PTR(-errno);
 
 	if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
 		r = -errno;
@@ -33,10 +43,27 @@ struct disk_image *blkdev__probe(const char *filename, struct stat *st)
 		return ERR_PTR(r);
 	}
 
-	/*
-	 * FIXME: This will not work on 32-bit host because we can not
-	 * mmap large disk. There is not enough virtual address space
-	 * in 32-bit host. However, this works on 64-bit host.
-	 */
-	return disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_MMAP);
+	if (params->cow)
+		return cow_image__probe(fd, size, params);
+
+	if (params->readonly) {
+		/*
+		 * Guest writes go to a MAP_PRIVATE mapping, and are lost.
+		 * FIXME: This will not work on 32-bit host because we can not
+		 * mmap large disk. There is not enough virtual address space
+		 * in 32-bit host. However, this works on 64-bit host.
+		 */
+		return disk_image__new(fd, size, &blk_dev_ro_ops, DISK_IMAGE_MMAP);
+	}
+
+	disk = uring_image__probe(fd, size, params);
+	if (!IS_ERR_OR_NULL(disk))
+		return disk;
+
+	disk = disk_image__new(fd, size, &blk_dev_ops, DISK_IMAGE_REGULAR);
+#ifdef CONFIG_HAS_AIO
+	if (!IS_ERR_OR_NULL(disk))
+		disk->async = 1;
+#endif
+	return disk;
 }
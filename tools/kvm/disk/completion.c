@@ -0,0 +1,175 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <sys/epoll.h>
+
+/*
+ * Asynchronous backends signal completions on a file descriptor, an eventfd
+ * for AIO and io_uring alike. Rather than a thread per disk blocking on it,
+ * the descriptors of every disk are polled by a small pool of threads shared
+ * by all of them.
+ *
+ * Sources are armed one-shot, so that a single thread at a time reaps a
+ * given source, and re-armed once it's done. Epoll events carry the slot of
+ * the source along with a generation, so that events still in flight for a
+ * source which was removed are recognized and dropped.
+ */
+
+#define DISK_COMPLETION_MAX		256
+#define DISK_COMPLETION_THREADS		8
+
+struct disk_completion {
+	int				fd;
+	void				(*reap)(void *arg);
+	void				*arg;
+	u32				gen;
+	bool				busy;
+};
+
+static struct disk_completion sources[DISK_COMPLETION_MAX];
+static DEFINE_MUTEX(completion_mutex);
+static pthread_cond_t completion_cond = PTHREAD_COND_INITIALIZER;
+static int epoll_fd = -1;
+
+static int disk_completion__arm(int op, int id)
+{
+	struct epoll_event ev = {
+		.events		= EPOLLIN | EPOLLONESHOT,
+		.data.u64	= (u64)sources[id].gen << 32 | id,
+	};
+
+	return epoll_ctl(epoll_fd, op, sources[id].fd, &ev);
+}
+
+static void *disk_completion__thread(void *arg)
+{
+	struct disk_completion *c;
+	struct epoll_event ev;
+	u32 id, gen;
+
+	while (1) {
+		if (epoll_wait(epoll_fd, &ev, 1, -1) <= 0)
+			continue;
+
+		id	= (u32)ev.data.u64;
+		gen	= ev.data.u64 >> 32;
+		c	= &sources[id];
+
+		mutex_lock(&completion_mutex);
+		if (c->gen != gen || !c->reap) {
+			mutex_unlock(&completion_mutex);
+			continue;
+		}
+		c->busy = true;
+		mutex_unlock(&completion_mutex);
+
+		c->reap(c->arg);
+
+		mutex_lock(&completion_mutex);
+		c->busy = false;
+		if (c->reap)
+			disk_completion__arm(EPOLL_CTL_MOD, id);
+		else
+			pthread_cond_broadcast(&completion_cond);
+		mutex_unlock(&completion_mutex);
+	}
+
+	return NULL;
+}
+
+/* Called with completion_mutex held */
+static int disk_completion__start(void)
+{
+	pthread_t thread;
+	long nr;
+	int i;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		return -errno;
+
+	nr = sysconf(_SC_NPROCESSORS_ONLN);
+	nr = min(max(nr, 1L), (long)DISK_COMPLETION_THREADS);
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&thread, NULL, disk_completion__thread, NULL))
+			break;
+		pthread_detach(thread);
+	}
+
+	/* The threads which did start are enough to go on with */
+	if (!i) {
+		close(epoll_fd);
+		epoll_fd = -1;
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Calls reap(arg) from the pool whenever fd becomes readable. Returns an id
+ * for disk_completion__del().
+ */
+int disk_completion__add(int fd, void (*reap)(void *arg), void *arg)
+{
+	int id, r;
+
+	mutex_lock(&completion_mutex);
+
+	if (epoll_fd < 0) {
+		r = disk_completion__start();
+		if (r < 0)
+			goto out;
+	}
+
+	for (id = 0; id < DISK_COMPLETION_MAX; id++)
+		if (!sources[id].reap && !sources[id].busy)
+			break;
+
+	if (id == DISK_COMPLETION_MAX) {
+		r = -ENOSPC;
+		goto out;
+	}
+
+	sources[id].fd		= fd;
+	sources[id].reap	= reap;
+	sources[id].arg		= arg;
+
+	r = disk_completion__arm(EPOLL_CTL_ADD, id);
+	if (r < 0) {
+		r = -errno;
+		sources[id].reap = NULL;
+		goto out;
+	}
+
+	r = id;
+out:
+	mutex_unlock(&completion_mutex);
+
+	return r;
+}
+
+/* Once this returns, reap won't be called again nor is it running */
+void disk_completion__del(int id)
+{
+	struct disk_completion *c;
+
+	if (id < 0)
+		return;
+
+	c = &sources[id];
+
+	mutex_lock(&completion_mutex);
+
+	c->reap = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+
+	while (c->busy)
+		pthread_cond_wait(&completion_cond, &completion_mutex);
+
+	c->gen++;
+
+	mutex_unlock(&completion_mutex);
+}
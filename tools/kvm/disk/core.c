@@ -1,31 +1,35 @@
 #include "kvm/disk-image.h"
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
+#include "kvm/mutex.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <sys/eventfd.h>
 #include <sys/poll.h>
 
-#define AIO_MAX 32
+#define AIO_MAX 256
 
 int debug_iodelay;
 
 #ifdef CONFIG_HAS_AIO
-static void *disk_image__thread(void *param)
+/* Called from the completion pool whenever the eventfd is signalled */
+static void disk_image__aio_reap(void *param)
 {
 	struct disk_image *disk = param;
-	struct io_event event[AIO_MAX];
+	struct io_event event[64];
 	struct timespec notime = {0};
 	int nr, i;
 	u64 dummy;
 
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
+	if (read(disk->evt, &dummy, sizeof(dummy)) < 0)
+		return;
+
+	do {
+		nr = io_getevents(disk->ctx, 0, ARRAY_SIZE(event), event, &notime);
 		for (i = 0; i < nr; i++)
 			disk->disk_req_cb(event[i].data, event[i].res);
-	}
-
-	return NULL;
+	} while (nr == ARRAY_SIZE(event));
 }
 #endif
 
@@ -44,6 +48,10 @@ struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operation
 		.ops	= ops,
 	};
 
+	mutex_init(&disk->flush_mutex);
+	pthread_cond_init(&disk->flush_cond, NULL);
+	mutex_init(&disk->stats_mutex);
+
 	if (use_mmap == DISK_IMAGE_MMAP) {
 		/*
 		 * The write to disk image will be discarded
@@ -57,62 +65,112 @@ struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operation
 	}
 
 #ifdef CONFIG_HAS_AIO
-	if (disk) {
-		pthread_t thread;
-
-		disk->evt = eventfd(0, 0);
-		io_setup(AIO_MAX, &disk->ctx);
-		r = pthread_create(&thread, NULL, disk_image__thread, disk);
-		if (r) {
-			r = -errno;
-			free(disk);
-			return ERR_PTR(r);
-		}
+	disk->evt = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	io_setup(AIO_MAX, &disk->ctx);
+	disk->aio_completion = disk_completion__add(disk->evt, disk_image__aio_reap, disk);
+	if (disk->aio_completion < 0) {
+		r = disk->aio_completion;
+		io_destroy(disk->ctx);
+		close(disk->evt);
+		free(disk);
+		return ERR_PTR(r);
 	}
 #endif
 	return disk;
 }
 
-struct disk_image *disk_image__open(const char *filename, bool readonly)
+/*
+ * cache=none only applies to images read and written in place, not to those
+ * behind a copy-on-write overlay. Unaligned requests are bounced through
+ * pread/pwrite on the image fd, which therefore has to be writable, and
+ * images served from a private mapping would never see the page cache
+ * bypassed.
+ */
+static struct disk_image *disk_image__set_direct(struct disk_image *disk,
+						 struct disk_image_params *params)
+{
+	int flags, r;
+
+	if (!params->direct)
+		return disk;
+
+	if (params->readonly || params->cow) {
+		pr_warning("Ignoring cache=none for read-only image %s", params->filename);
+		return disk;
+	}
+
+	flags = fcntl(disk->fd, F_GETFL);
+	if (flags < 0 || (flags & O_ACCMODE) != O_RDWR ||
+	    disk->ops->read_sector == raw_image__read_sector_mmap) {
+		pr_warning("cache=none needs %s to be opened read-write, without mmap",
+			   params->filename);
+		disk_image__close(disk);
+		return ERR_PTR(-EINVAL);
+	}
+
+	r = disk_direct__init(disk);
+	if (r < 0) {
+		pr_warning("Unable to open %s with O_DIRECT: %s", params->filename,
+			   strerror(-r));
+		disk_image__close(disk);
+		return ERR_PTR(r);
+	}
+
+	return disk;
+}
+
+struct disk_image *disk_image__open(struct disk_image_params *params)
 {
 	struct disk_image *disk;
 	struct stat st;
 	int fd;
 
-	if (stat(filename, &st) < 0)
+	if (stat(params->filename, &st) < 0)
 		return ERR_PTR(-errno);
 
 	/* blk device ?*/
-	disk = blkdev__probe(filename, &st);
+	disk = blkdev__probe(params, &st);
 	if (!IS_ERR_OR_NULL(disk))
-		return disk;
+		return disk_image__set_direct(disk, params);
 
-	fd = open(filename, readonly ? O_RDONLY : O_RDWR);
+	fd = open(params->filename, params->readonly ? O_RDONLY : O_RDWR);
 	if (fd < 0)
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
-	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
+	disk = qcow_probe(fd, params);
+	if (IS_ERR(disk))
+		goto err_close;
+	if (disk) {
+		if (params->cow)
+			pr_warning("Ignoring overlay for QCOW image %s", params->filename);
+		if (params->direct)
+			pr_warning("Ignoring cache=none for QCOW image %s", params->filename);
 		return disk;
 	}
 
 	/* raw image ?*/
-	disk = raw_image__probe(fd, &st, readonly);
+	disk = raw_image__probe(fd, &st, params);
 	if (!IS_ERR_OR_NULL(disk))
-		return disk;
+		return disk_image__set_direct(disk, params);
 
+	disk = ERR_PTR(-ENOSYS);
+err_close:
 	if (close(fd) < 0)
 		pr_warning("close() failed");
 
-	return ERR_PTR(-ENOSYS);
+	return disk;
 }
 
-struct disk_image **disk_image__open_all(const char **filenames, bool *readonly, int count)
+static bool disk_image__throttled(struct disk_throttle_limits *limits)
+{
+	return limits->iops || limits->bps;
+}
+
+struct disk_image **disk_image__open_all(struct disk_image_params *params, int count)
 {
 	struct disk_image **disks;
-	int i;
+	int i, r;
 	void *err;
 
 	if (!count)
@@ -125,15 +183,39 @@ struct disk_image **disk_image__open_all(const char **filenames, bool *readonly,
 		return ERR_PTR(-ENOMEM);
 
 	for (i = 0; i < count; i++) {
-		if (!filenames[i])
+		if (!params[i].filename)
 			continue;
 
-		disks[i] = disk_image__open(filenames[i], readonly[i]);
+		disks[i] = disk_image__open(&params[i]);
 		if (IS_ERR_OR_NULL(disks[i])) {
-			pr_err("Loading disk image '%s' failed", filenames[i]);
+			pr_err("Loading disk image '%s' failed", params[i].filename);
 			err = disks[i];
 			goto error;
 		}
+		disks[i]->nr_queues = params[i].nr_queues;
+
+		if (params[i].prefetch) {
+			r = disk_prefetch__replay(disks[i], params[i].prefetch);
+			if (r < 0)
+				pr_warning("Not reading ahead '%s' from %s: %s",
+					   params[i].filename, params[i].prefetch, strerror(-r));
+		}
+
+		if (params[i].record &&
+		    disk_prefetch__record(disks[i], params[i].record, params[i].record_secs) < 0) {
+			pr_err("Unable to record reads of disk image '%s'", params[i].filename);
+			err = ERR_PTR(-ENOMEM);
+			goto error;
+		}
+
+		if (!disk_image__throttled(&params[i].throttle))
+			continue;
+
+		if (disk_throttle__set(disks[i], &params[i].throttle) < 0) {
+			pr_err("Unable to throttle disk image '%s'", params[i].filename);
+			err = ERR_PTR(-ENOMEM);
+			goto error;
+		}
 	}
 
 	return disks;
@@ -146,12 +228,140 @@ error:
 	return err;
 }
 
-int disk_image__flush(struct disk_image *disk)
+static void disk_image__stat_lat(u64 *hist, u64 *total, u64 start, u64 end)
+{
+	u64 us = (end - start) / 1000;
+	int bucket;
+
+	bucket = us ? 64 - __builtin_clzll(us) : 0;
+	hist[min(bucket, DISK_STAT_BUCKETS - 1)]++;
+	*total += us;
+}
+
+static int disk_image__do_flush(struct disk_image *disk)
 {
 	if (disk->ops->flush)
 		return disk->ops->flush(disk);
 
-	return fsync(disk->fd);
+	/* File size changes needed to read the data back are synced as well */
+	return fdatasync(disk->fd);
+}
+
+/*
+ * Flushes are group committed: only one runs at a time, and those which come
+ * in meanwhile wait for it to end, then share the next one. That one starts
+ * after every write completed before they came in, which is all a flush has
+ * to cover.
+ */
+int disk_image__flush(struct disk_image *disk)
+{
+	struct disk_stats_op *stat = &disk->stats.op[DISK_STAT_FLUSH];
+	u64 start, seq;
+	int r;
+
+	start = disk_image__time_ns();
+
+	mutex_lock(&disk->flush_mutex);
+
+	/* The flush in progress may have started before our writes completed */
+	seq = disk->flush_seq + disk->flushing + 1;
+
+	while (disk->flush_seq < seq) {
+		if (disk->flushing) {
+			pthread_cond_wait(&disk->flush_cond, &disk->flush_mutex);
+			continue;
+		}
+
+		disk->flushing = true;
+		mutex_unlock(&disk->flush_mutex);
+
+		r = disk_image__do_flush(disk);
+
+		mutex_lock(&disk->flush_mutex);
+		disk->flushing = false;
+		disk->flush_seq++;
+		if (r < 0) {
+			disk->flush_err		= r;
+			disk->flush_err_seq	= disk->flush_seq;
+		}
+		pthread_cond_broadcast(&disk->flush_cond);
+	}
+
+	/* Later flushes succeeding doesn't bring back what a failed one lost */
+	r = disk->flush_err_seq >= seq ? disk->flush_err : 0;
+
+	mutex_unlock(&disk->flush_mutex);
+
+	mutex_lock(&disk->stats_mutex);
+	stat->ops++;
+	if (r < 0)
+		stat->errors++;
+	disk_image__stat_lat(stat->lat, &stat->lat_total, start, disk_image__time_ns());
+	mutex_unlock(&disk->stats_mutex);
+
+	return r;
+}
+
+int disk_image__submit(struct disk_image *disk)
+{
+	if (disk->ops->submit)
+		return disk->ops->submit(disk);
+
+	return 0;
+}
+
+int disk_image__register_mem(struct disk_image *disk, struct kvm *kvm)
+{
+	if (disk->ops->register_mem)
+		return disk->ops->register_mem(disk, kvm);
+
+	return 0;
+}
+
+/*
+ * The AIO context is set up for AIO_MAX requests in flight, and io_submit()
+ * fails with EAGAIN past it. Users which keep more in flight say so here,
+ * before submitting anything, and get a context large enough for them.
+ */
+int disk_image__set_depth(struct disk_image *disk, u32 depth)
+{
+#ifdef CONFIG_HAS_AIO
+	io_context_t ctx = 0;
+	int r;
+
+	if (!disk->async || depth <= AIO_MAX)
+		return 0;
+
+	r = io_setup(depth, &ctx);
+	if (r < 0)
+		return r;
+
+	io_destroy(disk->ctx);
+	disk->ctx = ctx;
+#endif
+	return 0;
+}
+
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 len)
+{
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	if (len > disk->size || sector > (disk->size - len) >> SECTOR_SHIFT)
+		return -EINVAL;
+
+	return disk->ops->discard(disk, sector, len);
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len, bool unmap)
+{
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	if (len > disk->size || sector > (disk->size - len) >> SECTOR_SHIFT)
+		return -EINVAL;
+
+	return disk->ops->write_zeroes(disk, sector, len, unmap);
 }
 
 int disk_image__close(struct disk_image *disk)
@@ -160,6 +370,16 @@ int disk_image__close(struct disk_image *disk)
 	if (!disk)
 		return 0;
 
+	disk_throttle__exit(disk);
+	disk_prefetch__exit(disk);
+	disk_direct__exit(disk);
+
+#ifdef CONFIG_HAS_AIO
+	disk_completion__del(disk->aio_completion);
+	io_destroy(disk->ctx);
+	close(disk->evt);
+#endif
+
 	if (disk->ops->close)
 		return disk->ops->close(disk);
 
@@ -181,61 +401,167 @@ int disk_image__close_all(struct disk_image **disks, int count)
 	return 0;
 }
 
+static void disk_image__req_start(struct disk_image *disk, struct disk_image_req *req,
+				  int op)
+{
+	struct disk_stats *stats = &disk->stats;
+
+	if (!disk->disk_req_cb)
+		return;
+
+	req->op = op;
+
+	mutex_lock(&disk->stats_mutex);
+	stats->in_flight++;
+	stats->max_in_flight = max(stats->max_in_flight, stats->in_flight);
+	mutex_unlock(&disk->stats_mutex);
+}
+
+/* Accounts for a request the completion callback was called for */
+void disk_image__req_done(struct disk_image *disk, struct disk_image_req *req, long len)
+{
+	struct disk_stats *stats = &disk->stats;
+	struct disk_stats_op *stat;
+	u64 now;
+
+	now = disk_image__time_ns();
+
+	mutex_lock(&disk->stats_mutex);
+
+	if (req->op >= 0) {
+		stat = &stats->op[req->op];
+		stat->ops++;
+		if (len < 0)
+			stat->errors++;
+		else
+			stat->bytes += len;
+		disk_image__stat_lat(stat->lat, &stat->lat_total, req->submit, now);
+
+		stats->in_flight--;
+		req->op = -1;
+	}
+
+	if (req->kick) {
+		stats->guest_ops++;
+		disk_image__stat_lat(stats->guest_lat, &stats->guest_lat_total,
+				     req->kick, now);
+	}
+
+	mutex_unlock(&disk->stats_mutex);
+}
+
+void disk_image__get_stats(struct disk_image *disk, struct disk_stats *stats)
+{
+	mutex_lock(&disk->stats_mutex);
+	*stats = disk->stats;
+	mutex_unlock(&disk->stats_mutex);
+
+	if (disk->ops->get_stats)
+		disk->ops->get_stats(disk, stats);
+}
+
 /*
  * Fill iov with disk data, starting from sector 'sector'.
- * Return amount of bytes read.
+ * Return amount of bytes read, or 0 if the request was queued by the
+ * throttle and completes later on.
  */
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
+	disk_image__req_start(disk, param, DISK_STAT_READ);
+	disk_prefetch__log(disk, sector, iov, iovcount);
+
+	if (disk->throttle && disk_throttle__queue(disk, false, sector, iov, iovcount, param))
+		return 0;
+
+	return disk_image__do_read(disk, sector, iov, iovcount, param);
+}
+
+/*
+ * Write iov to disk, starting from sector 'sector'.
+ * Return amount of bytes written, or 0 if the request was queued by the
+ * throttle and completes later on.
+ */
+ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
+{
+	disk_image__req_start(disk, param, DISK_STAT_WRITE);
+
+	if (disk->throttle && disk_throttle__queue(disk, true, sector, iov, iovcount, param))
+		return 0;
+
+	return disk_image__do_write(disk, sector, iov, iovcount, param);
+}
+
+/* Reads from the disk, bypassing the throttle */
+ssize_t disk_image__do_read(struct disk_image *disk, u64 sector, const struct iovec *iov,
+				int iovcount, void *param)
+{
+	struct disk_image_req *req = param;
+	bool async = disk->async;
 	ssize_t total = 0;
 
+	if (disk->disk_req_cb)
+		req->submit = disk_image__time_ns();
+
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->read_sector) {
+	if (disk->direct && !disk_direct__aligned(disk, sector, iov, iovcount)) {
+		total = disk_direct__read(disk, sector, iov, iovcount);
+		async = false;
+	} else if (disk->ops->read_sector) {
 		total = disk->ops->read_sector(disk, sector, iov, iovcount, param);
-		if (total < 0) {
+		if (total < 0)
 			pr_info("disk_image__read error: total=%ld\n", (long)total);
-			return total;
-		}
 	} else {
 		/* Do nothing */
 	}
 
-	if (!disk->async && disk->disk_req_cb)
+	/*
+	 * Bounced requests, and those which failed to be queued, won't
+	 * complete asynchronously
+	 */
+	if ((!async || total < 0) && disk->disk_req_cb)
 		disk->disk_req_cb(param, total);
 
 	return total;
 }
 
-/*
- * Write iov to disk, starting from sector 'sector'.
- * Return amount of bytes written.
- */
-ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
+/* Writes to the disk, bypassing the throttle */
+ssize_t disk_image__do_write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
+	struct disk_image_req *req = param;
+	bool async = disk->async;
 	ssize_t total = 0;
 
+	if (disk->disk_req_cb)
+		req->submit = disk_image__time_ns();
+
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
-	if (disk->ops->write_sector) {
+	if (disk->direct && !disk_direct__aligned(disk, sector, iov, iovcount)) {
+		total = disk_direct__write(disk, sector, iov, iovcount);
+		async = false;
+	} else if (disk->ops->write_sector) {
 		/*
 		 * Try writev based operation first
 		 */
 
 		total = disk->ops->write_sector(disk, sector, iov, iovcount, param);
-		if (total < 0) {
+		if (total < 0)
 			pr_info("disk_image__write error: total=%ld\n", (long)total);
-			return total;
-		}
 	} else {
 		/* Do nothing */
 	}
 
-	if (!disk->async && disk->disk_req_cb)
+	/*
+	 * Bounced requests, and those which failed to be queued, won't
+	 * complete asynchronously
+	 */
+	if ((!async || total < 0) && disk->disk_req_cb)
 		disk->disk_req_cb(param, total);
 
 	return total;
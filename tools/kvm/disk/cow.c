@@ -0,0 +1,430 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/byteorder.h>
+#include <string.h>
+#include <limits.h>
+
+/*
+ * A read-only raw image with a copy-on-write overlay on top of it. Written
+ * blocks live in a sparse overlay file, at the same offset they have in the
+ * image, and a bitmap tells which blocks the overlay holds.
+ *
+ * The overlay either persists in a file of its own, where the bitmap is
+ * kept after a small header, or it is an unlinked temporary file whose
+ * contents go away with the guest.
+ */
+
+#define COW_MAGIC		"LKVMCOW"
+#define COW_VERSION		1
+
+#define COW_BLOCK_SHIFT		12
+#define COW_BLOCK_SIZE		(1ULL << COW_BLOCK_SHIFT)
+
+/* The bitmap is written back in chunks of this many bytes */
+#define COW_CHUNK_SHIFT		12
+#define COW_CHUNK_SIZE		(1ULL << COW_CHUNK_SHIFT)
+
+#define COW_BITMAP_OFFSET	4096
+#define COW_DATA_ALIGN		(1ULL << 20)
+
+struct cow_header {
+	char				magic[8];
+	u32				version;
+	u32				block_shift;
+	u64				size;
+	u64				bitmap_offset;
+	u64				data_offset;
+};
+
+struct cow_image {
+	pthread_mutex_t			mutex;
+	int				fd;
+	bool				persistent;
+
+	u64				size;
+	u64				nr_blocks;
+	u64				data_offset;
+	u64				bitmap_offset;
+	u64				bitmap_size;
+
+	/* One bit per block, set once the overlay holds the block */
+	u8				*bitmap;
+	/* One byte per chunk of the bitmap which has to be written back */
+	u8				*dirty;
+};
+
+static inline bool cow_image__test(struct cow_image *cow, u64 block)
+{
+	return cow->bitmap[block >> 3] & (1 << (block & 7));
+}
+
+/* Called with cow->mutex held */
+static void cow_image__mark(struct cow_image *cow, u64 block)
+{
+	cow->bitmap[block >> 3] |= 1 << (block & 7);
+	cow->dirty[block >> (3 + COW_CHUNK_SHIFT)] = 1;
+}
+
+static int cow_image__iov_slice(const struct iovec *iov, int iovcount, u64 skip,
+				u64 len, struct iovec *sub)
+{
+	int nr = 0;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		sub[nr].iov_base	= iov->iov_base + skip;
+		sub[nr].iov_len		= min(iov->iov_len - skip, len);
+		len			-= sub[nr].iov_len;
+		skip			= 0;
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Serve each run of blocks from wherever it lives. A block is only marked
+ * once the overlay has its data, so a racing write can't expose a hole.
+ */
+static ssize_t cow_image__read_sector(struct disk_image *disk, u64 sector,
+				      const struct iovec *iov, int iovcount, void *param)
+{
+	struct cow_image *cow = disk->priv;
+	u64 offset, total, done, len, block;
+	struct iovec *sub;
+	bool in_overlay;
+	ssize_t r;
+	int nr;
+
+	offset	= sector << SECTOR_SHIFT;
+	total	= 0;
+	for (nr = 0; nr < iovcount; nr++)
+		total += iov[nr].iov_len;
+
+	if (offset + total > cow->size)
+		return -1;
+
+	sub = malloc(iovcount * sizeof(*sub));
+	if (!sub)
+		return -1;
+
+	for (done = 0; done < total; done += len) {
+		block		= (offset + done) >> COW_BLOCK_SHIFT;
+		in_overlay	= cow_image__test(cow, block);
+
+		len = ((block + 1) << COW_BLOCK_SHIFT) - (offset + done);
+		while (done + len < total && cow_image__test(cow, ++block) == in_overlay)
+			len += COW_BLOCK_SIZE;
+		len = min(len, total - done);
+
+		nr = cow_image__iov_slice(iov, iovcount, done, len, sub);
+		if (in_overlay)
+			r = preadv_in_full(cow->fd, sub, nr, cow->data_offset + offset + done);
+		else
+			r = preadv_in_full(disk->fd, sub, nr, offset + done);
+
+		if (r != (ssize_t)len) {
+			free(sub);
+			return -1;
+		}
+	}
+
+	free(sub);
+
+	return total;
+}
+
+/* Fill a block of the overlay from the image, unless that's already done */
+static int cow_image__copy_up(struct disk_image *disk, u64 block)
+{
+	struct cow_image *cow = disk->priv;
+	u64 offset, len;
+	void *buf;
+	int r = 0;
+
+	mutex_lock(&cow->mutex);
+
+	if (cow_image__test(cow, block))
+		goto out;
+
+	buf = malloc(COW_BLOCK_SIZE);
+	if (!buf) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	offset	= block << COW_BLOCK_SHIFT;
+	len	= min(COW_BLOCK_SIZE, cow->size - offset);
+
+	if (pread_in_full(disk->fd, buf, len, offset) != (ssize_t)len ||
+	    pwrite_in_full(cow->fd, buf, len, cow->data_offset + offset) < 0)
+		r = -EIO;
+	else
+		cow_image__mark(cow, block);
+
+	free(buf);
+out:
+	mutex_unlock(&cow->mutex);
+
+	return r;
+}
+
+/*
+ * Blocks only partially covered by the write get the rest of their data
+ * from the image first. Everything in between is simply overwritten.
+ */
+static ssize_t cow_image__write_sector(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount, void *param)
+{
+	struct cow_image *cow = disk->priv;
+	u64 offset, total, first, last, block;
+	int i;
+
+	offset	= sector << SECTOR_SHIFT;
+	total	= 0;
+	for (i = 0; i < iovcount; i++)
+		total += iov[i].iov_len;
+
+	if (!total)
+		return 0;
+	if (offset + total > cow->size)
+		return -1;
+
+	first	= offset >> COW_BLOCK_SHIFT;
+	last	= (offset + total - 1) >> COW_BLOCK_SHIFT;
+
+	if ((offset & (COW_BLOCK_SIZE - 1)) && cow_image__copy_up(disk, first) < 0)
+		return -1;
+
+	if (((offset + total) & (COW_BLOCK_SIZE - 1)) && offset + total < cow->size &&
+	    cow_image__copy_up(disk, last) < 0)
+		return -1;
+
+	if (pwritev_in_full(cow->fd, iov, iovcount, cow->data_offset + offset) < 0)
+		return -1;
+
+	mutex_lock(&cow->mutex);
+	for (block = first; block <= last; block++)
+		cow_image__mark(cow, block);
+	mutex_unlock(&cow->mutex);
+
+	return total;
+}
+
+/*
+ * The data has to be stable before the bitmap claims the overlay holds it.
+ * Temporary overlays don't outlive the guest, so there's nothing to do.
+ */
+static int cow_image__flush(struct disk_image *disk)
+{
+	struct cow_image *cow = disk->priv;
+	u64 chunk, offset, len;
+	bool written = false;
+	int r = 0;
+
+	if (!cow->persistent)
+		return 0;
+
+	if (fdatasync(cow->fd) < 0)
+		return -errno;
+
+	mutex_lock(&cow->mutex);
+
+	for (chunk = 0; chunk << COW_CHUNK_SHIFT < cow->bitmap_size; chunk++) {
+		if (!cow->dirty[chunk])
+			continue;
+
+		offset	= chunk << COW_CHUNK_SHIFT;
+		len	= min(COW_CHUNK_SIZE, cow->bitmap_size - offset);
+		if (pwrite_in_full(cow->fd, cow->bitmap + offset, len,
+				   cow->bitmap_offset + offset) < 0) {
+			r = -errno;
+			break;
+		}
+
+		cow->dirty[chunk]	= 0;
+		written			= true;
+	}
+
+	mutex_unlock(&cow->mutex);
+
+	if (!r && written && fdatasync(cow->fd) < 0)
+		r = -errno;
+
+	return r;
+}
+
+static void cow_image__free(struct cow_image *cow)
+{
+	free(cow->dirty);
+	free(cow->bitmap);
+	free(cow);
+}
+
+static int cow_image__close(struct disk_image *disk)
+{
+	struct cow_image *cow = disk->priv;
+
+	if (cow_image__flush(disk) < 0)
+		pr_warning("Unable to write back the copy-on-write overlay");
+
+	close(cow->fd);
+	close(disk->fd);
+	cow_image__free(cow);
+	free(disk);
+
+	return 0;
+}
+
+static struct disk_image_operations cow_image_ops = {
+	.read_sector		= cow_image__read_sector,
+	.write_sector		= cow_image__write_sector,
+	.flush			= cow_image__flush,
+	.close			= cow_image__close,
+};
+
+/* Overlays which don't persist live next to the guest sockets */
+static int cow_image__create_temp(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%scow-XXXXXX", kvm__get_dir());
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -errno;
+
+	unlink(path);
+
+	return fd;
+}
+
+static int cow_image__load(struct cow_image *cow)
+{
+	struct cow_header h;
+
+	if (pread_in_full(cow->fd, &h, sizeof(h), 0) != sizeof(h))
+		return -EIO;
+
+	if (memcmp(h.magic, COW_MAGIC, sizeof(h.magic)) ||
+	    le32_to_cpu(h.version) != COW_VERSION ||
+	    le32_to_cpu(h.block_shift) != COW_BLOCK_SHIFT ||
+	    le64_to_cpu(h.bitmap_offset) != cow->bitmap_offset ||
+	    le64_to_cpu(h.data_offset) != cow->data_offset)
+		return -EINVAL;
+
+	if (le64_to_cpu(h.size) != cow->size) {
+		pr_warning("Overlay was made for an image of %llu bytes, not %llu",
+			   (u64)le64_to_cpu(h.size), cow->size);
+		return -EINVAL;
+	}
+
+	if (pread_in_full(cow->fd, cow->bitmap, cow->bitmap_size,
+			  cow->bitmap_offset) != (ssize_t)cow->bitmap_size)
+		return -EIO;
+
+	return 0;
+}
+
+static int cow_image__format(struct cow_image *cow)
+{
+	struct cow_header h = {
+		.magic		= COW_MAGIC,
+		.version	= cpu_to_le32(COW_VERSION),
+		.block_shift	= cpu_to_le32(COW_BLOCK_SHIFT),
+		.size		= cpu_to_le64(cow->size),
+		.bitmap_offset	= cpu_to_le64(cow->bitmap_offset),
+		.data_offset	= cpu_to_le64(cow->data_offset),
+	};
+
+	if (ftruncate(cow->fd, cow->data_offset + cow->size) < 0)
+		return -errno;
+
+	if (!cow->persistent)
+		return 0;
+
+	/* The bitmap starts out empty, which the file already is */
+	if (pwrite_in_full(cow->fd, &h, sizeof(h), 0) < 0 || fdatasync(cow->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Open the overlay named by params->cow, creating it if needed, or a
+ * temporary one if there's no name.
+ */
+struct disk_image *cow_image__probe(int fd, u64 size, struct disk_image_params *params)
+{
+	struct disk_image *disk;
+	struct cow_image *cow;
+	struct stat st;
+	int r;
+
+	cow = calloc(1, sizeof(*cow));
+	if (!cow)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&cow->mutex);
+
+	cow->size		= size;
+	cow->persistent		= params->cow != NULL;
+	cow->nr_blocks		= DIV_ROUND_UP(size, COW_BLOCK_SIZE);
+	cow->bitmap_size	= DIV_ROUND_UP(cow->nr_blocks, 8);
+	cow->bitmap_offset	= COW_BITMAP_OFFSET;
+	cow->data_offset	= ALIGN(cow->bitmap_offset + cow->bitmap_size,
+					COW_DATA_ALIGN);
+
+	cow->bitmap	= calloc(1, cow->bitmap_size);
+	cow->dirty	= calloc(1, DIV_ROUND_UP(cow->bitmap_size, COW_CHUNK_SIZE));
+	if (!cow->bitmap || !cow->dirty) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	if (cow->persistent)
+		cow->fd = open(params->cow, O_RDWR | O_CREAT, 0644);
+	else
+		cow->fd = cow_image__create_temp();
+	if (cow->fd < 0) {
+		r = cow->persistent ? -errno : cow->fd;
+		goto err_free;
+	}
+
+	if (fstat(cow->fd, &st) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	if (st.st_size)
+		r = cow_image__load(cow);
+	else
+		r = cow_image__format(cow);
+	if (r < 0)
+		goto err_close;
+
+	disk = disk_image__new(fd, size, &cow_image_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk)) {
+		r = disk ? PTR_ERR(disk) : -ENOMEM;
+		goto err_close;
+	}
+
+	disk->priv = cow;
+
+	return disk;
+
+err_close:
+	close(cow->fd);
+err_free:
+	cow_image__free(cow);
+	return ERR_PTR(r);
+}
@@ -0,0 +1,303 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+
+/*
+ * cache=none opens the image with O_DIRECT, so that guest data isn't cached
+ * a second time by the host. O_DIRECT wants buffers, offsets and lengths
+ * aligned to the logical block size of the storage. Guest requests usually
+ * are, and go to the backend untouched. Those which aren't are copied
+ * through a bounce buffer from a small pool, and done synchronously.
+ */
+
+#define DISK_DIRECT_BOUNCE_SIZE		(256 * 1024)
+#define DISK_DIRECT_POOL_MAX		16
+#define DISK_DIRECT_MAX_ALIGN		4096
+
+struct disk_direct {
+	u32				align;
+
+	pthread_mutex_t			mutex;
+	void				*pool[DISK_DIRECT_POOL_MAX];
+	int				nr_pool;
+
+	/*
+	 * Serializes bounced writes which only cover part of a block. Guests
+	 * are told about the block size and don't send those anyway.
+	 */
+	pthread_mutex_t			rmw_mutex;
+};
+
+static void *disk_direct__get_buf(struct disk_direct *dd)
+{
+	void *buf = NULL;
+
+	mutex_lock(&dd->mutex);
+	if (dd->nr_pool)
+		buf = dd->pool[--dd->nr_pool];
+	mutex_unlock(&dd->mutex);
+
+	if (!buf && posix_memalign(&buf, DISK_DIRECT_MAX_ALIGN, DISK_DIRECT_BOUNCE_SIZE))
+		return NULL;
+
+	return buf;
+}
+
+static void disk_direct__put_buf(struct disk_direct *dd, void *buf)
+{
+	mutex_lock(&dd->mutex);
+	if (dd->nr_pool < DISK_DIRECT_POOL_MAX) {
+		dd->pool[dd->nr_pool++] = buf;
+		buf = NULL;
+	}
+	mutex_unlock(&dd->mutex);
+
+	free(buf);
+}
+
+/* Copies len bytes between buf and iov, starting skip bytes into iov */
+static void disk_direct__copy(const struct iovec *iov, int iovcount, u64 skip,
+			      void *buf, u64 len, bool to_iov)
+{
+	u64 n;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		n = min(len, iov->iov_len - skip);
+		if (to_iov)
+			memcpy(iov->iov_base + skip, buf, n);
+		else
+			memcpy(buf, iov->iov_base + skip, n);
+
+		buf	+= n;
+		len	-= n;
+		skip	= 0;
+	}
+}
+
+static u64 disk_direct__iov_size(const struct iovec *iov, int iovcount)
+{
+	u64 len = 0;
+
+	while (iovcount--)
+		len += (iov++)->iov_len;
+
+	return len;
+}
+
+bool disk_direct__aligned(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			  int iovcount)
+{
+	unsigned long mask = disk->direct->align - 1;
+	int i;
+
+	if ((sector << SECTOR_SHIFT) & mask)
+		return false;
+
+	for (i = 0; i < iovcount; i++)
+		if (((unsigned long)iov[i].iov_base | iov[i].iov_len) & mask)
+			return false;
+
+	return true;
+}
+
+/*
+ * Bounced requests go straight to the image file, which is fine as cache=none
+ * is only offered for images laid out like raw ones.
+ */
+ssize_t disk_direct__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			  int iovcount)
+{
+	struct disk_direct *dd = disk->direct;
+	u64 offset, len, start, end, pos, chunk, lo, hi;
+	ssize_t total, nr;
+	void *buf;
+
+	offset	= sector << SECTOR_SHIFT;
+	len	= disk_direct__iov_size(iov, iovcount);
+	total	= len;
+	start	= offset & ~((u64)dd->align - 1);
+	end	= ALIGN(offset + len, dd->align);
+
+	buf = disk_direct__get_buf(dd);
+	if (!buf)
+		return -ENOMEM;
+
+	for (pos = start; pos < end; pos += chunk) {
+		chunk	= min(end - pos, (u64)DISK_DIRECT_BOUNCE_SIZE);
+		lo	= max(pos, offset);
+		hi	= min(pos + chunk, offset + len);
+
+		/* The image may end in the middle of the last block */
+		nr = pread_in_full(disk->fd, buf, chunk, pos);
+		if (nr < 0 || (u64)nr < hi - pos) {
+			total = nr < 0 ? -errno : -EIO;
+			break;
+		}
+
+		disk_direct__copy(iov, iovcount, lo - offset, buf + lo - pos, hi - lo, true);
+	}
+
+	disk_direct__put_buf(dd, buf);
+
+	return total;
+}
+
+ssize_t disk_direct__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			   int iovcount)
+{
+	struct disk_direct *dd = disk->direct;
+	u64 offset, len, start, end, pos, chunk, lo, hi;
+	ssize_t total;
+	bool partial;
+	void *buf;
+
+	offset	= sector << SECTOR_SHIFT;
+	len	= disk_direct__iov_size(iov, iovcount);
+	total	= len;
+	start	= offset & ~((u64)dd->align - 1);
+	end	= ALIGN(offset + len, dd->align);
+	partial	= start != offset || end != offset + len;
+
+	buf = disk_direct__get_buf(dd);
+	if (!buf)
+		return -ENOMEM;
+
+	if (partial)
+		mutex_lock(&dd->rmw_mutex);
+
+	for (pos = start; pos < end; pos += chunk) {
+		chunk	= min(end - pos, (u64)DISK_DIRECT_BOUNCE_SIZE);
+		lo	= max(pos, offset);
+		hi	= min(pos + chunk, offset + len);
+
+		/* Fill in the rest of the blocks at either end first */
+		if (lo != pos || hi != pos + chunk) {
+			memset(buf, 0, chunk);
+			if (pread_in_full(disk->fd, buf, chunk, pos) < 0) {
+				total = -errno;
+				break;
+			}
+		}
+
+		disk_direct__copy(iov, iovcount, lo - offset, buf + lo - pos, hi - lo, false);
+
+		if (pwrite_in_full(disk->fd, buf, chunk, pos) < 0) {
+			total = -errno;
+			break;
+		}
+	}
+
+	if (partial)
+		mutex_unlock(&dd->rmw_mutex);
+
+	disk_direct__put_buf(dd, buf);
+
+	return total;
+}
+
+/*
+ * Block devices tell their logical block size, files don't: find the
+ * smallest read which O_DIRECT lets through.
+ */
+static int disk_direct__probe_align(int fd, u32 *align)
+{
+	struct stat st;
+	void *buf;
+	int size;
+	u32 a;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKSSZGET, &size) < 0)
+			return -errno;
+
+		*align = size;
+		return 0;
+	}
+
+	if (posix_memalign(&buf, DISK_DIRECT_MAX_ALIGN, DISK_DIRECT_MAX_ALIGN))
+		return -ENOMEM;
+
+	for (a = SECTOR_SIZE; a <= DISK_DIRECT_MAX_ALIGN; a <<= 1) {
+		if (pread(fd, buf, a, 0) >= 0 || errno != EINVAL)
+			break;
+	}
+
+	free(buf);
+
+	if (a > DISK_DIRECT_MAX_ALIGN)
+		return -EINVAL;
+
+	*align = a;
+	return 0;
+}
+
+int disk_direct__init(struct disk_image *disk)
+{
+	struct disk_direct *dd;
+	int flags, r;
+
+	flags = fcntl(disk->fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+
+	if (fcntl(disk->fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -errno;
+
+	dd = calloc(1, sizeof(*dd));
+	if (!dd) {
+		r = -ENOMEM;
+		goto err_flags;
+	}
+
+	r = disk_direct__probe_align(disk->fd, &dd->align);
+	if (r < 0)
+		goto err_free;
+
+	if (dd->align < SECTOR_SIZE || dd->align > DISK_DIRECT_MAX_ALIGN ||
+	    dd->align & (dd->align - 1)) {
+		r = -EINVAL;
+		goto err_free;
+	}
+
+	mutex_init(&dd->mutex);
+	mutex_init(&dd->rmw_mutex);
+
+	disk->direct = dd;
+
+	return 0;
+
+err_free:
+	free(dd);
+err_flags:
+	fcntl(disk->fd, F_SETFL, flags);
+	return r;
+}
+
+/* The block size guests should use so their requests need no bouncing */
+u32 disk_direct__block_size(struct disk_image *disk)
+{
+	return disk->direct ? disk->direct->align : SECTOR_SIZE;
+}
+
+void disk_direct__exit(struct disk_image *disk)
+{
+	struct disk_direct *dd = disk->direct;
+
+	if (!dd)
+		return;
+
+	while (dd->nr_pool)
+		free(dd->pool[--dd->nr_pool]);
+
+	disk->direct = NULL;
+	free(dd);
+}
@@ -0,0 +1,332 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <stdio.h>
+
+/*
+ * Boot time readahead. While recording, the sector ranges the guest reads
+ * during its first seconds are logged, in the order they are first read, and
+ * written out to a file with one "<sector> <sectors>" pair per line. Booting
+ * off the same image later, the ranges in that file are read ahead from a
+ * thread of their own as soon as the image is opened, so that the guest's
+ * small reads find their data cached.
+ */
+
+#define DISK_PREFETCH_RECORD_SECS	30
+/* Ranges beyond this many aren't recorded */
+#define DISK_PREFETCH_MAX_RANGES	65536
+/* Ranges closer than this are read ahead as one */
+#define DISK_PREFETCH_MERGE_GAP		((128 * 1024) >> SECTOR_SHIFT)
+#define DISK_PREFETCH_MAX_MERGE		((4 * 1024 * 1024) >> SECTOR_SHIFT)
+/* Chunk size for images which are read ahead through the backend */
+#define DISK_PREFETCH_BUF_SIZE		(1024 * 1024)
+
+struct disk_prefetch_range {
+	u64				sector;
+	u64				nr;
+};
+
+struct disk_prefetch {
+	pthread_mutex_t			mutex;
+
+	/* Recording */
+	bool				recording;
+	const char			*record_path;
+	u64				record_end;
+	struct disk_prefetch_range	*ranges;
+	int				nr_ranges;
+
+	/* Replay */
+	bool				replaying;
+	bool				stop;
+	pthread_t			thread;
+	struct disk_prefetch_range	*replay;
+	int				nr_replay;
+};
+
+static struct disk_prefetch *disk_prefetch__get(struct disk_image *disk)
+{
+	struct disk_prefetch *p = disk->prefetch;
+
+	if (p)
+		return p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	mutex_init(&p->mutex);
+	disk->prefetch = p;
+
+	return p;
+}
+
+static int disk_prefetch__save(const char *path, struct disk_prefetch_range *ranges, int nr)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -errno;
+
+	for (i = 0; i < nr; i++)
+		fprintf(f, "%llu %llu\n", ranges[i].sector, ranges[i].nr);
+
+	if (fclose(f))
+		return -errno;
+
+	return 0;
+}
+
+/* Ends the recording, and writes it out */
+static void disk_prefetch__record_end(struct disk_prefetch *p)
+{
+	struct disk_prefetch_range *ranges;
+	int nr, r;
+
+	mutex_lock(&p->mutex);
+	if (!p->recording) {
+		mutex_unlock(&p->mutex);
+		return;
+	}
+
+	p->recording	= false;
+	ranges		= p->ranges;
+	nr		= p->nr_ranges;
+	p->ranges	= NULL;
+	p->nr_ranges	= 0;
+	mutex_unlock(&p->mutex);
+
+	r = disk_prefetch__save(p->record_path, ranges, nr);
+	if (r < 0)
+		pr_warning("Unable to save disk reads to %s: %s", p->record_path,
+			   strerror(-r));
+	else
+		pr_info("Saved %d disk read ranges to %s", nr, p->record_path);
+
+	free(ranges);
+}
+
+int disk_prefetch__record(struct disk_image *disk, const char *path, int secs)
+{
+	struct disk_prefetch *p;
+
+	if (!secs)
+		secs = DISK_PREFETCH_RECORD_SECS;
+
+	p = disk_prefetch__get(disk);
+	if (!p)
+		return -ENOMEM;
+
+	p->ranges = calloc(DISK_PREFETCH_MAX_RANGES, sizeof(*p->ranges));
+	if (!p->ranges)
+		return -ENOMEM;
+
+	p->record_path	= path;
+	p->record_end	= disk_image__time_ns() + secs * 1000000000ULL;
+	p->recording	= true;
+
+	return 0;
+}
+
+/* Called for every guest read */
+void disk_prefetch__log(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			int iovcount)
+{
+	struct disk_prefetch *p = disk->prefetch;
+	struct disk_prefetch_range *last;
+	u64 nr = 0;
+	int i;
+
+	if (!p || !p->recording)
+		return;
+
+	if (disk_image__time_ns() >= p->record_end) {
+		disk_prefetch__record_end(p);
+		return;
+	}
+
+	for (i = 0; i < iovcount; i++)
+		nr += iov[i].iov_len;
+	nr = DIV_ROUND_UP(nr, SECTOR_SIZE);
+
+	mutex_lock(&p->mutex);
+
+	if (!p->recording)
+		goto out;
+
+	/* Sequential reads extend the range they follow */
+	last = p->nr_ranges ? &p->ranges[p->nr_ranges - 1] : NULL;
+	if (last && sector == last->sector + last->nr)
+		last->nr += nr;
+	else if (p->nr_ranges < DISK_PREFETCH_MAX_RANGES)
+		p->ranges[p->nr_ranges++] = (struct disk_prefetch_range) {
+			.sector	= sector,
+			.nr	= nr,
+		};
+
+out:
+	mutex_unlock(&p->mutex);
+}
+
+/* Read through the backend, which also warms up its own caches */
+static int disk_prefetch__read(struct disk_image *disk, u64 sector, u64 len)
+{
+	struct disk_prefetch *p = disk->prefetch;
+	struct iovec iov;
+	void *buf;
+	u64 chunk;
+	int r = 0;
+
+	buf = malloc(DISK_PREFETCH_BUF_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	for (; len && !p->stop; len -= chunk) {
+		chunk = min(len, (u64)DISK_PREFETCH_BUF_SIZE);
+		iov = (struct iovec) {
+			.iov_base	= buf,
+			.iov_len	= chunk,
+		};
+
+		if (disk->ops->read_sector(disk, sector, &iov, 1, NULL) < 0) {
+			r = -EIO;
+			break;
+		}
+
+		sector += chunk >> SECTOR_SHIFT;
+	}
+
+	free(buf);
+
+	return r;
+}
+
+static void *disk_prefetch__thread(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_prefetch *p = disk->prefetch;
+	struct disk_prefetch_range *range;
+	u64 len;
+	int i, r;
+
+	for (i = 0; i < p->nr_replay && !p->stop; i++) {
+		range	= &p->replay[i];
+		len	= range->nr << SECTOR_SHIFT;
+
+		if (disk->ops->prefetch)
+			r = disk->ops->prefetch(disk, range->sector, len);
+		else
+			r = disk_prefetch__read(disk, range->sector, len);
+
+		if (r < 0) {
+			pr_warning("Disk read ahead failed: %s", strerror(-r));
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int disk_prefetch__load(struct disk_image *disk, const char *path)
+{
+	struct disk_prefetch *p = disk->prefetch;
+	struct disk_prefetch_range *last, range;
+	u64 nr_sectors = disk->size >> SECTOR_SHIFT;
+	unsigned long long sector, nr;
+	FILE *f;
+	int r = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	p->replay = calloc(DISK_PREFETCH_MAX_RANGES, sizeof(*p->replay));
+	if (!p->replay) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	while (p->nr_replay < DISK_PREFETCH_MAX_RANGES) {
+		r = fscanf(f, "%llu %llu", &sector, &nr);
+		if (r != 2)
+			break;
+
+		if (!nr || sector >= nr_sectors || nr > nr_sectors - sector)
+			continue;
+
+		range = (struct disk_prefetch_range) {
+			.sector	= sector,
+			.nr	= nr,
+		};
+
+		/* Ranges close to the previous one are merged into it */
+		last = p->nr_replay ? &p->replay[p->nr_replay - 1] : NULL;
+		if (last && range.sector >= last->sector &&
+		    range.sector <= last->sector + last->nr + DISK_PREFETCH_MERGE_GAP &&
+		    range.sector + range.nr - last->sector <= DISK_PREFETCH_MAX_MERGE) {
+			last->nr = max(last->nr, range.sector + range.nr - last->sector);
+			continue;
+		}
+
+		p->replay[p->nr_replay++] = range;
+	}
+
+	r = (r == EOF || r == 2) ? 0 : -EINVAL;
+
+	fclose(f);
+
+	return r;
+}
+
+int disk_prefetch__replay(struct disk_image *disk, const char *path)
+{
+	struct disk_prefetch *p;
+	int r;
+
+	/* There's no page cache for it to warm up */
+	if (disk->direct)
+		return -EOPNOTSUPP;
+
+	/* Reads through the backend have to be synchronous */
+	if (!disk->ops->prefetch && disk->async)
+		return -EOPNOTSUPP;
+
+	p = disk_prefetch__get(disk);
+	if (!p)
+		return -ENOMEM;
+
+	r = disk_prefetch__load(disk, path);
+	if (r < 0)
+		return r;
+
+	r = pthread_create(&p->thread, NULL, disk_prefetch__thread, disk);
+	if (r)
+		return -r;
+
+	p->replaying = true;
+
+	return 0;
+}
+
+void disk_prefetch__exit(struct disk_image *disk)
+{
+	struct disk_prefetch *p = disk->prefetch;
+
+	if (!p)
+		return;
+
+	disk_prefetch__record_end(p);
+
+	if (p->replaying) {
+		p->stop = true;
+		pthread_join(p->thread, NULL);
+	}
+
+	disk->prefetch = NULL;
+	free(p->ranges);
+	free(p->replay);
+	free(p);
+}
@@ -3,6 +3,7 @@
 #include "kvm/disk-image.h"
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
+#include "kvm/rwsem.h"
 #include "kvm/util.h"
 
 #include <sys/types.h>
@@ -13,18 +14,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <libgen.h>
+#include <limits.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
 
 #include <linux/err.h>
+#include <linux/bitops.h>
 #include <linux/byteorder.h>
 #include <linux/kernel.h>
 #include <linux/types.h>
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
-static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
+static s64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
 
 static inline int qcow_pwrite_sync(int fd,
@@ -36,144 +40,213 @@ static inline int qcow_pwrite_sync(int fd,
 	return fdatasync(fd);
 }
 
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
-{
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
+static int write_refcount_blocks(struct qcow *q);
 
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
+/* Multiplier of the golden ratio hash, as used by the kernel's hash_64() */
+#define QCOW_CACHE_HASH_MUL	0x9e37fffffffc0001ULL
 
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+static int qcow_cache_init(struct qcow_cache *c, u32 size)
+{
+	u32 hash_bits = 1;
+
+	while ((1U << hash_bits) < size)
+		hash_bits++;
 
-		parent = *link;
+	*c = (struct qcow_cache) {
+		.hash		= calloc(1 << hash_bits, sizeof(struct hlist_head)),
+		.hash_bits	= hash_bits,
+		.slots		= calloc(size, sizeof(struct qcow_cache_node *)),
+		.size		= size,
+	};
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
+	if (!c->hash || !c->slots) {
+		free(c->hash);
+		free(c->slots);
+		*c = (struct qcow_cache) { };
+		return -1;
 	}
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
 	return 0;
-error:
-	return -1;
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static void qcow_cache_exit(struct qcow_cache *c)
 {
-	struct rb_node *link = root->rb_node;
+	u32 i;
+
+	for (i = 0; i < c->size; i++)
+		free(c->slots[i]);
 
-	while (link) {
-		struct qcow_l2_table *t;
+	free(c->slots);
+	free(c->hash);
+}
 
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+static struct hlist_head *qcow_cache_bucket(struct qcow_cache *c, u64 offset)
+{
+	return &c->hash[(offset * QCOW_CACHE_HASH_MUL) >> (64 - c->hash_bits)];
+}
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
+static struct qcow_cache_node *qcow_cache_lookup(struct qcow_cache *c, u64 offset)
+{
+	struct qcow_cache_node *n;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(n, pos, qcow_cache_bucket(c, offset), hash) {
+		if (n->offset == offset) {
+			n->referenced = 1;
+			c->hits++;
+			return n;
+		}
 	}
-out:
+
+	c->misses++;
+
 	return NULL;
 }
 
-static void l1_table_free_cache(struct qcow_l1_table *l1t)
+/*
+ * Pick the node to evict once the cache is full: the hand sweeps over the
+ * slots, clearing the referenced bit of every node it passes, and stops at
+ * the first node which hasn't been looked up since the previous sweep.
+ */
+static struct qcow_cache_node *qcow_cache_victim(struct qcow_cache *c)
 {
-	struct rb_root *r = &l1t->root;
-	struct list_head *pos, *n;
-	struct qcow_l2_table *t;
+	struct qcow_cache_node *n;
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
-		list_del(pos);
-		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+	for (;;) {
+		n = c->slots[c->hand];
+		c->hand = (c->hand + 1) % c->size;
 
-		/* Free the cached node */
-		free(t);
+		if (!n->referenced)
+			return n;
+
+		n->referenced = 0;
 	}
 }
 
+/* The cache must have a free slot */
+static void qcow_cache_insert(struct qcow_cache *c, struct qcow_cache_node *n)
+{
+	u32 slot = c->hand;
+
+	while (c->slots[slot])
+		slot = (slot + 1) % c->size;
+
+	c->slots[slot] = n;
+	c->nr_cached++;
+
+	n->slot = slot;
+	n->referenced = 1;
+	hlist_add_head(&n->hash, qcow_cache_bucket(c, n->offset));
+}
+
+static void qcow_cache_remove(struct qcow_cache *c, struct qcow_cache_node *n)
+{
+	c->slots[n->slot] = NULL;
+	c->nr_cached--;
+
+	hlist_del_init(&n->hash);
+}
+
+/*
+ * L2 tables are written back lazily. An L2 table may point at clusters
+ * whose refcount was just raised, so the refcount blocks always reach the
+ * disk first.
+ */
 static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 {
 	struct qcow_header *header = q->header;
 	u64 size;
 
-	if (!c->dirty)
+	if (!c->node.dirty)
 		return 0;
 
+	if (write_refcount_blocks(q) < 0)
+		return -1;
+
 	size = 1 << header->l2_bits;
 
 	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
+		size * sizeof(u64), c->node.offset) < 0)
 		return -1;
 
-	c->dirty = 0;
+	c->node.dirty = 0;
 
 	return 0;
 }
 
-static int cache_table(struct qcow *q, struct qcow_l2_table *c)
+/* Write back every dirty L2 table, with a single sync for all of them */
+static int write_l2_tables(struct qcow *q)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
-	struct qcow_l2_table *lru;
-
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
-		/*
-		 * The node at the head of the list is least recently used
-		 * node. Remove it from the list and replaced with a new node.
-		 */
-		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
-
-		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		l1t->nr_cached--;
-
-		/* Free the LRUed node */
-		free(lru);
+	struct qcow_cache *cache = &q->table.cache;
+	struct qcow_header *header = q->header;
+	struct qcow_l2_table *c;
+	bool written = false;
+	u64 size;
+	u32 i;
+
+	if (write_refcount_blocks(q) < 0)
+		return -1;
+
+	size = 1 << header->l2_bits;
+
+	for (i = 0; i < cache->size; i++) {
+		if (!cache->slots[i] || !cache->slots[i]->dirty)
+			continue;
+
+		c = container_of(cache->slots[i], struct qcow_l2_table, node);
+		if (pwrite_in_full(q->fd, c->table, size * sizeof(u64),
+				   c->node.offset) < 0)
+			return -1;
+
+		written = true;
 	}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
+	if (written && fdatasync(q->fd) < 0)
+		return -1;
 
-	/* Add in LRU replacement list */
-	list_add_tail(&c->list, &l1t->lru_list);
-	l1t->nr_cached++;
+	for (i = 0; i < cache->size; i++)
+		if (cache->slots[i])
+			cache->slots[i]->dirty = 0;
+
+	return 0;
+}
+
+static int cache_table(struct qcow *q, struct qcow_l2_table *c)
+{
+	struct qcow_cache *cache = &q->table.cache;
+	struct qcow_l2_table *victim;
+
+	if (cache->nr_cached == cache->size) {
+		victim = container_of(qcow_cache_victim(cache),
+				      struct qcow_l2_table, node);
+
+		/* Write the node back before it's replaced */
+		if (qcow_l2_cache_write(q, victim) < 0)
+			return -1;
+
+		qcow_cache_remove(cache, &victim->node);
+		free(victim);
+	}
+
+	qcow_cache_insert(cache, &c->node);
 
 	return 0;
-error:
-	return -1;
+}
+
+static void uncache_table(struct qcow *q, struct qcow_l2_table *c)
+{
+	qcow_cache_remove(&q->table.cache, &c->node);
 }
 
 static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
 {
-	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_cache_node *n;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
-	if (!l2t)
+	n = qcow_cache_lookup(&q->table.cache, offset);
+	if (!n)
 		return NULL;
 
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&l2t->list, &l1t->lru_list);
-
-	return l2t;
+	return container_of(n, struct qcow_l2_table, node);
 }
 
 /* Allocates a new node for caching L2 table */
@@ -190,9 +263,8 @@ static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
 	if (!c)
 		goto out;
 
-	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
-	INIT_LIST_HEAD(&c->list);
+	c->node.offset = offset;
+	INIT_HLIST_NODE(&c->node.hash);
 out:
 	return c;
 }
@@ -250,6 +322,134 @@ error:
 	return NULL;
 }
 
+enum {
+	QCOW_CLUSTER_UNALLOCATED,
+	QCOW_CLUSTER_ZERO,
+	QCOW_CLUSTER_NORMAL,
+	QCOW_CLUSTER_COMPRESSED,
+};
+
+/*
+ * Look up where the cluster holding 'offset' lives in the image. Only the
+ * table walk happens under the lock, the caller does the data I/O itself.
+ */
+static int qcow_map_cluster(struct qcow *q, u64 offset, u64 *clust_start)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 l2t_offset;
+	u64 l1_idx;
+	u64 l2_idx;
+	u64 entry;
+
+	l1_idx = get_l1_index(q, offset);
+	if (l1_idx >= l1t->table_size)
+		return -1;
+
+	mutex_lock(&q->mutex);
+
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]) & ~QCOW2_OFLAG_COPIED;
+	if (!l2t_offset) {
+		mutex_unlock(&q->mutex);
+		return QCOW_CLUSTER_UNALLOCATED;
+	}
+
+	l2t = qcow_read_l2_table(q, l2t_offset);
+	if (!l2t) {
+		mutex_unlock(&q->mutex);
+		return -1;
+	}
+
+	l2_idx = get_l2_index(q, offset);
+	entry = be64_to_cpu(l2t->table[l2_idx]);
+
+	mutex_unlock(&q->mutex);
+
+	if (q->version == QCOW1_VERSION) {
+		if (entry & QCOW1_OFLAG_COMPRESSED)
+			return QCOW_CLUSTER_COMPRESSED;
+	} else {
+		if (entry & QCOW2_OFLAG_COMPRESSED)
+			return QCOW_CLUSTER_COMPRESSED;
+		if (entry & QCOW2_OFLAG_ZERO)
+			return QCOW_CLUSTER_ZERO;
+
+		entry &= QCOW2_OFFSET_MASK;
+	}
+
+	if (!entry)
+		return QCOW_CLUSTER_UNALLOCATED;
+
+	*clust_start = entry;
+
+	return QCOW_CLUSTER_NORMAL;
+}
+
+static u64 qcow_iov_size(const struct iovec *iov, int iovcount)
+{
+	u64 size = 0;
+
+	while (iovcount--)
+		size += (iov++)->iov_len;
+
+	return size;
+}
+
+/*
+ * Fill 'sub' with the part of 'iov' which is 'len' bytes long and starts
+ * 'skip' bytes into it. Returns the number of segments used.
+ */
+static int qcow_iov_slice(const struct iovec *iov, int iovcount, u64 skip,
+			  u64 len, struct iovec *sub)
+{
+	int nr = 0;
+	u64 n;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		n = min((u64)iov->iov_len - skip, len);
+		sub[nr++] = (struct iovec) {
+			.iov_base	= iov->iov_base + skip,
+			.iov_len	= n,
+		};
+
+		skip = 0;
+		len -= n;
+	}
+
+	return nr;
+}
+
+static void qcow_iov_memset(const struct iovec *iov, int iovcount, int c)
+{
+	while (iovcount--) {
+		memset(iov->iov_base, c, iov->iov_len);
+		iov++;
+	}
+}
+
+static void qcow_iov_from_buf(const struct iovec *iov, int iovcount, const void *buf)
+{
+	while (iovcount--) {
+		memcpy(iov->iov_base, buf, iov->iov_len);
+		buf += iov->iov_len;
+		iov++;
+	}
+}
+
+static void qcow_iov_to_buf(const struct iovec *iov, int iovcount, void *buf)
+{
+	while (iovcount--) {
+		memcpy(buf, iov->iov_base, iov->iov_len);
+		buf += iov->iov_len;
+		iov++;
+	}
+}
+
 static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 	const u8 *buf, int buf_size)
 {
@@ -296,7 +496,7 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int csize;
 
 	l1_idx = get_l1_index(q, offset);
@@ -381,7 +581,7 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int sector_offset;
 	int nb_csectors;
 	int csize;
@@ -440,6 +640,9 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 		memcpy(dst, q->cluster_cache + clust_offset, length);
 		mutex_unlock(&q->mutex);
 	} else {
+		if (clust_start & QCOW2_OFLAG_ZERO)
+			goto zero_cluster;
+
 		clust_start &= QCOW2_OFFSET_MASK;
 		if (!clust_start)
 			goto zero_cluster;
@@ -464,148 +667,224 @@ out_error:
 	return -1;
 }
 
-static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
+static ssize_t qcow_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
-	struct qcow *q = disk->priv;
-	struct qcow_header *header = q->header;
-	u32 nr_read;
-	u64 offset;
-	char *buf;
-	u32 nr;
-
-	buf = dst;
-	nr_read = 0;
+	if (q->version == QCOW1_VERSION)
+		return qcow1_read_cluster(q, offset, dst, dst_len);
 
-	while (nr_read < dst_len) {
-		offset = sector << SECTOR_SHIFT;
-		if (offset >= header->size)
-			return -1;
+	return qcow2_read_cluster(q, offset, dst, dst_len);
+}
 
-		if (q->version == QCOW1_VERSION)
-			nr = qcow1_read_cluster(q, offset, buf,
-				dst_len - nr_read);
-		else
-			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
+/*
+ * Read guest data from the backing image. It may be smaller than this one,
+ * anything past its end reads as zeroes.
+ */
+static int qcow_read_backing(struct qcow *q, u64 offset, const struct iovec *iov,
+			     int iovcount, u64 len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec bounce;
+	ssize_t nr;
 
-		if (nr <= 0)
-			return -1;
+	if (offset >= backing->size) {
+		qcow_iov_memset(iov, iovcount, 0);
+		return 0;
+	}
 
-		nr_read	+= nr;
-		buf	+= nr;
-		sector	+= (nr >> SECTOR_SHIFT);
+	if (offset + len <= backing->size) {
+		nr = backing->ops->read_sector(backing, offset >> SECTOR_SHIFT,
+					       iov, iovcount, NULL);
+		return nr == (ssize_t)len ? 0 : -1;
 	}
 
-	return dst_len;
+	bounce.iov_len = backing->size - offset;
+	bounce.iov_base = calloc(1, len);
+	if (!bounce.iov_base)
+		return -1;
+
+	nr = backing->ops->read_sector(backing, offset >> SECTOR_SHIFT,
+				       &bounce, 1, NULL);
+	if (nr == (ssize_t)bounce.iov_len)
+		qcow_iov_from_buf(iov, iovcount, bounce.iov_base);
+
+	free(bounce.iov_base);
+
+	return nr == (ssize_t)bounce.iov_len ? 0 : -1;
 }
 
-static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
-				const struct iovec *iov, int iovcount, void *param)
+/* Read 'len' bytes at 'start' in the image into the iov, 'done' bytes in */
+static int qcow_read_extent(struct qcow *q, const struct iovec *iov, int iovcount,
+			    struct iovec *sub, u64 done, u64 start, u64 len)
 {
-	ssize_t nr, total = 0;
+	int nr;
 
-	while (iovcount--) {
-		nr = qcow_read_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_read_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
-		}
+	if (!len)
+		return 0;
 
-		sector += iov->iov_len >> SECTOR_SHIFT;
-		total += nr;
-		iov++;
-	}
+	nr = qcow_iov_slice(iov, iovcount, done, len, sub);
+	if (preadv_in_full(q->fd, sub, nr, start) != (ssize_t)len)
+		return -1;
 
-	return total;
+	return 0;
 }
 
-static void refcount_table_free_cache(struct qcow_refcount_table *rft)
+static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
+				const struct iovec *iov, int iovcount, void *param)
 {
-	struct rb_root *r = &rft->root;
-	struct list_head *pos, *n;
-	struct qcow_refcount_block *t;
+	struct qcow *q = disk->priv;
+	struct qcow_header *header = q->header;
+	u64 ext_start = 0, ext_done = 0, ext_len = 0;
+	u64 offset, total, done, len;
+	u64 clust_start;
+	struct iovec *sub;
+	void *buf = NULL;
+	int type, nr;
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		list_del(pos);
-		t = list_entry(pos, struct qcow_refcount_block, list);
-		rb_erase(&t->node, r);
+	offset = sector << SECTOR_SHIFT;
+	total = qcow_iov_size(iov, iovcount);
+	if (offset + total > header->size)
+		return -1;
 
-		free(t);
-	}
-}
+	sub = malloc(iovcount * sizeof(*sub));
+	if (!sub)
+		return -1;
 
-static int refcount_block_insert(struct rb_root *root, struct qcow_refcount_block *new)
-{
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
+	down_read(&q->discard_lock);
 
-	/* search the tree */
-	while (*link) {
-		struct qcow_refcount_block *t;
+	for (done = 0; done < total; done += len) {
+		len = min(q->cluster_size - get_cluster_offset(q, offset + done),
+			  total - done);
 
-		t = rb_entry(*link, struct qcow_refcount_block, node);
-		if (!t)
+		type = qcow_map_cluster(q, offset + done, &clust_start);
+		if (type < 0)
 			goto error;
 
-		parent = *link;
+		if (type == QCOW_CLUSTER_NORMAL) {
+			clust_start += get_cluster_offset(q, offset + done);
+
+			/*
+			 * Clusters which follow each other in the image are
+			 * read with a single preadv().
+			 */
+			if (ext_len && ext_done + ext_len == done &&
+			    ext_start + ext_len == clust_start) {
+				ext_len += len;
+				continue;
+			}
+
+			if (qcow_read_extent(q, iov, iovcount, sub, ext_done,
+					     ext_start, ext_len) < 0)
+				goto error;
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
+			ext_start	= clust_start;
+			ext_done	= done;
+			ext_len		= len;
+			continue;
+		}
+
+		nr = qcow_iov_slice(iov, iovcount, done, len, sub);
+
+		if (type == QCOW_CLUSTER_COMPRESSED) {
+			if (!buf) {
+				buf = malloc(q->cluster_size);
+				if (!buf)
+					goto error;
+			}
+
+			if (qcow_read_cluster(q, offset + done, buf, len) < 0)
+				goto error;
+
+			qcow_iov_from_buf(sub, nr, buf);
+		} else if (type == QCOW_CLUSTER_UNALLOCATED && q->backing) {
+			if (qcow_read_backing(q, offset + done, sub, nr, len) < 0)
+				goto error;
+		} else {
+			qcow_iov_memset(sub, nr, 0);
+		}
 	}
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
+	if (qcow_read_extent(q, iov, iovcount, sub, ext_done, ext_start, ext_len) < 0)
+		goto error;
+
+	up_read(&q->discard_lock);
+	free(buf);
+	free(sub);
+
+	return total;
+
 error:
+	pr_info("qcow_read_sector error: sector=%llu len=%llu\n", sector, total);
+	up_read(&q->discard_lock);
+	free(buf);
+	free(sub);
+
 	return -1;
 }
 
 static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 {
-	if (!rfb->dirty)
+	if (!rfb->node.dirty)
 		return 0;
 
 	if (qcow_pwrite_sync(q->fd, rfb->entries,
-		rfb->size * sizeof(u16), rfb->offset) < 0)
+		rfb->size * sizeof(u16), rfb->node.offset) < 0)
 		return -1;
 
-	rfb->dirty = 0;
+	rfb->node.dirty = 0;
 
 	return 0;
 }
 
-static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
+/* Write back every dirty refcount block, with a single sync for all of them */
+static int write_refcount_blocks(struct qcow *q)
 {
-	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct rb_root *r = &rft->root;
-	struct qcow_refcount_block *lru;
+	struct qcow_cache *cache = &q->refcount_table.cache;
+	struct qcow_refcount_block *rfb;
+	bool written = false;
+	u32 i;
 
-	if (rft->nr_cached == MAX_CACHE_NODES) {
-		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
+	for (i = 0; i < cache->size; i++) {
+		if (!cache->slots[i] || !cache->slots[i]->dirty)
+			continue;
 
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		rft->nr_cached--;
+		rfb = container_of(cache->slots[i], struct qcow_refcount_block, node);
+		if (pwrite_in_full(q->fd, rfb->entries, rfb->size * sizeof(u16),
+				   rfb->node.offset) < 0)
+			return -1;
 
-		free(lru);
+		written = true;
 	}
 
-	if (refcount_block_insert(r, c) < 0)
-		goto error;
+	if (written && fdatasync(q->fd) < 0)
+		return -1;
 
-	list_add_tail(&c->list, &rft->lru_list);
-	rft->nr_cached++;
+	for (i = 0; i < cache->size; i++)
+		if (cache->slots[i])
+			cache->slots[i]->dirty = 0;
+
+	return 0;
+}
+
+static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
+{
+	struct qcow_cache *cache = &q->refcount_table.cache;
+	struct qcow_refcount_block *victim;
+
+	if (cache->nr_cached == cache->size) {
+		victim = container_of(qcow_cache_victim(cache),
+				      struct qcow_refcount_block, node);
+
+		if (write_refcount_block(q, victim) < 0)
+			return -1;
+
+		qcow_cache_remove(cache, &victim->node);
+		free(victim);
+	}
+
+	qcow_cache_insert(cache, &c->node);
 
 	return 0;
-error:
-	return -1;
 }
 
 static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset)
@@ -616,49 +895,23 @@ static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_of
 	if (!rfb)
 		return NULL;
 
-	rfb->offset = rfb_offset;
+	rfb->node.offset = rfb_offset;
+	rfb->node.dirty = 0;
 	rfb->size = q->cluster_size / sizeof(u16);
-	RB_CLEAR_NODE(&rfb->node);
-	INIT_LIST_HEAD(&rfb->list);
+	INIT_HLIST_NODE(&rfb->node.hash);
 
 	return rfb;
 }
 
-static struct qcow_refcount_block *refcount_block_lookup(struct rb_root *root, u64 offset)
-{
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(link, struct qcow_refcount_block, node);
-		if (!t)
-			goto out;
-
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
-			return t;
-	}
-out:
-	return NULL;
-}
-
 static struct qcow_refcount_block *refcount_block_search(struct qcow *q, u64 offset)
 {
-	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct qcow_refcount_block *rfb;
+	struct qcow_cache_node *n;
 
-	rfb = refcount_block_lookup(&rft->root, offset);
-	if (!rfb)
+	n = qcow_cache_lookup(&q->refcount_table.cache, offset);
+	if (!n)
 		return NULL;
 
-	/* Update the LRU state, by moving the searched node to list tail */
-	list_move_tail(&rfb->list, &rft->lru_list);
-
-	return rfb;
+	return container_of(n, struct qcow_refcount_block, node);
 }
 
 static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
@@ -667,7 +920,7 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 	struct qcow_header *header = q->header;
 	struct qcow_refcount_table *rft = &q->refcount_table;
 	struct qcow_refcount_block *rfb;
-	u64 new_block_offset;
+	s64 new_block_offset;
 	u64 rft_idx;
 
 	rft_idx = clust_idx >> (header->cluster_bits -
@@ -687,7 +940,7 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 		return NULL;
 
 	memset(rfb->entries, 0x00, q->cluster_size);
-	rfb->dirty = 1;
+	rfb->node.dirty = 1;
 
 	/* write refcount block */
 	if (write_refcount_block(q, rfb) < 0)
@@ -751,29 +1004,151 @@ error_free_rfb:
 	return NULL;
 }
 
-static u16 qcow_get_refcount(struct qcow *q, u64 clust_idx)
+static bool qcow_cluster_used(struct qcow *q, u64 clust_idx)
 {
-	struct qcow_refcount_block *rfb = NULL;
-	struct qcow_header *header = q->header;
-	u64 rfb_idx;
+	if (clust_idx >= q->nr_bitmap_bits)
+		return false;
 
-	rfb = qcow_read_refcount_block(q, clust_idx);
-	if (PTR_ERR(rfb) == -ENOSPC)
-		return 0;
-	else if (IS_ERR_OR_NULL(rfb)) {
-		pr_warning("Error while reading refcount table");
-		return -1;
+	return q->cluster_bitmap[clust_idx / BITS_PER_LONG] &
+		(1UL << (clust_idx % BITS_PER_LONG));
+}
+
+static int qcow_mark_cluster(struct qcow *q, u64 clust_idx, bool used)
+{
+	unsigned long *bitmap, *full;
+	u64 old_longs, new_longs, word;
+
+	if (clust_idx >= q->nr_bitmap_bits) {
+		if (!used)
+			return 0;
+
+		/* The image grew, so does the bitmap */
+		old_longs = BITS_TO_LONGS(q->nr_bitmap_bits);
+		new_longs = max(BITS_TO_LONGS(clust_idx + 1), old_longs * 2);
+
+		full = realloc(q->full_words, BITS_TO_LONGS(new_longs) * sizeof(long));
+		if (!full)
+			return -ENOMEM;
+
+		memset(full + BITS_TO_LONGS(old_longs), 0,
+		       (BITS_TO_LONGS(new_longs) - BITS_TO_LONGS(old_longs)) * sizeof(long));
+		q->full_words = full;
+
+		bitmap = realloc(q->cluster_bitmap, new_longs * sizeof(long));
+		if (!bitmap)
+			return -ENOMEM;
+
+		memset(bitmap + old_longs, 0, (new_longs - old_longs) * sizeof(long));
+
+		q->cluster_bitmap = bitmap;
+		q->nr_bitmap_bits = new_longs * BITS_PER_LONG;
 	}
 
-	rfb_idx = clust_idx & (((1ULL <<
-		(header->cluster_bits - QCOW_REFCOUNT_BLOCK_SHIFT)) - 1));
+	word = clust_idx / BITS_PER_LONG;
 
-	if (rfb_idx >= rfb->size) {
-		pr_warning("L1: refcount block index out of bounds");
-		return -1;
+	if (used) {
+		q->cluster_bitmap[word] |= 1UL << (clust_idx % BITS_PER_LONG);
+		if (q->cluster_bitmap[word] == ~0UL)
+			q->full_words[word / BITS_PER_LONG] |= 1UL << (word % BITS_PER_LONG);
+	} else {
+		q->cluster_bitmap[word] &= ~(1UL << (clust_idx % BITS_PER_LONG));
+		q->full_words[word / BITS_PER_LONG] &= ~(1UL << (word % BITS_PER_LONG));
 	}
 
-	return be16_to_cpu(rfb->entries[rfb_idx]);
+	return 0;
+}
+
+/*
+ * The first word of the cluster bitmap at or after 'word' with a free
+ * cluster in it, going over full_words so that a used up stretch of the
+ * image costs one test per 64 words instead of one per word.
+ */
+static u64 qcow_next_free_word(struct qcow *q, u64 word)
+{
+	u64 nr_words = q->nr_bitmap_bits / BITS_PER_LONG;
+	unsigned long free;
+
+	while (word < nr_words) {
+		/* Words not full yet, from 'word' to the end of its summary word */
+		free = ~q->full_words[word / BITS_PER_LONG] >> (word % BITS_PER_LONG);
+		if (free) {
+			word += __builtin_ctzl(free);
+			return word < nr_words ? word : nr_words;
+		}
+
+		word = (word / BITS_PER_LONG + 1) * BITS_PER_LONG;
+	}
+
+	return nr_words;
+}
+
+/*
+ * Find the first run of 'count' free clusters at or after 'start'. Fully
+ * used words of the bitmap are skipped through full_words, and the run may
+ * extend past the end of the bitmap, where everything is free.
+ */
+static u64 qcow_find_free_clusters(struct qcow *q, u64 start, u64 count)
+{
+	u64 idx = start, run = 0, word;
+
+	while (idx < q->nr_bitmap_bits) {
+		if (!run && !(idx % BITS_PER_LONG)) {
+			word = qcow_next_free_word(q, idx / BITS_PER_LONG);
+			idx = word * BITS_PER_LONG;
+			if (idx >= q->nr_bitmap_bits)
+				break;
+		}
+
+		if (qcow_cluster_used(q, idx))
+			run = 0;
+		else if (++run == count)
+			break;
+
+		idx++;
+	}
+
+	if (run == count)
+		return idx - count + 1;
+
+	return idx - run;
+}
+
+/* Scan every refcount block once, to know which clusters are in use */
+static int qcow_build_cluster_bitmap(struct qcow *q)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	u64 rfb_size = q->cluster_size / sizeof(u16);
+	u64 rfb_offset, i, j;
+	u16 *entries;
+	int r = 0;
+
+	entries = malloc(q->cluster_size);
+	if (!entries)
+		return -ENOMEM;
+
+	for (i = 0; i < rft->rf_size; i++) {
+		rfb_offset = be64_to_cpu(rft->rf_table[i]);
+		if (!rfb_offset)
+			continue;
+
+		if (pread_in_full(q->fd, entries, q->cluster_size, rfb_offset) < 0) {
+			r = -errno;
+			break;
+		}
+
+		for (j = 0; j < rfb_size; j++) {
+			if (!entries[j])
+				continue;
+
+			r = qcow_mark_cluster(q, i * rfb_size + j, true);
+			if (r < 0)
+				goto out;
+		}
+	}
+
+out:
+	free(entries);
+	return r;
 }
 
 static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
@@ -804,13 +1179,10 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 
 	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
-	rfb->dirty = 1;
+	rfb->node.dirty = 1;
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
+	if (qcow_mark_cluster(q, clust_idx, refcount != 0) < 0)
 		return -1;
-	}
 
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
@@ -824,6 +1196,15 @@ static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
 	struct qcow_header *header = q->header;
 	u64 start, end, offset;
 
+	/*
+	 * Whatever stopped pointing at these clusters has to be on disk
+	 * before they can be reused, or a crash could leave two owners.
+	 */
+	if (write_l2_tables(q) < 0) {
+		pr_warning("Unable to write L2 tables, leaking clusters");
+		return;
+	}
+
 	start = clust_start & ~(q->cluster_size - 1);
 	end = (clust_start + size - 1) & ~(q->cluster_size - 1);
 	for (offset = start; offset <= end; offset += q->cluster_size)
@@ -831,38 +1212,37 @@ static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
 }
 
 /*
- * Allocate clusters according to the size. Find a postion that
- * can satisfy the size. free_clust_idx is initialized to zero and
- * Record last position.
+ * Allocate clusters according to the size, as a single contiguous run.
+ * free_clust_idx is the lowest cluster which may be free, the search for
+ * a run starts there.
  */
-static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
+static s64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref)
 {
 	struct qcow_header *header = q->header;
-	u16 clust_refcount;
-	u32 clust_idx = 0, i;
+	u64 clust_idx, i;
 	u64 clust_num;
 
 	clust_num = (size + (q->cluster_size - 1)) >> header->cluster_bits;
 
-again:
-	for (i = 0; i < clust_num; i++) {
-		clust_idx = q->free_clust_idx++;
-		clust_refcount = qcow_get_refcount(q, clust_idx);
-		if (clust_refcount < 0)
+	clust_idx = qcow_find_free_clusters(q, q->free_clust_idx, clust_num);
+
+	/*
+	 * Claim the clusters even if the refcount isn't updated yet, as the
+	 * caller may allocate more before it is.
+	 */
+	for (i = 0; i < clust_num; i++)
+		if (qcow_mark_cluster(q, clust_idx + i, true) < 0)
 			return -1;
-		else if (clust_refcount > 0)
-			goto again;
-	}
 
-	clust_idx++;
+	if (clust_idx == q->free_clust_idx)
+		q->free_clust_idx = clust_idx + clust_num;
 
 	if (update_ref)
 		for (i = 0; i < clust_num; i++)
-			if (update_cluster_refcount(q,
-				clust_idx - clust_num + i, 1))
+			if (update_cluster_refcount(q, clust_idx + i, 1))
 				return -1;
 
-	return (clust_idx - clust_num) << header->cluster_bits;
+	return clust_idx << header->cluster_bits;
 }
 
 static int qcow_write_l1_table(struct qcow *q)
@@ -888,12 +1268,12 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
+	struct qcow_l2_table *l2t, *old;
 	u64 l1t_idx;
 	u64 l2t_offset;
 	u64 l2t_idx;
 	u64 l2t_size;
-	u64 l2t_new_offset;
+	s64 l2t_new_offset;
 
 	l2t_size = 1 << header->l2_bits;
 
@@ -923,31 +1303,40 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			goto free_cluster;
 
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
+			old = qcow_read_l2_table(q, l2t_offset);
+			if (!old)
 				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
+
+			memcpy(l2t->table, old->table, l2t_size * sizeof(u64));
+
+			/* The shared table is never written to, drop it */
+			uncache_table(q, old);
+			free(old);
+		}
 
 		/* write l2 table */
-		l2t->dirty = 1;
+		l2t->node.dirty = 1;
 		if (qcow_l2_cache_write(q, l2t) < 0)
 			goto free_cache;
 
-		/* cache l2 table */
-		if (cache_table(q, l2t))
-			goto free_cache;
-
-		/* update the l1 talble */
+		/* update the l1 table */
 		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
 			| QCOW2_OFLAG_COPIED);
 		if (qcow_write_l1_table(q)) {
 			pr_warning("Update l1 table error");
+			l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_offset);
 			goto free_cache;
 		}
 
+		/* cache l2 table */
+		if (cache_table(q, l2t)) {
+			free(l2t);
+			goto error;
+		}
+
 		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		if (l2t_offset)
+			qcow_free_clusters(q, l2t_offset, q->cluster_size);
 	}
 
 	*result_l2t = l2t;
@@ -965,31 +1354,52 @@ error:
 	return -1;
 }
 
+static void qcow_free_cluster_entry(struct qcow *q, u64 entry)
+{
+	u64 size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((entry >> q->csize_shift) & q->csize_mask) + 1;
+		size *= SECTOR_SIZE;
+
+		entry &= q->cluster_offset_mask;
+		entry &= ~(SECTOR_SIZE - 1);
+
+		qcow_free_clusters(q, entry, size);
+	} else if (entry & QCOW2_OFFSET_MASK) {
+		qcow_free_clusters(q, entry & QCOW2_OFFSET_MASK, q->cluster_size);
+	}
+}
+
+/* Whether the cluster can be written to in place */
+static inline bool qcow_cluster_copied(u64 entry)
+{
+	return (entry & QCOW2_OFLAG_COPIED) &&
+		!(entry & (QCOW2_OFLAG_COMPRESSED | QCOW2_OFLAG_ZERO));
+}
+
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * If the cluster has been copied, write data directly. If not, allocate a
+ * new cluster, fill it with the original data and the modification, and
+ * only then point the L2 table at it.
+ *
+ * The lock is dropped while data is moved around, so another writer may
+ * have mapped the cluster in the meantime. In that case our copy is thrown
+ * away and the write is retried against the cluster the other writer
+ * installed.
  */
 static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
-		void *buf, u32 src_len)
+		const struct iovec *iov, int iovcount, u64 len)
 {
 	struct qcow_l2_table *l2t;
-	u64 clust_new_start;
+	s64 clust_new_start;
 	u64 clust_start;
-	u64 clust_flags;
 	u64 clust_off;
 	u64 l2t_idx;
-	u64 len;
-
-	l2t = NULL;
+	u64 entry;
+	void *buf;
 
 	clust_off = get_cluster_offset(q, offset);
-	if (clust_off >= q->cluster_size)
-		return -1;
-
-	len = q->cluster_size - clust_off;
-	if (len > src_len)
-		len = src_len;
 
 	mutex_lock(&q->mutex);
 
@@ -998,165 +1408,452 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 		goto error;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
+	entry = be64_to_cpu(l2t->table[l2t_idx]);
+	if (qcow_cluster_copied(entry)) {
+		clust_start = entry & QCOW2_OFFSET_MASK;
+		mutex_unlock(&q->mutex);
 
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start < 0) {
-			pr_warning("Cluster alloc error");
-			goto error;
-		}
+		/* Write actual data */
+		if (pwritev_in_full(q->fd, iov, iovcount, clust_start + clust_off) < 0)
+			return -1;
 
-		offset &= ~(q->cluster_size - 1);
+		return len;
+	}
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+	clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
+	if (clust_new_start < 0) {
+		pr_warning("Cluster alloc error");
+		goto error;
+	}
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	mutex_unlock(&q->mutex);
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
+	buf = malloc(q->cluster_size);
+	if (!buf)
+		goto free_cluster_unlocked;
+
+	/* Preserve whatever part of the cluster this write doesn't cover */
+	if (len == q->cluster_size) {
+		/* Nothing to preserve */
+	} else if ((entry & QCOW2_OFLAG_COMPRESSED) ||
+		   ((entry & QCOW2_OFFSET_MASK) && !(entry & QCOW2_OFLAG_ZERO))) {
+		if (qcow2_read_cluster(q, offset & ~(q->cluster_size - 1),
+				       buf, q->cluster_size) < 0) {
+			pr_warning("Read copy cluster error");
+			goto free_buf;
+		}
+	} else if (!(entry & QCOW2_OFLAG_ZERO) && q->backing) {
+		struct iovec backing_iov = {
+			.iov_base	= buf,
+			.iov_len	= q->cluster_size,
+		};
+
+		if (qcow_read_backing(q, offset & ~(q->cluster_size - 1),
+				      &backing_iov, 1, q->cluster_size) < 0) {
+			pr_warning("Read backing cluster error");
+			goto free_buf;
+		}
+	} else {
+		memset(buf, 0x00, q->cluster_size);
+	}
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+	qcow_iov_to_buf(iov, iovcount, buf + clust_off);
 
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
+	/* Write actual data */
+	if (pwrite_in_full(q->fd, buf, q->cluster_size, clust_new_start) < 0)
+		goto free_buf;
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	free(buf);
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	mutex_lock(&q->mutex);
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
+		pr_warning("Get l2 table error");
+		goto free_cluster;
+	}
+
+	if (be64_to_cpu(l2t->table[l2t_idx]) != entry) {
+		qcow_free_clusters(q, clust_new_start, q->cluster_size);
+		mutex_unlock(&q->mutex);
+
+		return qcow_write_cluster(q, offset, iov, iovcount, len);
 	}
+
+	/* update l2 table, it is written back later on */
+	l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
+		| QCOW2_OFLAG_COPIED);
+	l2t->node.dirty = 1;
+
+	/* free old cluster*/
+	qcow_free_cluster_entry(q, entry);
+
 	mutex_unlock(&q->mutex);
+
 	return len;
 
+free_buf:
+	free(buf);
+free_cluster_unlocked:
+	mutex_lock(&q->mutex);
 free_cluster:
 	qcow_free_clusters(q, clust_new_start, q->cluster_size);
-
 error:
 	mutex_unlock(&q->mutex);
 	return -1;
 }
 
-static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
+/*
+ * A write covering several whole clusters which all need allocating gets
+ * them as one contiguous run, and its data goes out with a single
+ * pwritev(). Returns how many clusters were written, or 0 when the first
+ * one has to go through qcow_write_cluster().
+ */
+static int qcow_write_new_clusters(struct qcow *q, u64 offset,
+				   const struct iovec *iov, int iovcount, u64 done,
+				   struct iovec *sub, u64 nr_clusters)
 {
-	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
-	u32 nr_written;
-	char *buf;
-	u64 offset;
-	ssize_t nr;
+	u64 entries[QCOW_MAX_EXTENT_CLUSTERS];
+	struct qcow_l2_table *l2t;
+	s64 clust_new_start;
+	u64 l2t_size;
+	u64 l2t_idx;
+	u64 i, n;
+	int nr;
+
+	l2t_size = 1 << header->l2_bits;
 
-	buf		= src;
-	nr_written	= 0;
-	offset		= sector << SECTOR_SHIFT;
+	mutex_lock(&q->mutex);
 
-	while (nr_written < src_len) {
-		if (offset >= header->size)
-			return -1;
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		goto error;
 
-		nr = qcow_write_cluster(q, offset, buf, src_len - nr_written);
-		if (nr < 0)
-			return -1;
+	/* The run has to be described by a single L2 table */
+	n = min(nr_clusters, l2t_size - l2t_idx);
+	for (i = 0; i < n; i++) {
+		entries[i] = be64_to_cpu(l2t->table[l2t_idx + i]);
+		if (qcow_cluster_copied(entries[i]))
+			break;
+	}
+
+	n = i;
+	if (n < 2) {
+		mutex_unlock(&q->mutex);
+		return 0;
+	}
 
-		nr_written	+= nr;
-		buf		+= nr;
-		offset		+= nr;
+	clust_new_start = qcow_alloc_clusters(q, n << header->cluster_bits, 1);
+	if (clust_new_start < 0)
+		goto error;
+
+	mutex_unlock(&q->mutex);
+
+	nr = qcow_iov_slice(iov, iovcount, done, n << header->cluster_bits, sub);
+	if (pwritev_in_full(q->fd, sub, nr, clust_new_start) < 0) {
+		mutex_lock(&q->mutex);
+		goto free_clusters;
+	}
+
+	mutex_lock(&q->mutex);
+
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		goto free_clusters;
+
+	/* Leave it to the slow path if anything changed meanwhile */
+	for (i = 0; i < n; i++) {
+		if (be64_to_cpu(l2t->table[l2t_idx + i]) != entries[i]) {
+			qcow_free_clusters(q, clust_new_start, n << header->cluster_bits);
+			mutex_unlock(&q->mutex);
+			return 0;
+		}
 	}
 
-	return nr_written;
+	for (i = 0; i < n; i++)
+		l2t->table[l2t_idx + i] = cpu_to_be64((clust_new_start +
+			(i << header->cluster_bits)) | QCOW2_OFLAG_COPIED);
+	l2t->node.dirty = 1;
+
+	for (i = 0; i < n; i++)
+		qcow_free_cluster_entry(q, entries[i]);
+
+	mutex_unlock(&q->mutex);
+
+	return n;
+
+free_clusters:
+	qcow_free_clusters(q, clust_new_start, n << header->cluster_bits);
+error:
+	mutex_unlock(&q->mutex);
+	return -1;
 }
 
 static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param)
 {
-	ssize_t nr, total = 0;
+	struct qcow *q = disk->priv;
+	struct qcow_header *header = q->header;
+	u64 offset, total, done, len;
+	u64 nr_clusters;
+	struct iovec *sub;
+	int nr;
+
+	offset = sector << SECTOR_SHIFT;
+	total = qcow_iov_size(iov, iovcount);
+	if (offset + total > header->size)
+		return -1;
 
-	while (iovcount--) {
-		nr = qcow_write_sector_single(disk, sector, iov->iov_base, iov->iov_len);
-		if (nr != (ssize_t)iov->iov_len) {
-			pr_info("qcow_write_sector error: nr=%ld iov_len=%ld\n", (long)nr, (long)iov->iov_len);
-			return -1;
+	sub = malloc(iovcount * sizeof(*sub));
+	if (!sub)
+		return -1;
+
+	down_read(&q->discard_lock);
+
+	for (done = 0; done < total; done += len) {
+		nr_clusters = min((total - done) >> header->cluster_bits,
+				  (u64)QCOW_MAX_EXTENT_CLUSTERS);
+
+		if (!get_cluster_offset(q, offset + done) && nr_clusters > 1) {
+			nr = qcow_write_new_clusters(q, offset + done, iov, iovcount,
+						     done, sub, nr_clusters);
+			if (nr < 0)
+				goto error;
+
+			len = (u64)nr << header->cluster_bits;
+			if (len)
+				continue;
 		}
 
-		sector	+= iov->iov_len >> SECTOR_SHIFT;
-		iov++;
-		total	+= nr;
+		len = min(q->cluster_size - get_cluster_offset(q, offset + done),
+			  total - done);
+
+		nr = qcow_iov_slice(iov, iovcount, done, len, sub);
+		if (qcow_write_cluster(q, offset + done, sub, nr, len) < 0)
+			goto error;
 	}
 
+	up_read(&q->discard_lock);
+	free(sub);
+
 	return total;
+
+error:
+	pr_info("qcow_write_sector error: sector=%llu len=%llu\n", sector, total);
+	up_read(&q->discard_lock);
+	free(sub);
+
+	return -1;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+static int qcow_write_zero_data(struct disk_image *disk, u64 offset, u64 len)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
+	struct iovec iov[QCOW_MAX_EXTENT_CLUSTERS];
+	u64 done, chunk;
+	void *buf;
+	int i, r = 0;
 
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	buf = calloc(1, q->cluster_size);
+	if (!buf)
+		return -ENOMEM;
 
-	mutex_lock(&q->mutex);
+	for (done = 0; done < len; done += chunk) {
+		chunk = min(len - done, QCOW_MAX_EXTENT_CLUSTERS * q->cluster_size);
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+		for (i = 0; i * q->cluster_size < chunk; i++) {
+			iov[i].iov_base	= buf;
+			iov[i].iov_len	= min(chunk - i * q->cluster_size, q->cluster_size);
+		}
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
+		if (qcow_write_sector(disk, (offset + done) >> SECTOR_SHIFT,
+				      iov, i, NULL) < 0) {
+			r = -EIO;
+			break;
+		}
 	}
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	free(buf);
+
+	return r;
+}
+
+/* Give the space of a cluster nothing points at anymore back to the host */
+static void qcow_punch_clusters(struct qcow *q, u64 start, u64 len)
+{
+	if (!len)
+		return;
+
+	if (fallocate(q->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) < 0 &&
+	    errno != EOPNOTSUPP)
+		pr_warning("Unable to punch hole in QCOW image: %s", strerror(errno));
+}
+
+/*
+ * Drop the mapping of whole clusters and release whatever they pointed at.
+ * Where a backing file would show through instead, the clusters are marked
+ * as reading zeroes if the image format allows it.
+ *
+ * Data is moved without holding q->mutex, and a released cluster can be
+ * allocated again right away, so no I/O may be in flight meanwhile.
+ */
+static int qcow_unmap_clusters(struct qcow *q, u64 offset, u64 len)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l2_table *l2t;
+	u64 punch_start = 0, punch_len = 0;
+	u64 l2t_size, l2t_idx;
+	u64 new_entry, entry;
+	u64 *entries;
+	u64 done, i, n;
+	int r = 0;
+
+	l2t_size = 1 << header->l2_bits;
+
+	entries = malloc(l2t_size * sizeof(u64));
+	if (!entries)
+		return -ENOMEM;
+
+	new_entry = 0;
+	if (q->backing && q->version >= QCOW3_VERSION)
+		new_entry = QCOW2_OFLAG_ZERO;
+
+	down_write(&q->discard_lock);
+	mutex_lock(&q->mutex);
+
+	for (done = 0; done < len; done += n << header->cluster_bits) {
+		n = min(l2t_size - get_l2_index(q, offset + done),
+			(len - done) >> header->cluster_bits);
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
+		/* Nothing to do where there isn't even an L2 table */
+		if (!q->table.l1_table[get_l1_index(q, offset + done)] && !new_entry)
+			continue;
+
+		if (get_cluster_table(q, offset + done, &l2t, &l2t_idx)) {
+			r = -EIO;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			entries[i] = be64_to_cpu(l2t->table[l2t_idx + i]);
+			if (entries[i] == new_entry)
+				continue;
+
+			l2t->table[l2t_idx + i] = cpu_to_be64(new_entry);
+			l2t->node.dirty = 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			entry = entries[i];
+			if (entry == new_entry)
+				continue;
+
+			qcow_free_cluster_entry(q, entry);
+
+			/* Shared and compressed clusters may still be in use */
+			if (!(entry & QCOW2_OFLAG_COPIED) || (entry & QCOW2_OFLAG_COMPRESSED))
+				continue;
+
+			entry &= QCOW2_OFFSET_MASK;
+			if (punch_start + punch_len != entry) {
+				qcow_punch_clusters(q, punch_start, punch_len);
+				punch_start	= entry;
+				punch_len	= 0;
+			}
+			punch_len += q->cluster_size;
+		}
 	}
 
-	if (qcow_write_l1_table < 0)
+	qcow_punch_clusters(q, punch_start, punch_len);
+
+	mutex_unlock(&q->mutex);
+	up_write(&q->discard_lock);
+
+	free(entries);
+
+	return r;
+}
+
+static int qcow_disk_discard(struct disk_image *disk, u64 sector, u64 len)
+{
+	struct qcow *q = disk->priv;
+	u64 offset, start, end;
+
+	offset	= sector << SECTOR_SHIFT;
+	start	= ALIGN(offset, q->cluster_size);
+	end	= (offset + len) & ~(q->cluster_size - 1);
+
+	/* Partial clusters are left alone, discarded data may read as anything */
+	if (start >= end)
+		return 0;
+
+	return qcow_unmap_clusters(q, start, end - start);
+}
+
+static int qcow_disk_write_zeroes(struct disk_image *disk, u64 sector, u64 len,
+				  bool unmap)
+{
+	struct qcow *q = disk->priv;
+	u64 offset, start, end;
+	int r;
+
+	offset	= sector << SECTOR_SHIFT;
+	start	= ALIGN(offset, q->cluster_size);
+	end	= (offset + len) & ~(q->cluster_size - 1);
+
+	/*
+	 * Unmapped clusters only read as zeroes if there's no backing file
+	 * to show through, or the image can mark them as zero.
+	 */
+	if (!unmap || start >= end || (q->backing && q->version < QCOW3_VERSION))
+		return qcow_write_zero_data(disk, offset, len);
+
+	r = qcow_write_zero_data(disk, offset, start - offset);
+	if (r < 0)
+		return r;
+
+	r = qcow_unmap_clusters(q, start, end - start);
+	if (r < 0)
+		return r;
+
+	return qcow_write_zero_data(disk, end, offset + len - end);
+}
+
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+
+	mutex_lock(&q->mutex);
+
+	if (write_l2_tables(q) < 0)
+		goto error_unlock;
+
+	if (qcow_write_l1_table(q) < 0)
 		goto error_unlock;
 
 	mutex_unlock(&q->mutex);
 
-	return fsync(disk->fd);
+	return fdatasync(disk->fd);
 
 error_unlock:
 	mutex_unlock(&q->mutex);
 	return -1;
 }
 
+static void qcow_disk_get_stats(struct disk_image *disk, struct disk_stats *stats)
+{
+	struct qcow *q = disk->priv;
+
+	mutex_lock(&q->mutex);
+	stats->cache[DISK_CACHE_L2] = (struct disk_stats_cache) {
+		.hits	= q->table.cache.hits,
+		.misses	= q->table.cache.misses,
+	};
+	stats->cache[DISK_CACHE_REFCOUNT] = (struct disk_stats_cache) {
+		.hits	= q->refcount_table.cache.hits,
+		.misses	= q->refcount_table.cache.misses,
+	};
+	mutex_unlock(&q->mutex);
+}
+
 static int qcow_disk_close(struct disk_image *disk)
 {
 	struct qcow *q;
@@ -1166,9 +1863,15 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
-	refcount_table_free_cache(&q->refcount_table);
-	l1_table_free_cache(&q->table);
-	free(q->copy_buff);
+	if (write_l2_tables(q) < 0)
+		pr_warning("Unable to write back QCOW metadata");
+
+	disk_image__close(q->backing);
+
+	qcow_cache_exit(&q->refcount_table.cache);
+	qcow_cache_exit(&q->table.cache);
+	free(q->cluster_bitmap);
+	free(q->full_words);
 	free(q->cluster_data);
 	free(q->cluster_cache);
 	free(q->refcount_table.rf_table);
@@ -1181,6 +1884,7 @@ static int qcow_disk_close(struct disk_image *disk)
 
 static struct disk_image_operations qcow_disk_readonly_ops = {
 	.read_sector		= qcow_read_sector,
+	.get_stats		= qcow_disk_get_stats,
 	.close			= qcow_disk_close,
 };
 
@@ -1188,6 +1892,9 @@ static struct disk_image_operations qcow_disk_ops = {
 	.read_sector		= qcow_read_sector,
 	.write_sector		= qcow_write_sector,
 	.flush			= qcow_disk_flush,
+	.discard		= qcow_disk_discard,
+	.write_zeroes		= qcow_disk_write_zeroes,
+	.get_stats		= qcow_disk_get_stats,
 	.close			= qcow_disk_close,
 };
 
@@ -1203,9 +1910,6 @@ static int qcow_read_refcount_table(struct qcow *q)
 	if (!rft->rf_table)
 		return -1;
 
-	rft->root = RB_ROOT;
-	INIT_LIST_HEAD(&rft->lru_list);
-
 	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
 }
 
@@ -1232,7 +1936,7 @@ static int qcow_read_l1_table(struct qcow *q)
 	return pread_in_full(q->fd, table->l1_table, sizeof(u64) * table->table_size, header->l1_table_offset);
 }
 
-static void *qcow2_read_header(int fd)
+static void *qcow2_read_header(int fd, bool readonly)
 {
 	struct qcow2_header_disk f_header;
 	struct qcow_header *header;
@@ -1260,6 +1964,43 @@ static void *qcow2_read_header(int fd)
 	be32_to_cpus(&f_header.nb_snapshots);
 	be64_to_cpus(&f_header.snapshots_offset);
 
+	if (f_header.version >= QCOW3_VERSION) {
+		be64_to_cpus(&f_header.incompatible_features);
+		be64_to_cpus(&f_header.compatible_features);
+		be64_to_cpus(&f_header.autoclear_features);
+		be32_to_cpus(&f_header.refcount_order);
+		be32_to_cpus(&f_header.header_length);
+	} else {
+		f_header.incompatible_features	= 0;
+		f_header.autoclear_features	= 0;
+		f_header.refcount_order		= 4;
+	}
+
+	if (f_header.incompatible_features) {
+		pr_warning("QCOW2 image has unsupported features 0x%llx",
+			   f_header.incompatible_features);
+		goto free_header;
+	}
+
+	/* Refcounts are handled as 16 bit entries only */
+	if (f_header.refcount_order != 4) {
+		pr_warning("QCOW2 refcount order %u is not supported",
+			   f_header.refcount_order);
+		goto free_header;
+	}
+
+	/*
+	 * None of the autoclear features are known to us, so whatever they
+	 * describe becomes stale as soon as we write to the image.
+	 */
+	if (f_header.autoclear_features && !readonly) {
+		u64 autoclear = 0;
+
+		if (qcow_pwrite_sync(fd, &autoclear, sizeof(autoclear),
+				     offsetof(struct qcow2_header_disk, autoclear_features)) < 0)
+			goto free_header;
+	}
+
 	*header		= (struct qcow_header) {
 		.size			= f_header.size,
 		.l1_table_offset	= f_header.l1_table_offset,
@@ -1268,31 +2009,34 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
+
+free_header:
+	free(header);
+	return NULL;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+static struct disk_image *qcow2_probe(int fd, struct disk_image_params *params)
 {
+	bool readonly = params->readonly;
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	u32 cache_size;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	pthread_rwlock_init(&q->discard_lock, NULL);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
-	h = q->header = qcow2_read_header(fd);
+	h = q->header = qcow2_read_header(fd, readonly);
 	if (!h)
 		goto free_qcow;
 
@@ -1302,16 +2046,10 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
 
-	q->copy_buff = malloc(q->cluster_size);
-	if (!q->copy_buff) {
-		pr_warning("copy buff malloc error");
-		goto free_header;
-	}
-
 	q->cluster_data = malloc(q->cluster_size);
 	if (!q->cluster_data) {
 		pr_warning("cluster data malloc error");
-		goto free_copy_buff;
+		goto free_header;
 	}
 
 	q->cluster_cache = malloc(q->cluster_size);
@@ -1326,6 +2064,14 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	cache_size = params->qcow_cache ? : QCOW_CACHE_DEFAULT;
+	if (qcow_cache_init(&q->table.cache, cache_size) < 0 ||
+	    qcow_cache_init(&q->refcount_table.cache, cache_size) < 0)
+		goto free_caches;
+
+	if (!readonly && qcow_build_cluster_bitmap(q) < 0)
+		goto free_caches;
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
@@ -1335,14 +2081,18 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto free_caches;
 
 	disk_image->async = 0;
 	disk_image->priv = q;
 
 	return disk_image;
 
-free_refcount_table:
+free_caches:
+	free(q->cluster_bitmap);
+	free(q->full_words);
+	qcow_cache_exit(&q->refcount_table.cache);
+	qcow_cache_exit(&q->table.cache);
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
@@ -1354,9 +2104,6 @@ free_cluster_cache:
 free_cluster_data:
 	if (q->cluster_data)
 		free(q->cluster_data);
-free_copy_buff:
-	if (q->copy_buff)
-		free(q->copy_buff);
 free_header:
 	if (q->header)
 		free(q->header);
@@ -1380,7 +2127,8 @@ static bool qcow2_check_image(int fd)
 	if (f_header.magic != QCOW_MAGIC)
 		return false;
 
-	if (f_header.version != QCOW2_VERSION)
+	if (f_header.version != QCOW2_VERSION &&
+	    f_header.version != QCOW3_VERSION)
 		return false;
 
 	return true;
@@ -1415,30 +2163,29 @@ static void *qcow1_read_header(int fd)
 		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
 		.cluster_bits		= f_header.cluster_bits,
 		.l2_bits		= f_header.l2_bits,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, struct disk_image_params *params)
 {
+	bool readonly = params->readonly;
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
+	u32 cache_size;
 
 	q = calloc(1, sizeof(struct qcow));
 	if (!q)
 		return NULL;
 
 	mutex_init(&q->mutex);
+	pthread_rwlock_init(&q->discard_lock, NULL);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
 		goto free_qcow;
@@ -1463,22 +2210,27 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	if (qcow_read_l1_table(q) < 0)
 		goto free_cluster_cache;
 
+	cache_size = params->qcow_cache ? : QCOW_CACHE_DEFAULT;
+	if (qcow_cache_init(&q->table.cache, cache_size) < 0)
+		goto free_l1_table;
+
+	if (!readonly)
+		pr_warning("Forcing read-only support for QCOW1");
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
-
-	if (!disk_image)
-		goto free_l1_table;
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk_image))
+		goto free_cache;
 
-	disk_image->async = 1;
+	disk_image->async = 0;
 	disk_image->priv = q;
 
 	return disk_image;
 
+free_cache:
+	qcow_cache_exit(&q->table.cache);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
@@ -1517,13 +2269,130 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+static ssize_t qcow_backing_read_sector(struct disk_image *disk, u64 sector,
+					const struct iovec *iov, int iovcount, void *param)
+{
+	return preadv_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
+}
+
+/* Backing images which aren't QCOW are raw, and are read synchronously */
+static struct disk_image_operations qcow_backing_raw_ops = {
+	.read_sector		= qcow_backing_read_sector,
+};
+
+/* Relative backing file names are relative to the image referring to them */
+static int qcow_backing_path(struct qcow *q, const char *image,
+			     char *path, size_t size)
 {
+	struct qcow_header *header = q->header;
+	char name[PATH_MAX];
+	char *dir;
+	int len;
+
+	if (header->backing_file_size >= sizeof(name))
+		return -ENAMETOOLONG;
+
+	if (pread_in_full(q->fd, name, header->backing_file_size,
+			  header->backing_file_offset) < 0)
+		return -errno;
+
+	name[header->backing_file_size] = '\0';
+
+	if (name[0] == '/') {
+		len = snprintf(path, size, "%s", name);
+	} else {
+		dir = strdup(image);
+		if (!dir)
+			return -ENOMEM;
+
+		len = snprintf(path, size, "%s/%s", dirname(dir), name);
+		free(dir);
+	}
+
+	return len < (int)size ? 0 : -ENAMETOOLONG;
+}
+
+static int qcow_open_backing(struct qcow *q, struct disk_image_params *params)
+{
+	static int depth;
+	struct disk_image_params backing_params;
+	struct disk_image *backing;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd, r;
+
+	if (!q->header->backing_file_offset)
+		return 0;
+
+	if (depth == QCOW_MAX_BACKING_DEPTH) {
+		pr_warning("QCOW backing chain of '%s' is too deep", params->filename);
+		return -ELOOP;
+	}
+
+	r = qcow_backing_path(q, params->filename, path, sizeof(path));
+	if (r < 0)
+		return r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		r = -errno;
+		pr_warning("Unable to open backing file '%s'", path);
+		return r;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	/* The backing image is shared, it is never written to */
+	backing_params = (struct disk_image_params) {
+		.filename	= path,
+		.readonly	= true,
+		.qcow_cache	= params->qcow_cache,
+	};
+
+	depth++;
+	backing = qcow_probe(fd, &backing_params);
+	depth--;
+
+	if (!backing)
+		backing = disk_image__new(fd, st.st_size, &qcow_backing_raw_ops,
+					  DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(backing)) {
+		r = backing ? PTR_ERR(backing) : -ENOMEM;
+		goto err_close;
+	}
+
+	q->backing = backing;
+
+	return 0;
+
+err_close:
+	close(fd);
+	return r;
+}
+
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params)
+{
+	struct disk_image *disk;
+
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		disk = qcow1_probe(fd, params);
+	else if (qcow2_check_image(fd))
+		disk = qcow2_probe(fd, params);
+	else
+		return NULL;
 
-	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+	/* An image we failed to open must not be mistaken for a raw one */
+	if (!disk)
+		return ERR_PTR(-EINVAL);
 
-	return NULL;
+	if (qcow_open_backing(disk->priv, params) < 0) {
+		disk_image__close(disk);
+		free(disk);
+		return ERR_PTR(-EINVAL);
+	}
+
+	return disk;
 }
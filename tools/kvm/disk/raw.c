@@ -1,11 +1,22 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/kernel.h>
 
 #ifdef CONFIG_HAS_AIO
 #include <libaio.h>
 #endif
 
+/* Not in our copies of linux/fs.h and linux/falloc.h yet */
+#ifndef BLKZEROOUT
+#define BLKZEROOUT		_IO(0x12, 127)
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
+
+#define RAW_ZERO_BUF_SIZE	(64 * 1024)
+
 ssize_t raw_image__read_sector(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
@@ -72,6 +83,85 @@ ssize_t raw_image__write_sector_mmap(struct disk_image *disk, u64 sector, const
 	return total;
 }
 
+static bool raw_image__is_blkdev(struct disk_image *disk)
+{
+	struct stat st;
+
+	return !fstat(disk->fd, &st) && S_ISBLK(st.st_mode);
+}
+
+static int raw_image__write_zero_data(struct disk_image *disk, u64 offset, u64 len)
+{
+	u64 done, chunk;
+	void *buf;
+	int r = 0;
+
+	/* Aligned, in case the image was opened with O_DIRECT */
+	if (posix_memalign(&buf, getpagesize(), RAW_ZERO_BUF_SIZE))
+		return -ENOMEM;
+	memset(buf, 0, RAW_ZERO_BUF_SIZE);
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = min(len - done, (u64)RAW_ZERO_BUF_SIZE);
+		if (pwrite_in_full(disk->fd, buf, chunk, offset + done) < 0) {
+			r = -errno;
+			break;
+		}
+	}
+
+	free(buf);
+
+	return r;
+}
+
+/*
+ * Hand the range back to the host. Reads of a punched hole return zeroes,
+ * but nothing is promised about a discarded block device range.
+ */
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 len)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, len };
+
+	if (raw_image__is_blkdev(disk))
+		return ioctl(disk->fd, BLKDISCARD, range) < 0 ? -errno : 0;
+
+	if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      range[0], range[1]) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Zero the range, deallocating it when allowed to. Filesystems which can't
+ * do either through fallocate() get the zeroes written out.
+ */
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, len };
+
+	if (raw_image__is_blkdev(disk))
+		return ioctl(disk->fd, BLKZEROOUT, range) < 0 ? -errno : 0;
+
+	if (unmap && !fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range[0], range[1]))
+		return 0;
+
+	if (!fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       range[0], range[1]))
+		return 0;
+
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	return raw_image__write_zero_data(disk, range[0], range[1]);
+}
+
+int raw_image__prefetch(struct disk_image *disk, u64 sector, u64 len)
+{
+	return -posix_fadvise(disk->fd, sector << SECTOR_SHIFT, len, POSIX_FADV_WILLNEED);
+}
+
 int raw_image__close(struct disk_image *disk)
 {
 	int ret = 0;
@@ -79,12 +169,6 @@ int raw_image__close(struct disk_image *disk)
 	if (disk->priv != MAP_FAILED)
 		ret = munmap(disk->priv, disk->size);
 
-	close(disk->evt);
-
-#ifdef CONFIG_HAS_VIRTIO
-	io_destroy(disk->ctx);
-#endif
-
 	return ret;
 }
 
@@ -94,29 +178,43 @@ int raw_image__close(struct disk_image *disk)
 static struct disk_image_operations raw_image_regular_ops = {
 	.read_sector	= raw_image__read_sector,
 	.write_sector	= raw_image__write_sector,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.prefetch	= raw_image__prefetch,
 };
 
 struct disk_image_operations ro_ops = {
 	.read_sector	= raw_image__read_sector_mmap,
 	.write_sector	= raw_image__write_sector_mmap,
+	.prefetch	= raw_image__prefetch,
 	.close		= raw_image__close,
 };
 
 struct disk_image_operations ro_ops_nowrite = {
 	.read_sector	= raw_image__read_sector,
+	.prefetch	= raw_image__prefetch,
 };
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
+struct disk_image *raw_image__probe(int fd, struct stat *st, struct disk_image_params *params)
 {
 	struct disk_image *disk;
 
-	if (readonly) {
+	if (params->readonly) {
+		/*
+		 * Guest writes go to an overlay file, which only persists if
+		 * the user named one.
+		 */
+		disk = cow_image__probe(fd, st->st_size, params);
+		if (!IS_ERR_OR_NULL(disk) || params->cow)
+			return disk;
+
+		pr_warning("Unable to create a copy-on-write overlay: %s",
+			   strerror(-PTR_ERR(disk)));
+
 		/*
 		 * Use mmap's MAP_PRIVATE to implement non-persistent write
 		 * FIXME: This does not work on 32-bit host.
 		 */
-		struct disk_image *disk;
-
 		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
 		if (IS_ERR_OR_NULL(disk)) {
 			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
@@ -128,6 +226,13 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 
 		return disk;
 	} else {
+		/*
+		 * Prefer io_uring when it is available
+		 */
+		disk = uring_image__probe(fd, st->st_size, params);
+		if (!IS_ERR_OR_NULL(disk))
+			return disk;
+
 		/*
 		 * Use read/write instead of mmap
 		 */
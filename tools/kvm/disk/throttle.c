@@ -0,0 +1,292 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Per-disk token buckets, one for requests and one for bytes. A request is
+ * let through as soon as each bucket with a limit holds at least a token,
+ * and then takes what it needs, possibly running the bucket into debt. Big
+ * requests are thus never starved, and pay for themselves by holding up
+ * those which follow.
+ *
+ * Requests which have to wait are queued, and submitted in order by a
+ * thread of the disk's own, so the virtio queue threads never sleep here.
+ */
+
+#define NSEC_PER_SEC		1000000000ULL
+
+struct disk_throttle_bucket {
+	double				rate;
+	double				burst;
+	double				level;
+};
+
+struct disk_throttle_req {
+	struct list_head		list;
+	bool				write;
+	u64				sector;
+	const struct iovec		*iov;
+	int				iovcount;
+	void				*param;
+	u64				len;
+};
+
+struct disk_throttle {
+	pthread_mutex_t			mutex;
+	pthread_cond_t			cond;
+	pthread_t			thread;
+	bool				stop;
+
+	struct list_head		queue;
+	struct disk_throttle_bucket	iops;
+	struct disk_throttle_bucket	bps;
+	u64				last;
+};
+
+static void disk_throttle__bucket_refill(struct disk_throttle_bucket *b, double secs)
+{
+	if (b->rate)
+		b->level = min(b->burst, b->level + b->rate * secs);
+}
+
+/* Called with t->mutex held */
+static void disk_throttle__refill(struct disk_throttle *t)
+{
+	u64 now = disk_image__time_ns();
+	double secs = (double)(now - t->last) / NSEC_PER_SEC;
+
+	disk_throttle__bucket_refill(&t->iops, secs);
+	disk_throttle__bucket_refill(&t->bps, secs);
+	t->last = now;
+}
+
+/* Seconds until the bucket holds a whole token again */
+static double disk_throttle__bucket_wait(struct disk_throttle_bucket *b)
+{
+	if (!b->rate || b->level >= 1)
+		return 0;
+
+	return (1 - b->level) / b->rate;
+}
+
+/* Called with t->mutex held */
+static bool disk_throttle__admit(struct disk_throttle *t, u64 len)
+{
+	if (disk_throttle__bucket_wait(&t->iops) || disk_throttle__bucket_wait(&t->bps))
+		return false;
+
+	if (t->iops.rate)
+		t->iops.level -= 1;
+	if (t->bps.rate)
+		t->bps.level -= len;
+
+	return true;
+}
+
+static void *disk_throttle__thread(void *param)
+{
+	struct disk_image *disk = param;
+	struct disk_throttle *t = disk->throttle;
+	struct disk_throttle_req *req;
+	struct timespec deadline;
+	double wait;
+	u64 until;
+
+	mutex_lock(&t->mutex);
+
+	while (!t->stop) {
+		if (list_empty(&t->queue)) {
+			pthread_cond_wait(&t->cond, &t->mutex);
+			continue;
+		}
+
+		req = list_first_entry(&t->queue, struct disk_throttle_req, list);
+
+		disk_throttle__refill(t);
+		if (!disk_throttle__admit(t, req->len)) {
+			wait = max(disk_throttle__bucket_wait(&t->iops),
+				   disk_throttle__bucket_wait(&t->bps));
+			until = t->last + (u64)(wait * NSEC_PER_SEC) + 1;
+
+			deadline.tv_sec		= until / NSEC_PER_SEC;
+			deadline.tv_nsec	= until % NSEC_PER_SEC;
+			pthread_cond_timedwait(&t->cond, &t->mutex, &deadline);
+			continue;
+		}
+
+		list_del(&req->list);
+		mutex_unlock(&t->mutex);
+
+		if (req->write)
+			disk_image__do_write(disk, req->sector, req->iov, req->iovcount,
+					     req->param);
+		else
+			disk_image__do_read(disk, req->sector, req->iov, req->iovcount,
+					    req->param);
+		disk_image__submit(disk);
+		free(req);
+
+		mutex_lock(&t->mutex);
+	}
+
+	mutex_unlock(&t->mutex);
+
+	return NULL;
+}
+
+/*
+ * Let the request through right away if nothing is waiting and the buckets
+ * allow it. Otherwise it's queued, and completed later on through the disk
+ * callback. Returns whether the request was queued.
+ */
+bool disk_throttle__queue(struct disk_image *disk, bool write, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param)
+{
+	struct disk_throttle *t = disk->throttle;
+	struct disk_throttle_req *req;
+	u64 len = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	mutex_lock(&t->mutex);
+
+	if (list_empty(&t->queue)) {
+		disk_throttle__refill(t);
+		if (disk_throttle__admit(t, len)) {
+			mutex_unlock(&t->mutex);
+			return false;
+		}
+	}
+
+	req = malloc(sizeof(*req));
+	if (!req) {
+		mutex_unlock(&t->mutex);
+		return false;
+	}
+
+	*req = (struct disk_throttle_req) {
+		.write		= write,
+		.sector		= sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.param		= param,
+		.len		= len,
+	};
+
+	list_add_tail(&req->list, &t->queue);
+	pthread_cond_signal(&t->cond);
+
+	mutex_unlock(&t->mutex);
+
+	return true;
+}
+
+static void disk_throttle__bucket_set(struct disk_throttle_bucket *b, u64 rate, u64 burst)
+{
+	bool was_limited = b->rate != 0;
+
+	if (rate != DISK_THROTTLE_KEEP) {
+		b->rate		= rate;
+		b->burst	= rate;
+	}
+	if (burst != DISK_THROTTLE_KEEP && burst)
+		b->burst	= burst;
+
+	/* A bucket which just got a limit starts out full */
+	if (was_limited)
+		b->level = min(b->level, b->burst);
+	else
+		b->level = b->burst;
+}
+
+static int disk_throttle__init(struct disk_image *disk)
+{
+	struct disk_throttle *t;
+	pthread_condattr_t attr;
+	int r;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	mutex_init(&t->mutex);
+	INIT_LIST_HEAD(&t->queue);
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&t->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	t->last = disk_image__time_ns();
+
+	disk->throttle = t;
+
+	r = pthread_create(&t->thread, NULL, disk_throttle__thread, disk);
+	if (r) {
+		disk->throttle = NULL;
+		free(t);
+		return -r;
+	}
+
+	return 0;
+}
+
+/*
+ * Fields set to DISK_THROTTLE_KEEP are left alone, and a rate of 0 lifts
+ * the limit. Bursts default to a second's worth of the rate.
+ */
+int disk_throttle__set(struct disk_image *disk, struct disk_throttle_limits *limits)
+{
+	struct disk_throttle *t;
+	int r;
+
+	if (!disk->throttle) {
+		r = disk_throttle__init(disk);
+		if (r < 0)
+			return r;
+	}
+
+	t = disk->throttle;
+
+	mutex_lock(&t->mutex);
+
+	disk_throttle__refill(t);
+	disk_throttle__bucket_set(&t->iops, limits->iops, limits->iops_burst);
+	disk_throttle__bucket_set(&t->bps, limits->bps, limits->bps_burst);
+
+	/* The new limits may let waiting requests through */
+	pthread_cond_signal(&t->cond);
+
+	mutex_unlock(&t->mutex);
+
+	return 0;
+}
+
+/* Requests still waiting at this point are dropped along with the guest */
+void disk_throttle__exit(struct disk_image *disk)
+{
+	struct disk_throttle *t = disk->throttle;
+	struct disk_throttle_req *req, *next;
+
+	if (!t)
+		return;
+
+	mutex_lock(&t->mutex);
+	t->stop = true;
+	pthread_cond_signal(&t->cond);
+	mutex_unlock(&t->mutex);
+
+	pthread_join(t->thread, NULL);
+
+	list_for_each_entry_safe(req, next, &t->queue, list)
+		free(req);
+
+	disk->throttle = NULL;
+	free(t);
+}
@@ -0,0 +1,322 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#define URING_ENTRIES		512
+#define URING_SQ_IDLE_MS	1000
+
+/*
+ * Guest memory is registered with the ring as fixed buffers, which can't be
+ * larger than 1GB each.
+ */
+#define URING_BUF_MAX		(1ULL << 30)
+#define URING_MAX_BUFS		1024
+
+struct uring_disk {
+	struct io_uring		ring;
+	/* Serializes access to the submission queue */
+	pthread_mutex_t		mutex;
+	/* Signalled by the kernel as completions are posted */
+	int			evt;
+	int			completion;
+
+	struct iovec		*bufs;
+	int			nr_bufs;
+};
+
+/*
+ * Completions for every request queue of the disk are reaped here, from the
+ * completion pool, and handed back through the disk callback to whoever
+ * submitted the request.
+ */
+static void uring_image__reap(void *param)
+{
+	struct disk_image *disk = param;
+	struct uring_disk *ud = disk->priv;
+	struct io_uring_cqe *cqe;
+	unsigned int head, nr;
+	u64 dummy;
+
+	if (read(ud->evt, &dummy, sizeof(dummy)) < 0)
+		return;
+
+	do {
+		nr = 0;
+		io_uring_for_each_cqe(&ud->ring, head, cqe) {
+			disk->disk_req_cb(io_uring_cqe_get_data(cqe), cqe->res);
+			nr++;
+		}
+		io_uring_cq_advance(&ud->ring, nr);
+	} while (nr);
+
+	/*
+	 * A submission may have been refused while the completion queue was
+	 * full, retry now that there is room in it.
+	 */
+	if (io_uring_sq_ready(&ud->ring)) {
+		mutex_lock(&ud->mutex);
+		io_uring_submit(&ud->ring);
+		mutex_unlock(&ud->mutex);
+	}
+}
+
+static struct io_uring_sqe *uring_image__get_sqe(struct uring_disk *ud)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ud->ring);
+	if (!sqe) {
+		/* The submission queue is full, flush it out */
+		io_uring_submit(&ud->ring);
+		sqe = io_uring_get_sqe(&ud->ring);
+	}
+
+	return sqe;
+}
+
+static int uring_image__find_buf(struct uring_disk *ud, const struct iovec *iov)
+{
+	int i;
+
+	for (i = 0; i < ud->nr_bufs; i++) {
+		void *start = ud->bufs[i].iov_base;
+		void *end = start + ud->bufs[i].iov_len;
+
+		if (iov->iov_base >= start && iov->iov_base + iov->iov_len <= end)
+			return i;
+	}
+
+	return -1;
+}
+
+static ssize_t uring_image__queue(struct disk_image *disk, bool write, u64 sector,
+				  const struct iovec *iov, int iovcount, void *param)
+{
+	struct uring_disk *ud = disk->priv;
+	struct io_uring_sqe *sqe;
+	u64 offset = sector << SECTOR_SHIFT;
+	int buf = -1;
+
+	mutex_lock(&ud->mutex);
+
+	sqe = uring_image__get_sqe(ud);
+	if (!sqe) {
+		mutex_unlock(&ud->mutex);
+		return -EBUSY;
+	}
+
+	if (iovcount == 1)
+		buf = uring_image__find_buf(ud, iov);
+
+	/* The image is the only registered file, so its index is 0 */
+	if (buf >= 0 && write)
+		io_uring_prep_write_fixed(sqe, 0, iov->iov_base, iov->iov_len, offset, buf);
+	else if (buf >= 0)
+		io_uring_prep_read_fixed(sqe, 0, iov->iov_base, iov->iov_len, offset, buf);
+	else if (write)
+		io_uring_prep_writev(sqe, 0, iov, iovcount, offset);
+	else
+		io_uring_prep_readv(sqe, 0, iov, iovcount, offset);
+
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, param);
+
+	mutex_unlock(&ud->mutex);
+
+	return 0;
+}
+
+static ssize_t uring_image__read_sector(struct disk_image *disk, u64 sector,
+					const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_image__queue(disk, false, sector, iov, iovcount, param);
+}
+
+static ssize_t uring_image__write_sector(struct disk_image *disk, u64 sector,
+					 const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_image__queue(disk, true, sector, iov, iovcount, param);
+}
+
+static int uring_image__submit(struct disk_image *disk)
+{
+	struct uring_disk *ud = disk->priv;
+	int r;
+
+	mutex_lock(&ud->mutex);
+	r = io_uring_submit(&ud->ring);
+	mutex_unlock(&ud->mutex);
+
+	return r < 0 ? r : 0;
+}
+
+static int uring_image__add_bank(struct kvm *kvm, struct kvm_mem_bank *bank, void *data)
+{
+	struct uring_disk *ud = data;
+	u64 done, len;
+
+	for (done = 0; done < bank->size; done += len) {
+		len = min(bank->size - done, (u64)URING_BUF_MAX);
+
+		if (ud->nr_bufs == URING_MAX_BUFS)
+			return -ENOSPC;
+
+		ud->bufs[ud->nr_bufs++] = (struct iovec) {
+			.iov_base	= bank->host_addr + done,
+			.iov_len	= len,
+		};
+	}
+
+	return 0;
+}
+
+/*
+ * Registering guest memory pins it, but lets the kernel skip mapping the
+ * pages of every single request. Not being able to do so (usually because of
+ * RLIMIT_MEMLOCK) isn't fatal, requests are then submitted as plain readv and
+ * writev.
+ */
+static int uring_image__register_mem(struct disk_image *disk, struct kvm *kvm)
+{
+	struct uring_disk *ud = disk->priv;
+	int r;
+
+	ud->bufs = calloc(URING_MAX_BUFS, sizeof(*ud->bufs));
+	if (!ud->bufs)
+		return -ENOMEM;
+
+	r = kvm__for_each_mem_bank(kvm, uring_image__add_bank, ud);
+	if (!r)
+		r = io_uring_register_buffers(&ud->ring, ud->bufs, ud->nr_bufs);
+
+	if (r < 0) {
+		pr_warning("Unable to register guest memory with io_uring: %s",
+			   strerror(-r));
+		free(ud->bufs);
+		ud->bufs = NULL;
+		ud->nr_bufs = 0;
+	}
+
+	return 0;
+}
+
+static int uring_image__close(struct disk_image *disk)
+{
+	struct uring_disk *ud = disk->priv;
+
+	disk_completion__del(ud->completion);
+	io_uring_queue_exit(&ud->ring);
+	close(ud->evt);
+	free(ud->bufs);
+	free(ud);
+
+	if (disk->fd >= 0)
+		close(disk->fd);
+	free(disk);
+
+	return 0;
+}
+
+static struct disk_image_operations uring_image_ops = {
+	.read_sector		= uring_image__read_sector,
+	.write_sector		= uring_image__write_sector,
+	.submit			= uring_image__submit,
+	.register_mem		= uring_image__register_mem,
+	.discard		= raw_image__discard,
+	.write_zeroes		= raw_image__write_zeroes,
+	.prefetch		= raw_image__prefetch,
+	.close			= uring_image__close,
+};
+
+static int uring_image__setup(struct uring_disk *ud, int fd, bool sqpoll)
+{
+	struct io_uring_params p;
+	int r;
+
+	memset(&p, 0, sizeof(p));
+	if (sqpoll) {
+		p.flags		= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MS;
+	}
+
+	r = io_uring_queue_init_params(URING_ENTRIES, &ud->ring, &p);
+	if (r < 0 && sqpoll) {
+		pr_warning("Unable to set up io_uring SQ polling: %s", strerror(-r));
+		return uring_image__setup(ud, fd, false);
+	}
+	if (r < 0)
+		return r;
+
+	r = io_uring_register_files(&ud->ring, &fd, 1);
+	if (r < 0)
+		goto err_ring;
+
+	ud->evt = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ud->evt < 0) {
+		r = -errno;
+		goto err_ring;
+	}
+
+	r = io_uring_register_eventfd(&ud->ring, ud->evt);
+	if (r < 0)
+		goto err_evt;
+
+	return 0;
+
+err_evt:
+	close(ud->evt);
+err_ring:
+	io_uring_queue_exit(&ud->ring);
+	return r;
+}
+
+struct disk_image *uring_image__probe(int fd, u64 size, struct disk_image_params *params)
+{
+	struct disk_image *disk;
+	struct uring_disk *ud;
+	int r;
+
+	ud = calloc(1, sizeof(*ud));
+	if (!ud)
+		return ERR_PTR(-ENOMEM);
+
+	mutex_init(&ud->mutex);
+
+	r = uring_image__setup(ud, fd, params->sqpoll);
+	if (r < 0)
+		goto err_free;
+
+	disk = disk_image__new(fd, size, &uring_image_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR_OR_NULL(disk)) {
+		r = disk ? PTR_ERR(disk) : -ENOMEM;
+		goto err_ring;
+	}
+
+	disk->priv	= ud;
+	disk->async	= true;
+
+	ud->completion = disk_completion__add(ud->evt, uring_image__reap, disk);
+	if (ud->completion < 0) {
+		r = ud->completion;
+		/* The image stays open, for the caller to fall back on */
+		disk->fd = -1;
+		disk_image__close(disk);
+		return ERR_PTR(r);
+	}
+
+	return disk;
+
+err_ring:
+	io_uring_queue_exit(&ud->ring);
+	close(ud->evt);
+err_free:
+	free(ud);
+	return ERR_PTR(r);
+}
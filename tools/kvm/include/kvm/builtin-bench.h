@@ -0,0 +1,9 @@
+#ifndef KVM__BENCH_H
+#define KVM__BENCH_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_bench(int argc, const char **argv, const char *prefix);
+void kvm_bench_help(void) NORETURN;
+
+#endif
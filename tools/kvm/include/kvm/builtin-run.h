@@ -3,9 +3,12 @@
 
 #include <kvm/util.h>
 
+struct disk_image_params;
+
 int kvm_cmd_run(int argc, const char **argv, const char *prefix);
 void kvm_run_help(void) NORETURN;
 
 void kvm_run_set_wrapper_sandbox(void);
+void kvm_run_set_disk_params(struct disk_image_params *p, const char *arg);
 
 #endif
@@ -0,0 +1,9 @@
+#ifndef KVM__THROTTLE_H
+#define KVM__THROTTLE_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_throttle(int argc, const char **argv, const char *prefix);
+void kvm_throttle_help(void) NORETURN;
+
+#endif
@@ -5,6 +5,7 @@
 #include "kvm/util.h"
 
 #include <linux/types.h>
+#include <linux/err.h>
 #include <linux/fs.h>	/* for BLKGETSIZE64 */
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -17,6 +18,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1UL << SECTOR_SHIFT)
@@ -26,16 +29,137 @@ enum {
 	DISK_IMAGE_MMAP,
 };
 
-#define MAX_DISK_IMAGES         4
+#define MAX_DISK_IMAGES         64
 
 struct disk_image;
+struct disk_throttle;
+struct disk_direct;
+struct disk_prefetch;
+struct kvm;
+
+/* Leaves the current limit as it is */
+#define DISK_THROTTLE_KEEP	((u64)-1)
+
+/* Rates are per second, 0 means unlimited */
+struct disk_throttle_limits {
+	u64				iops;
+	u64				iops_burst;
+	u64				bps;
+	u64				bps_burst;
+};
+
+enum {
+	DISK_STAT_READ,
+	DISK_STAT_WRITE,
+	DISK_STAT_FLUSH,
+	DISK_STAT_NR,
+};
+
+/*
+ * Latency histograms have log2 buckets of microseconds: bucket 0 counts
+ * latencies under 1us, bucket i those in [2^(i-1), 2^i), and the last one
+ * everything longer.
+ */
+#define DISK_STAT_BUCKETS	24
+
+struct disk_stats_op {
+	u64				ops;
+	u64				bytes;
+	u64				errors;
+	u64				lat_total;
+	u64				lat[DISK_STAT_BUCKETS];
+};
+
+enum {
+	DISK_CACHE_L2,
+	DISK_CACHE_REFCOUNT,
+	DISK_CACHE_NR,
+};
+
+struct disk_stats_cache {
+	u64				hits;
+	u64				misses;
+};
+
+/*
+ * Sent in reply to KVM_IPC_DISK_STAT, after the number of disks. Operation
+ * latencies go from the request being handed to the backend to its
+ * completion, guest latencies from the guest notifying the queue to the
+ * request being used, and cover every request type.
+ */
+struct disk_stats {
+	struct disk_stats_op		op[DISK_STAT_NR];
+	u64				in_flight;
+	u64				max_in_flight;
+	u64				guest_ops;
+	u64				guest_lat_total;
+	u64				guest_lat[DISK_STAT_BUCKETS];
+
+	/* Metadata caches of the image format, filled in by ops->get_stats */
+	struct disk_stats_cache		cache[DISK_CACHE_NR];
+};
+
+/*
+ * The param of disk_image__read and disk_image__write, for disks with a
+ * completion callback, so that the request can be accounted for. The
+ * callback hands it back with disk_image__req_done().
+ */
+struct disk_image_req {
+	u64				kick;
+	u64				submit;
+	int				op;
+};
+
+/* Sent along with KVM_IPC_DISK_THROTTLE */
+struct disk_throttle_msg {
+	u32				disk;
+	u32				pad;
+	struct disk_throttle_limits	limits;
+};
+
+struct disk_image_params {
+	const char			*filename;
+	bool				readonly;
+	bool				sqpoll;
+	/* cache=none: bypass the host page cache with O_DIRECT */
+	bool				direct;
+	int				nr_queues;
+	int				qcow_cache;
+	/* Copy-on-write overlay for a read-only raw image */
+	const char			*cow;
+	/* Where to record the reads of the first record_secs, and replay them from */
+	const char			*record;
+	int				record_secs;
+	const char			*prefetch;
+	struct disk_throttle_limits	throttle;
+};
 
 struct disk_image_operations {
 	ssize_t (*read_sector)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 	ssize_t (*write_sector)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+	/*
+	 * Backends which queue requests in read_sector/write_sector only
+	 * hand them to the kernel once submit is called.
+	 */
+	int (*submit)(struct disk_image *disk);
+	/* Lets the backend set up zero-copy access to guest memory */
+	int (*register_mem)(struct disk_image *disk, struct kvm *kvm);
 	int (*flush)(struct disk_image *disk);
+	/*
+	 * Synchronous, and only offered by writable images. After a discard
+	 * the range reads back as anything, after write_zeroes as zeroes.
+	 */
+	int (*discard)(struct disk_image *disk, u64 sector, u64 len);
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 len, bool unmap);
+	/*
+	 * Starts reading the range ahead, without waiting for it. Images
+	 * without it are read ahead through read_sector.
+	 */
+	int (*prefetch)(struct disk_image *disk, u64 sector, u64 len);
+	/* Adds the counters only the image format knows about */
+	void (*get_stats)(struct disk_image *disk, struct disk_stats *stats);
 	int (*close)(struct disk_image *disk);
 };
 
@@ -48,25 +172,87 @@ struct disk_image {
 	void				(*disk_req_cb)(void *param, long len);
 	bool				async;
 	int				evt;
+	int				nr_queues;
+	struct disk_throttle		*throttle;
+	struct disk_direct		*direct;
+	struct disk_prefetch		*prefetch;
+
+	/* Group commit of flushes, see disk_image__flush() */
+	pthread_mutex_t			flush_mutex;
+	pthread_cond_t			flush_cond;
+	bool				flushing;
+	u64				flush_seq;
+	u64				flush_err_seq;
+	int				flush_err;
+
+	pthread_mutex_t			stats_mutex;
+	struct disk_stats		stats;
 #ifdef CONFIG_HAS_AIO
 	io_context_t			ctx;
+	int				aio_completion;
 #endif
 };
 
-struct disk_image *disk_image__open(const char *filename, bool readonly);
-struct disk_image **disk_image__open_all(const char **filenames, bool *readonly, int count);
+struct disk_image *disk_image__open(struct disk_image_params *params);
+struct disk_image **disk_image__open_all(struct disk_image_params *params, int count);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
 int disk_image__close(struct disk_image *disk);
 int disk_image__close_all(struct disk_image **disks, int count);
 int disk_image__flush(struct disk_image *disk);
+int disk_image__submit(struct disk_image *disk);
+int disk_image__register_mem(struct disk_image *disk, struct kvm *kvm);
+int disk_image__set_depth(struct disk_image *disk, u32 depth);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 len);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len, bool unmap);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+ssize_t disk_image__do_read(struct disk_image *disk, u64 sector, const struct iovec *iov,
+				int iovcount, void *param);
+ssize_t disk_image__do_write(struct disk_image *disk, u64 sector, const struct iovec *iov,
+				int iovcount, void *param);
+void disk_image__req_done(struct disk_image *disk, struct disk_image_req *req, long len);
+void disk_image__get_stats(struct disk_image *disk, struct disk_stats *stats);
 ssize_t disk_image__get_serial(struct disk_image *disk, void *buffer, ssize_t *len);
 
-struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly);
-struct disk_image *blkdev__probe(const char *filename, struct stat *st);
+int disk_throttle__set(struct disk_image *disk, struct disk_throttle_limits *limits);
+bool disk_throttle__queue(struct disk_image *disk, bool write, u64 sector,
+			  const struct iovec *iov, int iovcount, void *param);
+void disk_throttle__exit(struct disk_image *disk);
+
+int disk_direct__init(struct disk_image *disk);
+bool disk_direct__aligned(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			  int iovcount);
+ssize_t disk_direct__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			  int iovcount);
+ssize_t disk_direct__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			   int iovcount);
+u32 disk_direct__block_size(struct disk_image *disk);
+void disk_direct__exit(struct disk_image *disk);
+
+int disk_completion__add(int fd, void (*reap)(void *arg), void *arg);
+void disk_completion__del(int id);
+
+int disk_prefetch__record(struct disk_image *disk, const char *path, int secs);
+void disk_prefetch__log(struct disk_image *disk, u64 sector, const struct iovec *iov,
+			int iovcount);
+int disk_prefetch__replay(struct disk_image *disk, const char *path);
+void disk_prefetch__exit(struct disk_image *disk);
+
+struct disk_image *raw_image__probe(int fd, struct stat *st, struct disk_image_params *params);
+struct disk_image *blkdev__probe(struct disk_image_params *params, struct stat *st);
+struct disk_image *cow_image__probe(int fd, u64 size, struct disk_image_params *params);
+
+#ifdef CONFIG_HAS_URING
+struct disk_image *uring_image__probe(int fd, u64 size, struct disk_image_params *params);
+#else
+static inline struct disk_image *uring_image__probe(int fd, u64 size,
+						     struct disk_image_params *params)
+{
+	return ERR_PTR(-ENOSYS);
+}
+#endif
 
 ssize_t raw_image__read_sector(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
@@ -76,6 +262,18 @@ ssize_t raw_image__read_sector_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__write_sector_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 len);
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 len, bool unmap);
+int raw_image__prefetch(struct disk_image *disk, u64 sector, u64 len);
 int raw_image__close(struct disk_image *disk);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
+
+static inline u64 disk_image__time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 #endif /* KVM__DISK_IMAGE_H */
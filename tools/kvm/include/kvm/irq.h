@@ -12,6 +12,8 @@ struct kvm;
 
 struct irq_line {
 	u8			line;
+	/* The PCI device number the line was given out with */
+	u8			num;
 	struct list_head	node;
 };
 
@@ -9,7 +9,14 @@
 #include "kvm/kvm.h"
 #include "kvm/msi.h"
 
+/*
+ * Devices are numbered slot first: numbers past the 32 slots of the bus are
+ * further functions of the same slots, so device n is function n / 32 of
+ * slot n % 32.
+ */
 #define PCI_MAX_DEVICES			256
+#define PCI_MAX_SLOTS			32
+#define PCI_HEADER_TYPE_MULTIFUNCTION	0x80
 /*
  * PCI Configuration Mechanism #1 I/O ports. See Section 3.7.4.1.
  * ("Configuration Mechanism #1") of the PCI Local Bus Specification 2.1 for
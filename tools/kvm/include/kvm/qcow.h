@@ -5,30 +5,57 @@
 
 #include <linux/types.h>
 #include <stdbool.h>
-#include <linux/rbtree.h>
 #include <linux/list.h>
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
 
 #define QCOW1_VERSION		1
 #define QCOW2_VERSION		2
+#define QCOW3_VERSION		3
 
 #define QCOW1_OFLAG_COMPRESSED	(1ULL << 63)
 
 #define QCOW2_OFLAG_COPIED	(1ULL << 63)
 #define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)
 
-#define QCOW2_OFLAGS_MASK	(QCOW2_OFLAG_COPIED|QCOW2_OFLAG_COMPRESSED)
+#define QCOW2_OFLAGS_MASK	(QCOW2_OFLAG_COPIED|QCOW2_OFLAG_COMPRESSED|QCOW2_OFLAG_ZERO)
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
-#define MAX_CACHE_NODES         32
+/* Number of tables kept by each of the L2 and refcount block caches */
+#define QCOW_CACHE_DEFAULT	128
 
-struct qcow_l2_table {
+#define QCOW_MAX_BACKING_DEPTH	16
+
+/* Most clusters allocated at once for a single write */
+#define QCOW_MAX_EXTENT_CLUSTERS	64
+
+/* Must be the first member of whatever is being cached */
+struct qcow_cache_node {
 	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
+	struct hlist_node		hash;
+	u32				slot;
 	u8				dirty;
+	u8				referenced;
+};
+
+struct qcow_cache {
+	struct hlist_head		*hash;
+	u32				hash_bits;
+
+	/* Slots swept by the CLOCK hand */
+	struct qcow_cache_node		**slots;
+	u32				size;
+	u32				nr_cached;
+	u32				hand;
+
+	u64				hits;
+	u64				misses;
+};
+
+struct qcow_l2_table {
+	struct qcow_cache_node		node;
 	u64				table[];
 };
 
@@ -37,19 +64,14 @@ struct qcow_l1_table {
 	u64				*l1_table;
 
 	/* Level2 caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
-	int				nr_cached;
+	struct qcow_cache		cache;
 };
 
 #define QCOW_REFCOUNT_BLOCK_SHIFT	1
 
 struct qcow_refcount_block {
-	u64				offset;
-	struct rb_node			node;
-	struct list_head		list;
+	struct qcow_cache_node		node;
 	u64				size;
-	u8				dirty;
 	u16				entries[];
 };
 
@@ -58,9 +80,7 @@ struct qcow_refcount_table {
 	u64				*rf_table;
 
 	/* Refcount block caching data structures */
-	struct rb_root			root;
-	struct list_head		lru_list;
-	int				nr_cached;
+	struct qcow_cache		cache;
 };
 
 struct qcow_header {
@@ -71,10 +91,17 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
 };
 
 struct qcow {
 	pthread_mutex_t			mutex;
+	/*
+	 * Held for reading across data I/O, which happens outside of mutex,
+	 * and for writing while clusters are discarded.
+	 */
+	pthread_rwlock_t		discard_lock;
 	struct qcow_header		*header;
 	struct qcow_l1_table		table;
 	struct qcow_refcount_table	refcount_table;
@@ -85,9 +112,21 @@ struct qcow {
 	u64				cluster_size;
 	u64				cluster_offset_mask;
 	u64				free_clust_idx;
+
+	/*
+	 * One bit per cluster with a non-zero refcount. Clusters past the
+	 * end of it are free.
+	 */
+	unsigned long			*cluster_bitmap;
+	u64				nr_bitmap_bits;
+	/* One bit per word of cluster_bitmap with every cluster in use */
+	unsigned long			*full_words;
+
 	void				*cluster_cache;
 	void				*cluster_data;
-	void				*copy_buff;
+
+	/* Unallocated clusters are read from here, if there is one */
+	struct disk_image		*backing;
 };
 
 struct qcow1_header_disk {
@@ -126,8 +165,18 @@ struct qcow2_header_disk {
 
 	u32				nb_snapshots;
 	u64				snapshots_offset;
+
+	/* Version 3 only */
+	u64				incompatible_features;
+	u64				compatible_features;
+	u64				autoclear_features;
+
+	u32				refcount_order;
+	u32				header_length;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image_params;
+
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params);
 
 #endif /* KVM__QCOW_H */
@@ -7,9 +7,9 @@
 #include <netinet/in.h>
 #include <sys/uio.h>
 
-#define UIP_BUF_STATUS_FREE	0
-#define UIP_BUF_STATUS_INUSE	1
-#define UIP_BUF_STATUS_USED	2
+#define UIP_BUF_NR		64
+#define UIP_BUF_MAX		4096
+#define UIP_CACHE_LINE		64
 
 #define UIP_ETH_P_IP		0X0800
 #define UIP_ETH_P_ARP		0X0806
@@ -23,6 +23,9 @@
 
 #define UIP_TCP_HDR_LEN		0x50
 #define UIP_TCP_WIN_SIZE	14600
+/* Our window scale, which the guest's window is scaled by is its own */
+#define UIP_TCP_WSCALE		7
+#define UIP_TCP_WSCALE_MAX	14
 #define UIP_TCP_FLAG_FIN	1
 #define UIP_TCP_FLAG_SYN	2
 #define UIP_TCP_FLAG_RST	4
@@ -30,6 +33,11 @@
 #define UIP_TCP_FLAG_ACK	16
 #define UIP_TCP_FLAG_URG	32
 
+#define UIP_TCP_OPT_EOL		0
+#define UIP_TCP_OPT_NOP		1
+#define UIP_TCP_OPT_MSS		2
+#define UIP_TCP_OPT_WSCALE	3
+
 #define UIP_BOOTP_VENDOR_SPECIFIC_LEN	64
 #define UIP_BOOTP_MAX_PAYLOAD_LEN	300
 #define UIP_DHCP_VENDOR_SPECIFIC_LEN	312
@@ -75,6 +83,12 @@
 #define UIP_MAX_TCP_PAYLOAD	(64*1024 - 20 - 20 - 1)
 #define UIP_MAX_UDP_PAYLOAD	(64*1024 - 20 -  8 - 1)
 
+/*
+ * Segments to a guest which can't take TSO frames carry at most what fits
+ * into a 1500 bytes MTU
+ */
+#define UIP_TCP_MSS		(1500 - 20 - 20)
+
 struct uip_eth_addr {
 	u8 addr[6];
 };
@@ -184,44 +198,84 @@ struct uip_dhcp {
 	u8 option[UIP_DHCP_OPTION_LEN];
 } __attribute__((packed));
 
+/*
+ * Sockets to remote hosts are looked up by their (sip, dip, sport, dport)
+ * tuple in hash tables of this many buckets.
+ */
+#define UIP_SOCKET_HASH_BITS	10
+#define UIP_SOCKET_HASH_SIZE	(1 << UIP_SOCKET_HASH_BITS)
+
+/*
+ * Bounded queue of buffers, lock-free for any number of producers and
+ * consumers: each slot tells through its sequence number whether it's ready
+ * to be pushed to or popped from at a given position. The mutex and cond are
+ * only used to sleep on an empty ring.
+ */
+struct uip_buf_ring_slot {
+	u32 seq;
+	struct uip_buf *buf;
+};
+
+struct uip_buf_ring {
+	struct uip_buf_ring_slot *slots;
+	u32 mask;
+	int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Pushers and poppers each get a cache line of their own */
+	u32 head __attribute__((aligned(UIP_CACHE_LINE)));
+	u32 tail __attribute__((aligned(UIP_CACHE_LINE)));
+} __attribute__((aligned(UIP_CACHE_LINE)));
+
 struct uip_info {
-	struct list_head udp_socket_head;
-	struct list_head tcp_socket_head;
+	struct hlist_head *udp_socket_hash;
+	struct hlist_head *tcp_socket_hash;
+	/* Closed TCP sockets, freed by the event loop */
+	struct hlist_head tcp_socket_dead;
 	pthread_mutex_t udp_socket_lock;
 	pthread_mutex_t tcp_socket_lock;
 	struct uip_eth_addr guest_mac;
 	struct uip_eth_addr host_mac;
-	pthread_cond_t buf_free_cond;
-	pthread_cond_t buf_used_cond;
-	struct list_head buf_head;
-	pthread_mutex_t buf_lock;
-	pthread_t udp_thread;
-	int udp_epollfd;
-	int buf_free_nr;
-	int buf_used_nr;
+	/* Buffers ready for, and filled with, frames to the guest */
+	struct uip_buf_ring buf_free;
+	struct uip_buf_ring buf_used;
+	struct uip_buf *bufs;
+	void *buf_mem;
+	pthread_t event_thread;
+	int event_fd;
 	u32 guest_ip;
 	u32 guest_netmask;
 	u32 host_ip;
 	u32 dns_ip[UIP_DHCP_MAX_DNS_SERVER_NR];
 	char *domain_name;
 	u32 buf_nr;
+	/* Negotiated by the guest: it takes partial checksums, and TSO frames */
+	bool guest_csum;
+	bool guest_tso4;
 };
 
 struct uip_buf {
-	struct list_head list;
 	struct uip_info *info;
 	int vnet_len;
 	int eth_len;
-	int status;
 	char *vnet;
 	char *eth;
 	int id;
+} __attribute__((aligned(UIP_CACHE_LINE)));
+
+/*
+ * Host sockets are all polled by a single event loop thread, which calls
+ * handle() with the epoll events of the socket the uip_event is part of.
+ */
+struct uip_event {
+	void (*handle)(struct uip_event *ev, u32 events);
 };
 
 struct uip_udp_socket {
 	struct sockaddr_in addr;
-	struct list_head list;
-	pthread_mutex_t *lock;
+	struct hlist_node node;
+	struct uip_event event;
+	struct uip_info *info;
 	u32 dport, sport;
 	u32 dip, sip;
 	int fd;
@@ -229,12 +283,23 @@ struct uip_udp_socket {
 
 struct uip_tcp_socket {
 	struct sockaddr_in addr;
-	struct list_head list;
+	struct hlist_node node;
+	struct uip_event event;
 	struct uip_info *info;
-	pthread_mutex_t *lock;
-	pthread_t thread;
+	/* Serializes the guest side (uip_tx) and the event loop */
+	pthread_mutex_t mutex;
 	u32 dport, sport;
 	u32 guest_acked;
+	/*
+	 * How much the guest takes past guest_acked, and how much of its data
+	 * we take, both in bytes
+	 */
+	u32 guest_window;
+	u32 window;
+	/* Window scale the guest offered, if it did */
+	u8 guest_wscale;
+	int wscale_ok;
+	u16 mss;
 	/*
 	 * Initial Sequence Number
 	 */
@@ -244,8 +309,11 @@ struct uip_tcp_socket {
 	u32 seq_server;
 	int write_done;
 	int read_done;
+	int connected;
+	int closed;
+	/* Not read from, until the guest opens its window */
+	int paused;
 	u32 dip, sip;
-	u8 *payload;
 	int fd;
 };
 
@@ -311,6 +379,11 @@ static inline bool uip_tcp_is_fin(struct uip_tcp *tcp)
 	return (tcp->flg & UIP_TCP_FLAG_FIN) != 0;
 }
 
+static inline bool uip_tcp_is_rst(struct uip_tcp *tcp)
+{
+	return (tcp->flg & UIP_TCP_FLAG_RST) != 0;
+}
+
 static inline u32 uip_tcp_isn(struct uip_tcp *tcp)
 {
 	return ntohl(tcp->seq);
@@ -324,6 +397,13 @@ static inline u32 uip_tcp_isn_alloc(void)
 	return 10000000;
 }
 
+static inline u32 uip_socket_hash(u32 sip, u32 dip, u16 sport, u16 dport)
+{
+	u32 key = sip ^ dip ^ ((u32)sport << 16 | dport);
+
+	return (key * 0x9e370001U) >> (32 - UIP_SOCKET_HASH_BITS);
+}
+
 static inline u16 uip_eth_hdrlen(struct uip_eth *eth)
 {
 	return sizeof(*eth);
@@ -333,6 +413,12 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info);
 int uip_rx(struct iovec *iov, u16 in, struct uip_info *info);
 int uip_init(struct uip_info *info);
 
+int uip_event_init(struct uip_info *info);
+int uip_event_add(struct uip_info *info, int fd, struct uip_event *ev, u32 events);
+int uip_event_mod(struct uip_info *info, int fd, struct uip_event *ev, u32 events);
+void uip_event_del(struct uip_info *info, int fd);
+void uip_tcp_socket_reap(struct uip_info *info);
+
 int uip_tx_do_ipv4_udp_dhcp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_icmp(struct uip_tx_arg *arg);
 int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg);
@@ -344,7 +430,9 @@ u16 uip_csum_icmp(struct uip_icmp *icmp);
 u16 uip_csum_udp(struct uip_udp *udp);
 u16 uip_csum_tcp(struct uip_tcp *tcp);
 u16 uip_csum_ip(struct uip_ip *ip);
+void uip_csum_partial(struct uip_buf *buf, u16 csum_offset);
 
+int uip_buf_init(struct uip_info *info);
 struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf);
 struct uip_buf *uip_buf_get_used(struct uip_info *info);
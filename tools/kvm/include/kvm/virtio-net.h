@@ -7,17 +7,23 @@ struct virtio_net_params {
 	const char *guest_ip;
 	const char *host_ip;
 	const char *script;
+	const char *ifname;
 	char guest_mac[6];
 	char host_mac[6];
 	struct kvm *kvm;
 	int mode;
 	int vhost;
 	int fd;
+	int queues;
+	int coalesce_usecs;
+	int coalesce_packets;
+	int buffers;
 };
 
 void virtio_net__init(const struct virtio_net_params *params);
 
 #define NET_MODE_USER	0
 #define NET_MODE_TAP	1
+#define NET_MODE_PACKET	2
 
 #endif /* KVM__VIRTIO_NET_H */
@@ -6,8 +6,17 @@
 
 #include <linux/types.h>
 
-#define VIRTIO_PCI_MAX_VQ	3
+#define VIRTIO_PCI_MAX_VQ	32
 #define VIRTIO_PCI_MAX_CONFIG	1
+#define VIRTIO_PCI_MAX_MSIX	(VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG)
+
+/*
+ * The MSI-X table and the PBA share BAR 1: the table sits at offset 0 and
+ * the PBA right after it. Each table entry is 16 bytes, and the BAR has to
+ * be a power of two in size.
+ */
+#define VIRTIO_PCI_MSIX_TABLE_SIZE	(PCI_IO_SIZE * 4)
+#define VIRTIO_PCI_MSIX_BAR_SIZE	(VIRTIO_PCI_MSIX_TABLE_SIZE * 2)
 
 struct kvm;
 
@@ -31,7 +40,7 @@ struct virtio_pci {
 	u32			gsis[VIRTIO_PCI_MAX_VQ];
 	u32			msix_io_block;
 	u64			msix_pba;
-	struct msix_table	msix_table[VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG];
+	struct msix_table	msix_table[VIRTIO_PCI_MAX_MSIX];
 
 	/* virtio queue */
 	u16			queue_selector;
@@ -55,6 +55,9 @@ static inline void *guest_pfn_to_host(struct kvm *kvm, u32 pfn)
 
 
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
+struct vring_used_elem *virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
+							    u32 len, u16 offset);
+void virt_queue__used_idx_advance(struct virt_queue *queue, u16 nr);
 
 bool virtio_queue__should_signal(struct virt_queue *vq);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[], u16 *out, u16 *in, struct kvm *kvm);
@@ -7,6 +7,8 @@
 #include "kvm/builtin-pause.h"
 #include "kvm/builtin-resume.h"
 #include "kvm/builtin-balloon.h"
+#include "kvm/builtin-throttle.h"
+#include "kvm/builtin-bench.h"
 #include "kvm/builtin-list.h"
 #include "kvm/builtin-version.h"
 #include "kvm/builtin-setup.h"
@@ -23,6 +25,8 @@ struct cmd_struct kvm_commands[] = {
 	{ "resume",	kvm_cmd_resume,		kvm_resume_help,	0 },
 	{ "debug",	kvm_cmd_debug,		kvm_debug_help,		0 },
 	{ "balloon",	kvm_cmd_balloon,	kvm_balloon_help,	0 },
+	{ "throttle",	kvm_cmd_throttle,	kvm_throttle_help,	0 },
+	{ "bench",	kvm_cmd_bench,		kvm_bench_help,		0 },
 	{ "list",	kvm_cmd_list,		kvm_list_help,		0 },
 	{ "version",	kvm_cmd_version,	NULL,			0 },
 	{ "--version",	kvm_cmd_version,	NULL,			0 },
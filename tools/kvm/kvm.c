@@ -5,6 +5,7 @@
 #include "kvm/kvm-cpu.h"
 #include "kvm/kvm-ipc.h"
 
+#include <linux/kernel.h>
 #include <linux/kvm.h>
 #include <linux/err.h>
 
@@ -128,6 +129,7 @@ static struct kvm *kvm__new(void)
 
 	kvm->sys_fd = -1;
 	kvm->vm_fd = -1;
+	INIT_LIST_HEAD(&kvm->mem_banks);
 
 	return kvm;
 }
@@ -251,8 +253,15 @@ int kvm__enumerate_instances(int (*callback)(const char *name, int fd))
 
 int kvm__exit(struct kvm *kvm)
 {
+	struct kvm_mem_bank *bank, *tmp;
+
 	kvm__stop_timer(kvm);
 
+	list_for_each_entry_safe(bank, tmp, &kvm->mem_banks, list) {
+		list_del(&bank->list);
+		free(bank);
+	}
+
 	kvm__arch_delete_ram(kvm);
 	kvm_ipc__stop();
 	kvm__remove_socket(kvm->name);
@@ -270,8 +279,13 @@ int kvm__exit(struct kvm *kvm)
 int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace_addr)
 {
 	struct kvm_userspace_memory_region mem;
+	struct kvm_mem_bank *bank;
 	int ret;
 
+	bank = malloc(sizeof(*bank));
+	if (!bank)
+		return -ENOMEM;
+
 	mem = (struct kvm_userspace_memory_region) {
 		.slot			= kvm->mem_slots++,
 		.guest_phys_addr	= guest_phys,
@@ -280,8 +294,34 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size, void *userspace
 	};
 
 	ret = ioctl(kvm->vm_fd, KVM_SET_USER_MEMORY_REGION, &mem);
-	if (ret < 0)
-		return -errno;
+	if (ret < 0) {
+		ret = -errno;
+		free(bank);
+		return ret;
+	}
+
+	*bank = (struct kvm_mem_bank) {
+		.guest_phys_addr	= guest_phys,
+		.host_addr		= userspace_addr,
+		.size			= size,
+	};
+	list_add_tail(&bank->list, &kvm->mem_banks);
+
+	return 0;
+}
+
+int kvm__for_each_mem_bank(struct kvm *kvm,
+			   int (*fun)(struct kvm *kvm, struct kvm_mem_bank *bank, void *data),
+			   void *data)
+{
+	struct kvm_mem_bank *bank;
+	int ret;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		ret = fun(kvm, bank, data);
+		if (ret)
+			return ret;
+	}
 
 	return 0;
 }
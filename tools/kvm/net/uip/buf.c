@@ -1,86 +1,180 @@
 #include "kvm/uip.h"
+#include "kvm/barrier.h"
 
+#include <linux/virtio_net.h>
+#include <linux/compiler.h>
 #include <linux/kernel.h>
-#include <linux/list.h>
 
-struct uip_buf *uip_buf_get_used(struct uip_info *info)
+/*
+ * Frames to the guest go through a ring of free buffers, which whoever has
+ * something for the guest pops from, and a ring of used ones, which uip_rx()
+ * pops from and pushes back to the free ring. Getting and putting a buffer
+ * costs neither a lock nor a syscall, unless a ring is empty and its
+ * consumer has to sleep.
+ */
+
+static int uip_buf_ring_init(struct uip_buf_ring *ring, u32 size)
 {
-	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_used_nr > 0))
-		pthread_cond_wait(&info->buf_used_cond, &info->buf_lock);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_USED) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_used_nr--;
-			found = true;
-			break;
-		}
-	}
+	u32 i;
+
+	ring->slots = calloc(size, sizeof(*ring->slots));
+	if (!ring->slots)
+		return -ENOMEM;
+
+	for (i = 0; i < size; i++)
+		ring->slots[i].seq = i;
 
-	mutex_unlock(&info->buf_lock);
+	ring->mask	= size - 1;
+	ring->head	= 0;
+	ring->tail	= 0;
+	ring->waiters	= 0;
 
-	return found ? buf : NULL;
+	mutex_init(&ring->lock);
+	pthread_cond_init(&ring->cond, NULL);
+
+	return 0;
 }
 
-struct uip_buf *uip_buf_get_free(struct uip_info *info)
+/* There are never more buffers than slots, so this can't fail */
+static void uip_buf_ring_push(struct uip_buf_ring *ring, struct uip_buf *buf)
 {
-	struct uip_buf *buf;
-	bool found = false;
-
-	mutex_lock(&info->buf_lock);
-
-	while (!(info->buf_free_nr > 0))
-		pthread_cond_wait(&info->buf_free_cond, &info->buf_lock);
-
-	list_for_each_entry(buf, &info->buf_head, list) {
-		if (buf->status == UIP_BUF_STATUS_FREE) {
-			/*
-			 * Set status to INUSE immediately to prevent
-			 * someone from using this buf until we free it
-			 */
-			buf->status = UIP_BUF_STATUS_INUSE;
-			info->buf_free_nr--;
-			found = true;
-			break;
-		}
+	struct uip_buf_ring_slot *slot;
+	u32 pos;
+
+	do {
+		pos	= ACCESS_ONCE(ring->head);
+		slot	= &ring->slots[pos & ring->mask];
+	} while (ACCESS_ONCE(slot->seq) != pos ||
+		 !__sync_bool_compare_and_swap(&ring->head, pos, pos + 1));
+
+	slot->buf = buf;
+	wmb();
+	slot->seq = pos + 1;
+
+	/* Pairs with the barrier in uip_buf_ring_pop_wait() */
+	mb();
+	if (ACCESS_ONCE(ring->waiters)) {
+		mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->cond);
+		mutex_unlock(&ring->lock);
 	}
+}
 
-	mutex_unlock(&info->buf_lock);
+static struct uip_buf *uip_buf_ring_pop(struct uip_buf_ring *ring)
+{
+	struct uip_buf_ring_slot *slot;
+	struct uip_buf *buf;
+	u32 pos;
+
+	do {
+		pos	= ACCESS_ONCE(ring->tail);
+		slot	= &ring->slots[pos & ring->mask];
+
+		/* Not pushed to yet, or still being pushed to */
+		if ((int)(ACCESS_ONCE(slot->seq) - (pos + 1)) < 0)
+			return NULL;
+	} while (ACCESS_ONCE(slot->seq) != pos + 1 ||
+		 !__sync_bool_compare_and_swap(&ring->tail, pos, pos + 1));
 
-	return found ? buf : NULL;
+	buf = slot->buf;
+	mb();
+	slot->seq = pos + ring->mask + 1;
+
+	return buf;
 }
 
-struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+static struct uip_buf *uip_buf_ring_pop_wait(struct uip_buf_ring *ring)
 {
-	mutex_lock(&info->buf_lock);
+	struct uip_buf *buf;
+
+	buf = uip_buf_ring_pop(ring);
+	if (buf)
+		return buf;
 
-	buf->status = UIP_BUF_STATUS_USED;
-	info->buf_used_nr++;
-	pthread_cond_signal(&info->buf_used_cond);
+	mutex_lock(&ring->lock);
+	ring->waiters++;
+
+	/*
+	 * Pushers look for waiters after pushing, check the ring again once
+	 * they can see us
+	 */
+	mb();
+	while (!(buf = uip_buf_ring_pop(ring)))
+		pthread_cond_wait(&ring->cond, &ring->lock);
 
-	mutex_unlock(&info->buf_lock);
+	ring->waiters--;
+	mutex_unlock(&ring->lock);
 
 	return buf;
 }
 
-struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
+int uip_buf_init(struct uip_info *info)
 {
-	mutex_lock(&info->buf_lock);
+	size_t vnet_size, eth_size;
+	struct uip_buf *buf;
+	u32 size, i;
+	int r;
+
+	if (!info->buf_nr)
+		info->buf_nr = UIP_BUF_NR;
+	info->buf_nr = min(info->buf_nr, (u32)UIP_BUF_MAX);
+
+	/* Rings are a power of two in size, and at least as large as needed */
+	for (size = 1; size < info->buf_nr; size <<= 1)
+		;
+
+	r = uip_buf_ring_init(&info->buf_free, size);
+	if (!r)
+		r = uip_buf_ring_init(&info->buf_used, size);
+	if (r)
+		return r;
+
+	/* Each buffer's data starts on a cache line of its own */
+	vnet_size	= ALIGN(sizeof(struct virtio_net_hdr), UIP_CACHE_LINE);
+	eth_size	= ALIGN(1024*64 + sizeof(struct uip_pseudo_hdr), UIP_CACHE_LINE);
+
+	if (posix_memalign((void **)&info->bufs, UIP_CACHE_LINE, info->buf_nr * sizeof(*buf)) ||
+	    posix_memalign(&info->buf_mem, UIP_CACHE_LINE, info->buf_nr * (vnet_size + eth_size)))
+		return -ENOMEM;
+
+	memset(info->bufs, 0, info->buf_nr * sizeof(*buf));
+	memset(info->buf_mem, 0, info->buf_nr * (vnet_size + eth_size));
+
+	for (i = 0; i < info->buf_nr; i++) {
+		buf		= &info->bufs[i];
+		buf->info	= info;
+		buf->id		= i;
+		buf->vnet	= info->buf_mem + i * (vnet_size + eth_size);
+		buf->vnet_len	= sizeof(struct virtio_net_hdr);
+		buf->eth	= buf->vnet + vnet_size;
+		buf->eth_len	= 1024*64 + sizeof(struct uip_pseudo_hdr);
+
+		uip_buf_ring_push(&info->buf_free, buf);
+	}
 
-	buf->status = UIP_BUF_STATUS_FREE;
-	info->buf_free_nr++;
-	pthread_cond_signal(&info->buf_free_cond);
+	return 0;
+}
 
-	mutex_unlock(&info->buf_lock);
+struct uip_buf *uip_buf_get_used(struct uip_info *info)
+{
+	return uip_buf_ring_pop_wait(&info->buf_used);
+}
+
+struct uip_buf *uip_buf_get_free(struct uip_info *info)
+{
+	return uip_buf_ring_pop_wait(&info->buf_free);
+}
+
+struct uip_buf *uip_buf_set_used(struct uip_info *info, struct uip_buf *buf)
+{
+	uip_buf_ring_push(&info->buf_used, buf);
+
+	return buf;
+}
+
+struct uip_buf *uip_buf_set_free(struct uip_info *info, struct uip_buf *buf)
+{
+	uip_buf_ring_push(&info->buf_free, buf);
 
 	return buf;
 }
@@ -99,11 +193,12 @@ struct uip_buf *uip_buf_clone(struct uip_tx_arg *arg)
 	buf = uip_buf_get_free(info);
 
 	/*
-	 * Clone buffer
+	 * Clone buffer. Replies are checksummed by us, and don't inherit the
+	 * offloads of the guest's frame.
 	 */
-	memcpy(buf->vnet, arg->vnet, arg->vnet_len);
+	memset(buf->vnet, 0, sizeof(struct virtio_net_hdr));
 	memcpy(buf->eth, arg->eth, arg->eth_len);
-	buf->vnet_len	= arg->vnet_len;
+	buf->vnet_len	= sizeof(struct virtio_net_hdr);
 	buf->eth_len	= arg->eth_len;
 
 	eth2		= (struct uip_eth *)buf->eth;
@@ -5,6 +5,26 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 
+/*
+ * TSO and UFO frames from the guest are taken as they are: their payload goes
+ * to the host socket in one go, and is segmented by the host stack. Their
+ * checksums, partial or not, aren't looked at either. Only the IP length is
+ * trusted no further than the frame itself goes.
+ */
+static void uip_tx_fixup_gso(struct uip_tx_arg *arg)
+{
+	struct uip_ip *ip = (struct uip_ip *)arg->eth;
+	int len;
+
+	if (arg->vnet_len < (int)sizeof(*arg->vnet) ||
+	    (arg->vnet->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE)
+		return;
+
+	len = arg->eth_len - uip_eth_hdrlen(&ip->eth);
+	if (len > 0 && len <= 0xffff && len < ntohs(ip->len))
+		ip->len = htons(len);
+}
+
 int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 {
 	struct virtio_net_hdr *vnet;
@@ -62,6 +82,7 @@ int uip_tx(struct iovec *iov, u16 out, struct uip_info *info)
 		uip_tx_do_arp(&arg);
 		break;
 	case UIP_ETH_P_IP:
+		uip_tx_fixup_gso(&arg);
 		uip_tx_do_ipv4(&arg);
 		break;
 	default:
@@ -137,54 +158,23 @@ out:
 
 int uip_init(struct uip_info *info)
 {
-	struct list_head *udp_socket_head;
-	struct list_head *tcp_socket_head;
-	struct list_head *buf_head;
-	struct uip_buf *buf;
-	int buf_nr;
-	int i;
+	int r;
 
-	udp_socket_head	= &info->udp_socket_head;
-	tcp_socket_head	= &info->tcp_socket_head;
-	buf_head	= &info->buf_head;
-	buf_nr		= info->buf_nr;
+	info->udp_socket_hash = calloc(UIP_SOCKET_HASH_SIZE, sizeof(struct hlist_head));
+	info->tcp_socket_hash = calloc(UIP_SOCKET_HASH_SIZE, sizeof(struct hlist_head));
+	if (!info->udp_socket_hash || !info->tcp_socket_hash)
+		return -ENOMEM;
 
-	INIT_LIST_HEAD(udp_socket_head);
-	INIT_LIST_HEAD(tcp_socket_head);
-	INIT_LIST_HEAD(buf_head);
+	INIT_HLIST_HEAD(&info->tcp_socket_dead);
 
 	pthread_mutex_init(&info->udp_socket_lock, NULL);
 	pthread_mutex_init(&info->tcp_socket_lock, NULL);
-	pthread_mutex_init(&info->buf_lock, NULL);
-
-	pthread_cond_init(&info->buf_used_cond, NULL);
-	pthread_cond_init(&info->buf_free_cond, NULL);
-
-
-	for (i = 0; i < buf_nr; i++) {
-		buf = malloc(sizeof(*buf));
-		memset(buf, 0, sizeof(*buf));
-
-		buf->status	= UIP_BUF_STATUS_FREE;
-		buf->info	= info;
-		buf->id		= i;
-		list_add_tail(&buf->list, buf_head);
-	}
-
-	list_for_each_entry(buf, buf_head, list) {
-		buf->vnet	= malloc(sizeof(struct virtio_net_hdr));
-		buf->vnet_len	= sizeof(struct virtio_net_hdr);
-		buf->eth	= malloc(1024*64 + sizeof(struct uip_pseudo_hdr));
-		buf->eth_len	= 1024*64 + sizeof(struct uip_pseudo_hdr);
-
-		memset(buf->vnet, 0, buf->vnet_len);
-		memset(buf->eth, 0, buf->eth_len);
-	}
 
-	info->buf_free_nr = buf_nr;
-	info->buf_used_nr = 0;
+	r = uip_buf_init(info);
+	if (r < 0)
+		return r;
 
 	uip_dhcp_get_dns(info);
 
-	return 0;
+	return uip_event_init(info);
 }
@@ -1,22 +1,82 @@
 #include "kvm/uip.h"
 
-static u16 uip_csum(u16 csum, u8 *addr, u16 count)
+#include <linux/virtio_net.h>
+#include <linux/kernel.h>
+
+/*
+ * Ones' complement sum, 64 bits at a time: the sum of 16-bit words only
+ * depends on their value, not on the width they are added at, so wider
+ * words are folded down to 16 bits at the end.
+ */
+static u64 uip_csum_add(u64 sum, const void *addr, int count)
 {
-	long sum = csum;
+	const u8 *p = addr;
+	u64 v;
+	u32 w;
+	u16 h;
+
+	while (count >= 8) {
+		memcpy(&v, p, 8);
+		sum	+= v;
+		sum	+= sum < v;
+		p	+= 8;
+		count	-= 8;
+	}
+
+	if (count >= 4) {
+		memcpy(&w, p, 4);
+		sum	+= w;
+		sum	+= sum < w;
+		p	+= 4;
+		count	-= 4;
+	}
 
-	while (count > 1) {
-		sum	+= *(u16 *)addr;
-		addr	+= 2;
+	if (count >= 2) {
+		memcpy(&h, p, 2);
+		sum	+= h;
+		sum	+= sum < h;
+		p	+= 2;
 		count	-= 2;
 	}
 
-	if (count > 0)
-		sum += *(unsigned char *)addr;
+	/* An odd byte is padded with a zero one */
+	if (count > 0) {
+		h = 0;
+		memcpy(&h, p, 1);
+		sum	+= h;
+		sum	+= sum < h;
+	}
+
+	return sum;
+}
+
+static u16 uip_csum_fold(u64 sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
 
-	while (sum>>16)
-		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
 
-	return ~sum;
+static u16 uip_csum(u16 csum, u8 *addr, u16 count)
+{
+	return ~uip_csum_fold(uip_csum_add(csum, addr, count));
+}
+
+/* Sum of the pseudo header TCP and UDP checksums start with */
+static u64 uip_csum_pseudo(struct uip_ip *ip, u16 len)
+{
+	struct uip_pseudo_hdr hdr;
+
+	hdr.sip   = ip->sip;
+	hdr.dip	  = ip->dip;
+	hdr.zero  = 0;
+	hdr.proto = ip->proto;
+	hdr.len   = htons(len);
+
+	return uip_csum_add(0, &hdr, sizeof(hdr));
 }
 
 u16 uip_csum_ip(struct uip_ip *ip)
@@ -34,59 +94,48 @@ u16 uip_csum_icmp(struct uip_icmp *icmp)
 
 u16 uip_csum_udp(struct uip_udp *udp)
 {
-	struct uip_pseudo_hdr hdr;
-	struct uip_ip *ip;
 	int udp_len;
-	u8 *pad;
-
-	ip	  = &udp->ip;
-
-	hdr.sip   = ip->sip;
-	hdr.dip	  = ip->dip;
-	hdr.zero  = 0;
-	hdr.proto = ip->proto;
-	hdr.len   = udp->len;
 
 	udp_len	  = uip_udp_len(udp);
 
-	if (udp_len % 2) {
-		pad = (u8 *)&udp->sport + udp_len;
-		*pad = 0;
-		memcpy((u8 *)&udp->sport + udp_len + 1, &hdr, sizeof(hdr));
-		return uip_csum(0, (u8 *)&udp->sport, udp_len + 1 + sizeof(hdr));
-	} else {
-		memcpy((u8 *)&udp->sport + udp_len, &hdr, sizeof(hdr));
-		return uip_csum(0, (u8 *)&udp->sport, udp_len + sizeof(hdr));
-	}
-
+	return ~uip_csum_fold(uip_csum_add(uip_csum_pseudo(&udp->ip, udp_len),
+					   &udp->sport, udp_len));
 }
 
 u16 uip_csum_tcp(struct uip_tcp *tcp)
 {
-	struct uip_pseudo_hdr hdr;
 	struct uip_ip *ip;
 	u16 tcp_len;
-	u8 *pad;
 
 	ip	  = &tcp->ip;
 	tcp_len   = ntohs(ip->len) - uip_ip_hdrlen(ip);
 
-	hdr.sip   = ip->sip;
-	hdr.dip	  = ip->dip;
-	hdr.zero  = 0;
-	hdr.proto = ip->proto;
-	hdr.len   = htons(tcp_len);
-
 	if (tcp_len > UIP_MAX_TCP_PAYLOAD + 20)
 		pr_warning("tcp_len(%d) is too large", tcp_len);
 
-	if (tcp_len % 2) {
-		pad = (u8 *)&tcp->sport + tcp_len;
-		*pad = 0;
-		memcpy((u8 *)&tcp->sport + tcp_len + 1, &hdr, sizeof(hdr));
-		return uip_csum(0, (u8 *)&tcp->sport, tcp_len + 1 + sizeof(hdr));
-	} else {
-		memcpy((u8 *)&tcp->sport + tcp_len, &hdr, sizeof(hdr));
-		return uip_csum(0, (u8 *)&tcp->sport, tcp_len + sizeof(hdr));
-	}
+	return ~uip_csum_fold(uip_csum_add(uip_csum_pseudo(ip, tcp_len),
+					   &tcp->sport, tcp_len));
+}
+
+/*
+ * Leaves the TCP or UDP checksum of a frame to the guest, which only has to
+ * compute it if it forwards the frame: the checksum field, at csum_offset in
+ * the L4 header, only holds the sum of the pseudo header.
+ */
+void uip_csum_partial(struct uip_buf *buf, u16 csum_offset)
+{
+	struct virtio_net_hdr *vnet;
+	struct uip_ip *ip;
+	u16 csum_start, l4_len;
+
+	vnet		= (struct virtio_net_hdr *)buf->vnet;
+	ip		= (struct uip_ip *)buf->eth;
+	csum_start	= uip_eth_hdrlen(&ip->eth) + uip_ip_hdrlen(ip);
+	l4_len		= ntohs(ip->len) - uip_ip_hdrlen(ip);
+
+	vnet->flags		|= VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vnet->csum_start	= csum_start;
+	vnet->csum_offset	= csum_offset;
+
+	*(u16 *)(buf->eth + csum_start + csum_offset) = uip_csum_fold(uip_csum_pseudo(ip, l4_len));
 }
@@ -0,0 +1,84 @@
+#include "kvm/uip.h"
+
+#include <linux/kernel.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+/*
+ * Rather than a thread per connection, the sockets uip opens to remote hosts
+ * are non-blocking and all polled by one thread, which handles them as they
+ * become ready. Each event is handled with a single read, so that a busy
+ * socket doesn't hold back the others.
+ */
+
+#define UIP_EVENT_MAX_EVENTS	64
+
+static void *uip_event_thread(void *p)
+{
+	struct epoll_event events[UIP_EVENT_MAX_EVENTS];
+	struct uip_info *info = p;
+	struct uip_event *ev;
+	int nfds, i;
+
+	while (1) {
+		nfds = epoll_wait(info->event_fd, events, UIP_EVENT_MAX_EVENTS, -1);
+		if (nfds < 0)
+			continue;
+
+		for (i = 0; i < nfds; i++) {
+			ev = events[i].data.ptr;
+			ev->handle(ev, events[i].events);
+		}
+
+		/*
+		 * Sockets closed so far are out of the epoll set, and none of
+		 * the events above refers to them anymore.
+		 */
+		uip_tcp_socket_reap(info);
+	}
+
+	return NULL;
+}
+
+int uip_event_init(struct uip_info *info)
+{
+	info->event_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (info->event_fd < 0)
+		return -errno;
+
+	if (pthread_create(&info->event_thread, NULL, uip_event_thread, info)) {
+		close(info->event_fd);
+		info->event_fd = -1;
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+static int uip_event_ctl(struct uip_info *info, int op, int fd, struct uip_event *ev, u32 events)
+{
+	struct epoll_event event = {
+		.events		= events,
+		.data.ptr	= ev,
+	};
+
+	if (epoll_ctl(info->event_fd, op, fd, &event) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int uip_event_add(struct uip_info *info, int fd, struct uip_event *ev, u32 events)
+{
+	return uip_event_ctl(info, EPOLL_CTL_ADD, fd, ev, events);
+}
+
+int uip_event_mod(struct uip_info *info, int fd, struct uip_event *ev, u32 events)
+{
+	return uip_event_ctl(info, EPOLL_CTL_MOD, fd, ev, events);
+}
+
+void uip_event_del(struct uip_info *info, int fd)
+{
+	epoll_ctl(info->event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
@@ -3,37 +3,71 @@
 #include <linux/virtio_net.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/sockios.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+/*
+ * Called with sk->mutex held. Returns true when this closed the socket, in
+ * which case the caller unlinks it once the mutex is dropped.
+ */
+static bool uip_tcp_socket_close(struct uip_tcp_socket *sk)
+{
+	if (sk->closed || !sk->write_done || !sk->read_done)
+		return false;
+
+	sk->closed = 1;
+	uip_event_del(sk->info, sk->fd);
+	close(sk->fd);
+
+	return true;
+}
 
-static int uip_tcp_socket_close(struct uip_tcp_socket *sk, int how)
+/* Hands the socket over to the event loop, which frees it */
+static void uip_tcp_socket_unlink(struct uip_tcp_socket *sk)
 {
-	shutdown(sk->fd, how);
+	struct uip_info *info = sk->info;
 
-	if (sk->write_done && sk->read_done) {
-		shutdown(sk->fd, SHUT_RDWR);
-		close(sk->fd);
+	mutex_lock(&info->tcp_socket_lock);
+	hlist_del(&sk->node);
+	hlist_add_head(&sk->node, &info->tcp_socket_dead);
+	mutex_unlock(&info->tcp_socket_lock);
+}
 
-		mutex_lock(sk->lock);
-		list_del(&sk->list);
-		mutex_unlock(sk->lock);
+void uip_tcp_socket_reap(struct uip_info *info)
+{
+	struct hlist_node *pos, *n;
+	struct uip_tcp_socket *sk;
+
+	mutex_lock(&info->tcp_socket_lock);
+	hlist_for_each_entry_safe(sk, pos, n, &info->tcp_socket_dead, node) {
+		hlist_del(&sk->node);
+
+		/* Someone may still be looking at it from uip_tcp_socket_find() */
+		mutex_lock(&sk->mutex);
+		mutex_unlock(&sk->mutex);
 
 		free(sk);
 	}
-
-	return 0;
+	mutex_unlock(&info->tcp_socket_lock);
 }
 
+/* Returns the socket with its mutex held */
 static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
+	struct hlist_head *sk_head;
 	pthread_mutex_t *sk_lock;
 	struct uip_tcp_socket *sk;
+	struct hlist_node *pos;
 
-	sk_head = &arg->info->tcp_socket_head;
+	sk_head = &arg->info->tcp_socket_hash[uip_socket_hash(sip, dip, sport, dport)];
 	sk_lock = &arg->info->tcp_socket_lock;
 
 	mutex_lock(sk_lock);
-	list_for_each_entry(sk, sk_head, list) {
+	hlist_for_each_entry(sk, pos, sk_head, node) {
 		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
+			mutex_lock(&sk->mutex);
 			mutex_unlock(sk_lock);
 			return sk;
 		}
@@ -43,64 +77,176 @@ static struct uip_tcp_socket *uip_tcp_socket_find(struct uip_tx_arg *arg, u32 si
 	return NULL;
 }
 
+/* The options of the guest's SYN which we care about */
+static void uip_tcp_socket_syn_options(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
+{
+	u8 *opt, *end;
+
+	opt = (u8 *)&tcp->sport + 20;
+	end = (u8 *)&tcp->sport + uip_tcp_hdrlen(tcp);
+
+	while (opt < end) {
+		if (opt[0] == UIP_TCP_OPT_EOL)
+			break;
+
+		if (opt[0] == UIP_TCP_OPT_NOP) {
+			opt++;
+			continue;
+		}
+
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+			break;
+
+		if (opt[0] == UIP_TCP_OPT_MSS && opt[1] == 4) {
+			sk->mss = opt[2] << 8 | opt[3];
+			sk->mss = max(sk->mss, (u16)536);
+		} else if (opt[0] == UIP_TCP_OPT_WSCALE && opt[1] == 3) {
+			sk->guest_wscale = min(opt[2], (u8)UIP_TCP_WSCALE_MAX);
+			sk->wscale_ok = 1;
+		}
+
+		opt += opt[1];
+	}
+}
+
+/*
+ * Our window is what the host socket can take before writes to it would
+ * block, so that what the guest sends in it doesn't need retransmitting.
+ */
+static void uip_tcp_socket_update_window(struct uip_tcp_socket *sk)
+{
+	socklen_t len = sizeof(int);
+	int sndbuf, outq;
+
+	if (getsockopt(sk->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 ||
+	    ioctl(sk->fd, SIOCOUTQ, &outq) < 0)
+		return;
+
+	/* Half of the buffer goes to bookkeeping */
+	sk->window = max(sndbuf / 2 - outq, 0);
+}
+
+static void uip_tcp_socket_event(struct uip_event *ev, u32 events);
+
+/*
+ * The connection to the remote host is started here, and the guest gets its
+ * SYN-ACK from the event loop once it's established.
+ */
 static struct uip_tcp_socket *uip_tcp_socket_alloc(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
+	struct uip_info *info = arg->info;
 	struct uip_tcp_socket *sk;
-	pthread_mutex_t *sk_lock;
 	struct uip_tcp *tcp;
-	struct uip_ip *ip;
 	int ret;
 
 	tcp = (struct uip_tcp *)arg->eth;
-	ip = (struct uip_ip *)arg->eth;
 
-	sk_head = &arg->info->tcp_socket_head;
-	sk_lock = &arg->info->tcp_socket_lock;
+	sk = calloc(1, sizeof(*sk));
+	if (!sk)
+		return NULL;
 
-	sk = malloc(sizeof(*sk));
-	memset(sk, 0, sizeof(*sk));
+	mutex_init(&sk->mutex);
+	sk->info			= info;
+	sk->event.handle		= uip_tcp_socket_event;
 
-	sk->lock			= sk_lock;
-	sk->info			= arg->info;
+	sk->fd				= socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sk->fd < 0)
+		goto err_free;
 
-	sk->fd				= socket(AF_INET, SOCK_STREAM, 0);
 	sk->addr.sin_family		= AF_INET;
 	sk->addr.sin_addr.s_addr	= dip;
 	sk->addr.sin_port		= dport;
 
 	ret = connect(sk->fd, (struct sockaddr *)&sk->addr, sizeof(sk->addr));
-	if (ret) {
-		free(sk);
+	if (ret < 0 && errno != EINPROGRESS)
+		goto err_close;
+
+	sk->sip		= sip;
+	sk->dip		= dip;
+	sk->sport	= sport;
+	sk->dport	= dport;
+
+	/*
+	 * Setup ISN number
+	 */
+	sk->isn_guest	= uip_tcp_isn(tcp);
+	sk->isn_server	= uip_tcp_isn_alloc();
+	sk->seq_server	= sk->isn_server;
+	sk->ack_server	= sk->isn_guest + 1;
+
+	/* Until the guest tells otherwise */
+	sk->mss		= UIP_TCP_MSS;
+	sk->window	= UIP_TCP_WIN_SIZE;
+	sk->guest_acked	= sk->isn_server + 1;
+	sk->guest_window = ntohs(tcp->win);
+	uip_tcp_socket_syn_options(sk, tcp);
+
+	mutex_lock(&info->tcp_socket_lock);
+	hlist_add_head(&sk->node, &info->tcp_socket_hash[uip_socket_hash(sip, dip, sport, dport)]);
+	mutex_unlock(&info->tcp_socket_lock);
+
+	/* Writable once connected, or once the connection failed */
+	if (uip_event_add(info, sk->fd, &sk->event, EPOLLOUT) < 0) {
+		close(sk->fd);
+		sk->closed = 1;
+		uip_tcp_socket_unlink(sk);
 		return NULL;
 	}
 
-	sk->sip		= ip->sip;
-	sk->dip		= ip->dip;
-	sk->sport	= tcp->sport;
-	sk->dport	= tcp->dport;
+	return sk;
 
-	mutex_lock(sk_lock);
-	list_add_tail(&sk->list, sk_head);
-	mutex_unlock(sk_lock);
+err_close:
+	close(sk->fd);
+err_free:
+	free(sk);
+	return NULL;
+}
 
-	return sk;
+/*
+ * Our MSS, and our window scale if the guest offered one, go after the TCP
+ * header of a SYN-ACK. Returns their length.
+ */
+static int uip_tcp_syn_options(struct uip_tcp_socket *sk, struct uip_tcp *tcp2)
+{
+	u8 *opt = (u8 *)&tcp2->sport + 20;
+
+	opt[0]	= UIP_TCP_OPT_MSS;
+	opt[1]	= 4;
+	opt[2]	= UIP_TCP_MSS >> 8;
+	opt[3]	= UIP_TCP_MSS & 0xff;
+
+	if (!sk->wscale_ok)
+		return 4;
+
+	opt[4]	= UIP_TCP_OPT_NOP;
+	opt[5]	= UIP_TCP_OPT_WSCALE;
+	opt[6]	= 3;
+	opt[7]	= UIP_TCP_WSCALE;
+
+	return 8;
 }
 
-static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_len)
+/*
+ * Sends a segment to the guest. Its payload, if any, has already been read
+ * into buf, otherwise a free buffer is taken.
+ */
+static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, struct uip_buf *buf, u16 payload_len)
 {
+	struct virtio_net_hdr *vnet;
 	struct uip_info *info;
 	struct uip_eth *eth2;
 	struct uip_tcp *tcp2;
-	struct uip_buf *buf;
 	struct uip_ip *ip2;
+	u32 win;
+	int optlen;
 
 	info		= sk->info;
 
 	/*
 	 * Get free buffer to send data to guest
 	 */
-	buf		= uip_buf_get_free(info);
+	if (!buf)
+		buf	= uip_buf_get_free(info);
 
 	/*
 	 * Cook a ethernet frame
@@ -128,26 +274,44 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	tcp2->seq	= htonl(sk->seq_server);
 	tcp2->ack	= htonl(sk->ack_server);
 	/*
-	 * Diable TCP options, tcp hdr len equals 20 bytes
+	 * Only the SYN carries TCP options, otherwise tcp hdr len equals
+	 * 20 bytes. The window in a SYN is never scaled.
 	 */
-	tcp2->off	= UIP_TCP_HDR_LEN;
+	optlen		= flag & UIP_TCP_FLAG_SYN ? uip_tcp_syn_options(sk, tcp2) : 0;
+	win		= sk->window;
+	if (!(flag & UIP_TCP_FLAG_SYN) && sk->wscale_ok)
+		win	>>= UIP_TCP_WSCALE;
+
+	tcp2->off	= UIP_TCP_HDR_LEN + (optlen << 2);
 	tcp2->flg	= flag;
-	tcp2->win	= htons(UIP_TCP_WIN_SIZE);
+	tcp2->win	= htons(min(win, 0xffffU));
 	tcp2->csum	= 0;
 	tcp2->urgent	= 0;
 
-	if (payload_len > 0)
-		memcpy(uip_tcp_payload(tcp2), sk->payload, payload_len);
-
 	ip2->len	= htons(uip_tcp_hdrlen(tcp2) + payload_len + uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
-	tcp2->csum	= uip_csum_tcp(tcp2);
 
 	/*
 	 * virtio_net_hdr
 	 */
 	buf->vnet_len	= sizeof(struct virtio_net_hdr);
 	memset(buf->vnet, 0, buf->vnet_len);
+	vnet		= (struct virtio_net_hdr *)buf->vnet;
+
+	/*
+	 * Leave the checksum to the guest, and have it take large segments
+	 * as TSO frames, as if they had been coalesced on their way in
+	 */
+	if (info->guest_csum)
+		uip_csum_partial(buf, offsetof(struct uip_tcp, csum) - offsetof(struct uip_tcp, sport));
+	else
+		tcp2->csum = uip_csum_tcp(tcp2);
+
+	if (info->guest_tso4 && payload_len > sk->mss) {
+		vnet->gso_type	= VIRTIO_NET_HDR_GSO_TCPV4;
+		vnet->gso_size	= sk->mss;
+		vnet->hdr_len	= uip_eth_hdrlen(&ip2->eth) + uip_ip_hdrlen(ip2) + uip_tcp_hdrlen(tcp2);
+	}
 
 	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
@@ -164,58 +328,150 @@ static int uip_tcp_payload_send(struct uip_tcp_socket *sk, u8 flag, u16 payload_
 	return 0;
 }
 
-static void *uip_tcp_socket_thread(void *p)
+/* The non-blocking connect() is done, one way or the other */
+static void uip_tcp_socket_connected(struct uip_tcp_socket *sk)
 {
-	struct uip_tcp_socket *sk;
-	u8 *payload;
-	int ret;
+	socklen_t len = sizeof(int);
+	int err;
 
-	sk = p;
+	if (getsockopt(sk->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
 
-	payload = malloc(UIP_MAX_TCP_PAYLOAD);
-	sk->payload = payload;
-	if (!sk->payload)
-		goto out;
+	if (!err && uip_event_mod(sk->info, sk->fd, &sk->event, EPOLLIN) < 0)
+		err = errno;
 
-	while (1) {
+	if (err) {
+		/*
+		 * Refuse the guest's connection, rather than leaving it to
+		 * time out
+		 */
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_RST | UIP_TCP_FLAG_ACK, NULL, 0);
+		sk->read_done	= 1;
+		sk->write_done	= 1;
+		return;
+	}
 
-		ret = read(sk->fd, payload, UIP_MAX_TCP_PAYLOAD);
+	sk->connected = 1;
+	uip_tcp_socket_update_window(sk);
 
-		if (ret <= 0 || ret > UIP_MAX_TCP_PAYLOAD)
-			goto out;
+	/*
+	 * Now that the remote host accepted, let's fake SYN-ACK to guest
+	 */
+	uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, NULL, 0);
+	sk->seq_server += 1;
+}
 
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, ret);
+/* How much more the guest's window lets us send */
+static int uip_tcp_socket_room(struct uip_tcp_socket *sk)
+{
+	return (int)(sk->guest_acked + sk->guest_window - sk->seq_server);
+}
+
+/*
+ * Backpressure: the socket isn't polled while the guest's window is closed,
+ * or too small to be worth sending to while data is still in flight, and
+ * data piles up in the host socket until the guest opens it again.
+ */
+static bool uip_tcp_socket_pause(struct uip_tcp_socket *sk)
+{
+	int room = uip_tcp_socket_room(sk);
 
+	if (room <= 0 || (room < sk->mss && sk->seq_server != sk->guest_acked)) {
+		uip_event_del(sk->info, sk->fd);
+		sk->paused = 1;
+		return true;
+	}
+
+	return false;
+}
+
+static void uip_tcp_socket_resume(struct uip_tcp_socket *sk)
+{
+	int room = uip_tcp_socket_room(sk);
+
+	if (!sk->paused || sk->read_done)
+		return;
+
+	if (room <= 0 || (room < sk->mss && sk->seq_server != sk->guest_acked))
+		return;
+
+	if (uip_event_add(sk->info, sk->fd, &sk->event, EPOLLIN) == 0)
+		sk->paused = 0;
+}
+
+/* Data from the remote host is read straight into the frame for the guest */
+static void uip_tcp_socket_read(struct uip_tcp_socket *sk)
+{
+	struct uip_info *info = sk->info;
+	struct uip_tcp *tcp2;
+	struct uip_buf *buf;
+	ssize_t ret;
+	int len;
+
+	if (uip_tcp_socket_pause(sk))
+		return;
+
+	buf		= uip_buf_get_free(info);
+	tcp2		= (struct uip_tcp *)buf->eth;
+	tcp2->off	= UIP_TCP_HDR_LEN;
+
+	/*
+	 * Without TSO, the guest only takes segments which fit its MTU, and
+	 * never more than its window
+	 */
+	len = info->guest_tso4 ? UIP_MAX_TCP_PAYLOAD : sk->mss;
+	len = min(len, uip_tcp_socket_room(sk));
+
+	ret = read(sk->fd, uip_tcp_payload(tcp2), len);
+	if (ret > 0) {
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, buf, ret);
+		return;
+	}
+
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+		uip_buf_set_free(info, buf);
+		return;
 	}
 
-out:
 	/*
 	 * Close server to guest TCP connection
 	 */
-	uip_tcp_socket_close(sk, SHUT_RD);
+	uip_event_del(info, sk->fd);
+	shutdown(sk->fd, SHUT_RD);
 
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, 0);
+	uip_tcp_payload_send(sk, UIP_TCP_FLAG_FIN | UIP_TCP_FLAG_ACK, buf, 0);
 	sk->seq_server += 1;
 
 	sk->read_done = 1;
-
-	free(sk->payload);
-	pthread_exit(NULL);
-
-	return NULL;
 }
 
-static int uip_tcp_socket_receive(struct uip_tcp_socket *sk)
+static void uip_tcp_socket_event(struct uip_event *ev, u32 events)
 {
-	if (sk->thread == 0)
-		return pthread_create(&sk->thread, NULL, uip_tcp_socket_thread, (void *)sk);
+	struct uip_tcp_socket *sk = container_of(ev, struct uip_tcp_socket, event);
+	bool closed;
 
-	return 0;
+	mutex_lock(&sk->mutex);
+
+	if (sk->closed) {
+		mutex_unlock(&sk->mutex);
+		return;
+	}
+
+	if (!sk->connected)
+		uip_tcp_socket_connected(sk);
+	else
+		uip_tcp_socket_read(sk);
+
+	closed = uip_tcp_socket_close(sk);
+	mutex_unlock(&sk->mutex);
+
+	if (closed)
+		uip_tcp_socket_unlink(sk);
 }
 
 static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
 {
-	int len;
+	int len, off;
 	int ret;
 	u8 *payload;
 
@@ -225,8 +481,21 @@ static int uip_tcp_socket_send(struct uip_tcp_socket *sk, struct uip_tcp *tcp)
 	payload = uip_tcp_payload(tcp);
 	len = uip_tcp_payloadlen(tcp);
 
-	ret = write(sk->fd, payload, len);
-	if (ret != len)
+	/*
+	 * Only what the socket takes is acked, the guest retransmits the
+	 * rest. Until then, segments it had already sent past ack_server are
+	 * dropped, and retransmissions overlapping what was written are
+	 * trimmed: data only goes out when it starts at ack_server.
+	 */
+	off = sk->ack_server - ntohl(tcp->seq);
+	if (off < 0 || off >= len)
+		return 0;
+
+	ret = write(sk->fd, payload + off, len - off);
+	if (ret < 0 && errno == EAGAIN)
+		return 0;
+
+	if (ret < 0)
 		pr_warning("tcp send error");
 
 	return ret;
@@ -237,81 +506,114 @@ int uip_tx_do_ipv4_tcp(struct uip_tx_arg *arg)
 	struct uip_tcp_socket *sk;
 	struct uip_tcp *tcp;
 	struct uip_ip *ip;
-	int ret;
+	bool closed = false;
+	int ret = 0;
 
 	tcp = (struct uip_tcp *)arg->eth;
 	ip = (struct uip_ip *)arg->eth;
 
 	/*
-	 * Guest is trying to start a TCP session, let's fake SYN-ACK to guest
+	 * Find socket we have allocated
+	 */
+	sk = uip_tcp_socket_find(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
+
+	/*
+	 * Guest is trying to start a TCP session, connect to the remote host.
+	 * A retransmitted SYN finds the socket still connecting.
 	 */
 	if (uip_tcp_is_syn(tcp)) {
+		if (sk) {
+			mutex_unlock(&sk->mutex);
+			return 0;
+		}
+
 		sk = uip_tcp_socket_alloc(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-		if (!sk)
-			return -1;
 
-		/*
-		 * Setup ISN number
-		 */
-		sk->isn_guest  = uip_tcp_isn(tcp);
-		sk->isn_server = uip_tcp_isn_alloc();
+		return sk ? 0 : -1;
+	}
 
-		sk->seq_server = sk->isn_server;
-		sk->ack_server = sk->isn_guest + 1;
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_SYN | UIP_TCP_FLAG_ACK, 0);
-		sk->seq_server += 1;
+	if (!sk)
+		return -1;
 
-		/*
-		 * Start receive thread for data from remote to guest
-		 */
-		uip_tcp_socket_receive(sk);
+	if (sk->closed || !sk->connected)
+		goto out;
 
+	/*
+	 * Track the guest's window, and start reading for it again if it
+	 * opened
+	 */
+	if (tcp->flg & UIP_TCP_FLAG_ACK && (int)(ntohl(tcp->ack) - sk->guest_acked) >= 0) {
+		sk->guest_acked		= ntohl(tcp->ack);
+		sk->guest_window	= ntohs(tcp->win) << (sk->wscale_ok ? sk->guest_wscale : 0);
+		uip_tcp_socket_resume(sk);
+	}
+
+	/*
+	 * Guest reset the connection, drop it on our side too
+	 */
+	if (uip_tcp_is_rst(tcp)) {
+		sk->read_done	= 1;
+		sk->write_done	= 1;
+		closed = uip_tcp_socket_close(sk);
 		goto out;
 	}
 
 	/*
-	 * Find socket we have allocated
+	 * Guest to server frames with zero tcp payload only need an answer
+	 * if they probe a window of ours which has opened since
 	 */
-	sk = uip_tcp_socket_find(arg, ip->sip, ip->dip, tcp->sport, tcp->dport);
-	if (!sk)
-		return -1;
+	if (uip_tcp_payloadlen(tcp) == 0 && !uip_tcp_is_fin(tcp)) {
+		if (sk->window < sk->mss) {
+			uip_tcp_socket_update_window(sk);
+			if (sk->window >= sk->mss)
+				uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, NULL, 0);
+		}
+		goto out;
+	}
 
-	sk->guest_acked = ntohl(tcp->ack);
+	/*
+	 * Sent out TCP data to remote host
+	 */
+	ret = uip_tcp_socket_send(sk, tcp);
+	if (ret < 0) {
+		ret = -1;
+		goto out;
+	}
 
-	if (uip_tcp_is_fin(tcp)) {
-		if (sk->write_done)
-			goto out;
+	sk->ack_server += ret;
+	ret = 0;
 
+	/*
+	 * The FIN only counts once everything before it went out, otherwise
+	 * the guest gets acked up to the gap and retransmits both
+	 */
+	if (uip_tcp_is_fin(tcp) && !sk->write_done &&
+	    ntohl(tcp->seq) + uip_tcp_payloadlen(tcp) == sk->ack_server) {
 		sk->write_done = 1;
 		sk->ack_server += 1;
-		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+		uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, NULL, 0);
 
 		/*
 		 * Close guest to server TCP connection
 		 */
-		uip_tcp_socket_close(sk, SHUT_WR);
+		shutdown(sk->fd, SHUT_WR);
+		closed = uip_tcp_socket_close(sk);
 
 		goto out;
 	}
 
 	/*
-	 * Ignore guest to server frames with zero tcp payload
+	 * Send ACK to guest imediately, which also asks for what was dropped
+	 * above once more
 	 */
-	if (uip_tcp_payloadlen(tcp) == 0)
-		goto out;
-
-	/*
-	 * Sent out TCP data to remote host
-	 */
-	ret = uip_tcp_socket_send(sk, tcp);
-	if (ret < 0)
-		return -1;
-	/*
-	 * Send ACK to guest imediately
-	 */
-	sk->ack_server += ret;
-	uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, 0);
+	uip_tcp_socket_update_window(sk);
+	uip_tcp_payload_send(sk, UIP_TCP_FLAG_ACK, NULL, 0);
 
 out:
-	return 0;
+	mutex_unlock(&sk->mutex);
+
+	if (closed)
+		uip_tcp_socket_unlink(sk);
+
+	return ret;
 }
@@ -5,27 +5,25 @@
 #include <linux/list.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
-#include <fcntl.h>
 
-#define UIP_UDP_MAX_EVENTS 1000
+static void uip_udp_socket_event(struct uip_event *ev, u32 events);
 
 static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 sip, u32 dip, u16 sport, u16 dport)
 {
-	struct list_head *sk_head;
+	struct hlist_head *sk_head;
 	struct uip_udp_socket *sk;
 	pthread_mutex_t *sk_lock;
-	struct epoll_event ev;
-	int flags;
+	struct hlist_node *pos;
 	int ret;
 
-	sk_head = &arg->info->udp_socket_head;
+	sk_head = &arg->info->udp_socket_hash[uip_socket_hash(sip, dip, sport, dport)];
 	sk_lock = &arg->info->udp_socket_lock;
 
 	/*
 	 * Find existing sk
 	 */
 	mutex_lock(sk_lock);
-	list_for_each_entry(sk, sk_head, list) {
+	hlist_for_each_entry(sk, pos, sk_head, node) {
 		if (sk->sip == sip && sk->dip == dip && sk->sport == sport && sk->dport == dport) {
 			mutex_unlock(sk_lock);
 			return sk;
@@ -39,31 +37,13 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	sk = malloc(sizeof(*sk));
 	memset(sk, 0, sizeof(*sk));
 
-	sk->lock = sk_lock;
+	sk->info		= arg->info;
+	sk->event.handle	= uip_udp_socket_event;
 
-	sk->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	sk->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sk->fd < 0)
 		goto out;
 
-	/*
-	 * Set non-blocking
-	 */
-	flags = fcntl(sk->fd, F_GETFL, 0);
-	flags |= O_NONBLOCK;
-	fcntl(sk->fd, F_SETFL, flags);
-
-	/*
-	 * Add sk->fd to epoll_wait
-	 */
-	ev.events	= EPOLLIN;
-	ev.data.fd	= sk->fd;
-	ev.data.ptr	= sk;
-	if (arg->info->udp_epollfd <= 0)
-		arg->info->udp_epollfd = epoll_create(UIP_UDP_MAX_EVENTS);
-	ret = epoll_ctl(arg->info->udp_epollfd, EPOLL_CTL_ADD, sk->fd, &ev);
-	if (ret == -1)
-		pr_warning("epoll_ctl error");
-
 	sk->addr.sin_family	 = AF_INET;
 	sk->addr.sin_addr.s_addr = dip;
 	sk->addr.sin_port	 = dport;
@@ -73,8 +53,18 @@ static struct uip_udp_socket *uip_udp_socket_find(struct uip_tx_arg *arg, u32 si
 	sk->sport		 = sport;
 	sk->dport		 = dport;
 
+	/*
+	 * Add sk->fd to the event loop
+	 */
+	ret = uip_event_add(arg->info, sk->fd, &sk->event, EPOLLIN);
+	if (ret < 0) {
+		pr_warning("epoll_ctl error");
+		close(sk->fd);
+		goto out;
+	}
+
 	mutex_lock(sk_lock);
-	list_add_tail(&sk->list, sk_head);
+	hlist_add_head(&sk->node, sk_head);
 	mutex_unlock(sk_lock);
 
 	return sk;
@@ -136,7 +126,6 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 
 	ip2->len	= udp2->len + htons(uip_ip_hdrlen(ip2));
 	ip2->csum	= uip_csum_ip(ip2);
-	udp2->csum	= uip_csum_udp(udp2);
 
 	/*
 	 * virtio_net_hdr
@@ -144,71 +133,54 @@ int uip_udp_make_pkg(struct uip_info *info, struct uip_udp_socket *sk, struct ui
 	buf->vnet_len	= sizeof(struct virtio_net_hdr);
 	memset(buf->vnet, 0, buf->vnet_len);
 
+	if (info->guest_csum)
+		uip_csum_partial(buf, offsetof(struct uip_udp, csum) - offsetof(struct uip_udp, sport));
+	else
+		udp2->csum = uip_csum_udp(udp2);
+
 	buf->eth_len	= ntohs(ip2->len) + uip_eth_hdrlen(&ip2->eth);
 
 	return 0;
 }
 
-static void *uip_udp_socket_thread(void *p)
+static void uip_udp_socket_event(struct uip_event *ev, u32 events)
 {
-	struct epoll_event events[UIP_UDP_MAX_EVENTS];
-	struct uip_udp_socket *sk;
-	struct uip_info *info;
+	struct uip_udp_socket *sk = container_of(ev, struct uip_udp_socket, event);
+	struct uip_info *info = sk->info;
+	struct uip_udp *udp2;
 	struct uip_buf *buf;
 	int payload_len;
-	u8 *payload;
-	int nfds;
-	int i;
 
-	info = p;
-
-	do {
-		payload = malloc(UIP_MAX_UDP_PAYLOAD);
-	} while (!payload);
-
-	while (1) {
-		nfds = epoll_wait(info->udp_epollfd, events, UIP_UDP_MAX_EVENTS, -1);
-
-		if (nfds == -1)
-			continue;
-
-		for (i = 0; i < nfds; i++) {
-
-			sk = events[i].data.ptr;
-			payload_len = recvfrom(sk->fd, payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
-			if (payload_len < 0)
-				continue;
-
-			/*
-			 * Get free buffer to send data to guest
-			 */
-			buf = uip_buf_get_free(info);
-
-			uip_udp_make_pkg(info, sk, buf, payload, payload_len);
+	/*
+	 * Get free buffer to send data to guest, and receive the datagram
+	 * straight into it
+	 */
+	buf = uip_buf_get_free(info);
+	udp2 = (struct uip_udp *)buf->eth;
 
-			/*
-			 * Send data received from socket to guest
-			 */
-			uip_buf_set_used(info, buf);
-		}
+	payload_len = recvfrom(sk->fd, udp2->payload, UIP_MAX_UDP_PAYLOAD, 0, NULL, NULL);
+	if (payload_len < 0) {
+		uip_buf_set_free(info, buf);
+		return;
 	}
 
-	free(payload);
-	pthread_exit(NULL);
-	return NULL;
+	uip_udp_make_pkg(info, sk, buf, NULL, payload_len);
+
+	/*
+	 * Send data received from socket to guest
+	 */
+	uip_buf_set_used(info, buf);
 }
 
 int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 {
 	struct uip_udp_socket *sk;
-	struct uip_info *info;
 	struct uip_udp *udp;
 	struct uip_ip *ip;
 	int ret;
 
 	udp	= (struct uip_udp *)(arg->eth);
 	ip	= (struct uip_ip *)(arg->eth);
-	info	= arg->info;
 
 	if (uip_udp_is_dhcp(udp)) {
 		uip_tx_do_ipv4_udp_dhcp(arg);
@@ -229,8 +201,5 @@ int uip_tx_do_ipv4_udp(struct uip_tx_arg *arg)
 	if (ret)
 		return -1;
 
-	if (!info->udp_thread)
-		pthread_create(&info->udp_thread, NULL, uip_udp_socket_thread, (void *)info);
-
 	return 0;
 }
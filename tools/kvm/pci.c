@@ -61,22 +61,17 @@ static struct ioport_operations pci_config_address_ops = {
 	.io_out	= pci_config_address_out,
 };
 
-static bool pci_device_exists(u8 bus_number, u8 device_number, u8 function_number)
+static u8 pci_dev_num(union pci_config_address addr)
 {
-	struct pci_device_header *dev;
+	return addr.function_number * PCI_MAX_SLOTS + addr.device_number;
+}
 
+static bool pci_device_exists(u8 bus_number, u8 dev_num)
+{
 	if (pci_config_address.bus_number != bus_number)
 		return false;
 
-	if (pci_config_address.function_number != function_number)
-		return false;
-
-	if (device_number >= PCI_MAX_DEVICES)
-		return false;
-
-	dev = pci_devices[device_number];
-
-	return dev != NULL;
+	return pci_devices[dev_num] != NULL;
 }
 
 static bool pci_config_data_out(struct ioport *ioport, struct kvm *kvm, u16 port, void *data, int size)
@@ -114,9 +109,9 @@ void pci__config_wr(struct kvm *kvm, union pci_config_address addr, void *data,
 {
 	u8 dev_num;
 
-	dev_num	= addr.device_number;
+	dev_num	= pci_dev_num(addr);
 
-	if (pci_device_exists(0, dev_num, 0)) {
+	if (pci_device_exists(0, dev_num)) {
 		unsigned long offset;
 
 		offset = addr.w & 0xff;
@@ -151,9 +146,9 @@ void pci__config_rd(struct kvm *kvm, union pci_config_address addr, void *data,
 {
 	u8 dev_num;
 
-	dev_num	= addr.device_number;
+	dev_num	= pci_dev_num(addr);
 
-	if (pci_device_exists(0, dev_num, 0)) {
+	if (pci_device_exists(0, dev_num)) {
 		unsigned long offset;
 
 		offset = addr.w & 0xff;
@@ -171,11 +166,18 @@ void pci__config_rd(struct kvm *kvm, union pci_config_address addr, void *data,
 
 int pci__register(struct pci_device_header *dev, u8 dev_num)
 {
+	struct pci_device_header *func0;
+
 	if (dev_num >= PCI_MAX_DEVICES)
 		return -ENOSPC;
 
 	pci_devices[dev_num] = dev;
 
+	/* Guests only look for further functions of multi-function devices */
+	func0 = pci_devices[dev_num % PCI_MAX_SLOTS];
+	if (dev_num >= PCI_MAX_SLOTS && func0)
+		func0->header_type |= PCI_HEADER_TYPE_MULTIFUNCTION;
+
 	return 0;
 }
 
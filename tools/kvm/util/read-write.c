@@ -192,7 +192,7 @@ static inline ssize_t get_iov_size(const struct iovec *iov, int iovcnt)
 static inline void shift_iovec(const struct iovec **iov, int *iovcnt,
 				size_t nr, ssize_t *total, size_t *count, off_t *offset)
 {
-	while (nr >= (*iov)->iov_len) {
+	while (*iovcnt && nr >= (*iov)->iov_len) {
 		nr -= (*iov)->iov_len;
 		*total += (*iov)->iov_len;
 		*count -= (*iov)->iov_len;
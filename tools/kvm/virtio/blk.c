@@ -18,39 +18,113 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
-
-#define VIRTIO_BLK_MAX_DEV		4
+#include <limits.h>
 
 /*
  * the header and status consume too entries
  */
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
 #define VIRTIO_BLK_QUEUE_SIZE		128
-#define NUM_VIRT_QUEUES			1
+#define VIRTIO_BLK_MAX_QUEUES		VIRTIO_PCI_MAX_VQ
+
+/* Not in our copy of linux/virtio_blk.h yet */
+#define VIRTIO_BLK_F_MQ			12
+#define VIRTIO_BLK_F_DISCARD		13
+#define VIRTIO_BLK_F_WRITE_ZEROES	14
+
+#define VIRTIO_BLK_T_DISCARD		11
+#define VIRTIO_BLK_T_WRITE_ZEROES	13
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	(1 << 0)
+
+struct virtio_blk_discard_write_zeroes {
+	u64				sector;
+	u32				num_sectors;
+	u32				flags;
+};
+
+/*
+ * Discards and write zeroes are carried out synchronously by the queue
+ * thread, so keep each of them reasonably short.
+ */
+#define VIRTIO_BLK_DISCARD_MAX_SECTORS	(1U << 21)
+#define VIRTIO_BLK_DISCARD_MAX_SEG	16
+
+/* Upper bound on the size of a request built by merging adjacent ones */
+#define VIRTIO_BLK_MERGE_MAX		(1024 * 1024)
+
+struct blk_dev_queue;
 
 struct blk_dev_req {
-	struct virt_queue		*vq;
+	/* Must come first, the disk accounts for the request through it */
+	struct disk_image_req		dreq;
+	struct blk_dev_queue		*queue;
 	struct blk_dev			*bdev;
 	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
 	u16				out, in, head;
 	struct kvm			*kvm;
+
+	u32				type;
+	u64				sector;
+	size_t				len;
+
+	/*
+	 * When adjacent requests are merged, the first one carries the
+	 * combined iovec and the rest are chained behind it.
+	 */
+	struct blk_dev_req		*next;
+	struct iovec			*merged_iov;
+	int				merged_iovcount;
 };
 
-struct blk_dev {
+/*
+ * Every request queue has its own ring, worker thread and MSI-X vector.
+ * Requests popped from a queue are always completed on that same queue.
+ */
+struct blk_dev_queue {
 	pthread_mutex_t			mutex;
+	struct virt_queue		vq;
+	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	struct blk_dev			*bdev;
+	u32				id;
+
+	pthread_t			thread;
+	int				efd;
+	/* When the guest first notified the queue since it was last drained */
+	u64				kick;
+};
+
+struct blk_dev_config {
+	struct virtio_blk_config	config;
+	u8				wce;
+	u8				unused;
+	u16				num_queues;
+	u32				max_discard_sectors;
+	u32				max_discard_seg;
+	u32				discard_sector_alignment;
+	u32				max_write_zeroes_sectors;
+	u32				max_write_zeroes_seg;
+	u8				write_zeroes_may_unmap;
+	u8				unused1[3];
+} __attribute__((packed));
+
+struct blk_dev {
 	pthread_mutex_t			req_mutex;
 
 	struct list_head		list;
 	struct list_head		req_list;
 
 	struct virtio_trans		vtrans;
-	struct virtio_blk_config	blk_config;
+	struct blk_dev_config		blk_config;
 	struct disk_image		*disk;
 	u32				features;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
+	u32				nr_queues;
+	struct blk_dev_queue		*queues;
+
+	struct kvm			*kvm;
 };
 
 static LIST_HEAD(bdevs);
@@ -58,21 +132,87 @@ static int compat_id = -1;
 
 void virtio_blk_complete(void *param, long len)
 {
-	struct blk_dev_req *req = param;
+	struct blk_dev_req *req = param, *next;
+	struct blk_dev_queue *queue = req->queue;
 	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
+	bool merged = req->next != NULL;
 	u8 *status;
 
-	/* status */
-	status	= req->iov[req->out + req->in - 1].iov_base;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	free(req->merged_iov);
+	req->merged_iov = NULL;
+
+	mutex_lock(&queue->mutex);
+	for (; req; req = next) {
+		/* The guest may reuse the head as soon as it is used */
+		next		= req->next;
+		req->next	= NULL;
+
+		disk_image__req_done(bdev->disk, &req->dreq, len);
+
+		/* status */
+		status	= req->iov[req->out + req->in - 1].iov_base;
+		if (len == -EOPNOTSUPP)
+			*status	= VIRTIO_BLK_S_UNSUPP;
+		else
+			*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+		virt_queue__set_used_elem(&queue->vq, req->head,
+					  (merged && len >= 0) ? (long)req->len : len);
+	}
+	mutex_unlock(&queue->mutex);
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vtrans.trans_ops->signal_vq(req->kvm, &bdev->vtrans, queueid);
+	if (virtio_queue__should_signal(&queue->vq))
+		bdev->vtrans.trans_ops->signal_vq(bdev->kvm, &bdev->vtrans, queue->id);
+}
+
+/*
+ * The ranges follow the header, possibly spread over several buffers.
+ * Returns 0 once all of them are done, and -EOPNOTSUPP for segment flags
+ * we don't know, which the guest gets as VIRTIO_BLK_S_UNSUPP.
+ */
+static ssize_t virtio_blk_do_discard(struct blk_dev *bdev, struct blk_dev_req *req,
+				     u32 type)
+{
+	struct virtio_blk_discard_write_zeroes segs[VIRTIO_BLK_DISCARD_MAX_SEG];
+	size_t len = 0, copy;
+	bool unmap;
+	int i, nr;
+	int r;
+
+	for (i = 1; i < req->out; i++) {
+		copy = req->iov[i].iov_len;
+		if (len + copy > sizeof(segs))
+			return -EINVAL;
+
+		memcpy((void *)segs + len, req->iov[i].iov_base, copy);
+		len += copy;
+	}
+
+	if (!len || len % sizeof(segs[0]))
+		return -EINVAL;
+
+	nr = len / sizeof(segs[0]);
+	for (i = 0; i < nr; i++) {
+		if (segs[i].num_sectors > VIRTIO_BLK_DISCARD_MAX_SECTORS)
+			return -EINVAL;
+
+		/* Discard takes no flags at all, write zeroes only unmap */
+		unmap = segs[i].flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+		if (type == VIRTIO_BLK_T_DISCARD ? segs[i].flags :
+		    segs[i].flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+			return -EOPNOTSUPP;
+
+		if (type == VIRTIO_BLK_T_DISCARD)
+			r = disk_image__discard(bdev->disk, segs[i].sector,
+				(u64)segs[i].num_sectors << SECTOR_SHIFT);
+		else
+			r = disk_image__write_zeroes(bdev->disk, segs[i].sector,
+				(u64)segs[i].num_sectors << SECTOR_SHIFT, unmap);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
 }
 
 static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
@@ -92,17 +232,30 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
 
 	switch (req_hdr->type) {
 	case VIRTIO_BLK_T_IN:
-		block_cnt	= disk_image__read(bdev->disk, req_hdr->sector, iov + 1,
-					in + out - 2, req);
+		if (req->merged_iov)
+			block_cnt	= disk_image__read(bdev->disk, req_hdr->sector,
+						req->merged_iov, req->merged_iovcount, req);
+		else
+			block_cnt	= disk_image__read(bdev->disk, req_hdr->sector, iov + 1,
+						in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_OUT:
-		block_cnt	= disk_image__write(bdev->disk, req_hdr->sector, iov + 1,
-					in + out - 2, req);
+		if (req->merged_iov)
+			block_cnt	= disk_image__write(bdev->disk, req_hdr->sector,
+						req->merged_iov, req->merged_iovcount, req);
+		else
+			block_cnt	= disk_image__write(bdev->disk, req_hdr->sector, iov + 1,
+						in + out - 2, req);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
 		block_cnt       = disk_image__flush(bdev->disk);
 		virtio_blk_complete(req, block_cnt);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		block_cnt	= virtio_blk_do_discard(bdev, req, req_hdr->type);
+		virtio_blk_complete(req, block_cnt);
+		break;
 	case VIRTIO_BLK_T_GET_ID:
 		block_cnt	= VIRTIO_BLK_ID_BYTES;
 		disk_image__get_serial(bdev->disk, (iov + 1)->iov_base, &block_cnt);
@@ -115,25 +268,197 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct blk_dev_req *req)
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+static int virtio_blk_req_cmp(const void *a, const void *b)
+{
+	const struct blk_dev_req *ra = *(const struct blk_dev_req **)a;
+	const struct blk_dev_req *rb = *(const struct blk_dev_req **)b;
+
+	if (ra->type != rb->type)
+		return ra->type < rb->type ? -1 : 1;
+	if (ra->sector != rb->sector)
+		return ra->sector < rb->sector ? -1 : 1;
+
+	return 0;
+}
+
+static bool virtio_blk_can_merge(struct blk_dev_req *leader, struct blk_dev_req *tail,
+				 struct blk_dev_req *req, size_t len, int iovcount)
+{
+	if (req->type != leader->type)
+		return false;
+	if (tail->len & (SECTOR_SIZE - 1))
+		return false;
+	if (req->sector != tail->sector + (tail->len >> SECTOR_SHIFT))
+		return false;
+	if (len + req->len > VIRTIO_BLK_MERGE_MAX)
+		return false;
+
+	return iovcount + req->out + req->in - 2 <= IOV_MAX;
+}
+
+static void virtio_blk_merge_iov(struct blk_dev_req *leader, int iovcount)
+{
+	struct blk_dev_req *req;
+	struct iovec *iov;
+
+	iov = malloc(iovcount * sizeof(*iov));
+	if (!iov) {
+		/* Fall back to submitting the requests one by one */
+		while (leader->next) {
+			req		= leader->next;
+			leader->next	= NULL;
+			virtio_blk_do_io_request(leader->kvm, leader);
+			leader		= req;
+		}
+		return;
+	}
+
+	leader->merged_iov	= iov;
+	leader->merged_iovcount	= iovcount;
+
+	for (req = leader; req; req = req->next) {
+		memcpy(iov, req->iov + 1, (req->out + req->in - 2) * sizeof(*iov));
+		iov += req->out + req->in - 2;
+	}
+}
+
+/*
+ * Sort a batch of reads and writes by sector, and submit each run of
+ * adjacent requests going in the same direction as a single vectored I/O.
+ *
+ * The guest doesn't expect any ordering between requests it has in flight at
+ * the same time, so reordering them is fine.
+ */
+static void virtio_blk_do_batch(struct kvm *kvm, struct blk_dev_req **batch, int nr)
+{
+	struct blk_dev_req *leader, *tail;
+	int i, start, iovcount;
+	size_t len;
+
+	qsort(batch, nr, sizeof(*batch), virtio_blk_req_cmp);
+
+	for (start = 0; start < nr; start = i) {
+		leader		= tail = batch[start];
+		len		= leader->len;
+		iovcount	= leader->out + leader->in - 2;
+
+		for (i = start + 1; i < nr; i++) {
+			if (!virtio_blk_can_merge(leader, tail, batch[i], len, iovcount))
+				break;
+
+			tail->next	= batch[i];
+			tail		= batch[i];
+			len		+= tail->len;
+			iovcount	+= tail->out + tail->in - 2;
+		}
+
+		if (leader->next)
+			virtio_blk_merge_iov(leader, iovcount);
+
+		/* The merge may have failed, leaving only the tail to submit */
+		virtio_blk_do_io_request(kvm, leader->merged_iov ? leader : tail);
+	}
+}
+
+/* Flushes in a row are chained, and done as one */
+static void virtio_blk_do_flush(struct kvm *kvm, struct blk_dev_req **flush)
+{
+	if (*flush)
+		virtio_blk_do_io_request(kvm, *flush);
+
+	*flush = NULL;
+}
+
+static void virtio_blk_do_io(struct kvm *kvm, struct blk_dev_queue *queue)
 {
+	struct blk_dev_req *batch[VIRTIO_BLK_QUEUE_SIZE];
+	struct virt_queue *vq = &queue->vq;
+	struct virtio_blk_outhdr *req_hdr;
+	struct blk_dev_req *flush = NULL;
 	struct blk_dev_req *req;
+	int i, nr = 0;
+	u64 kick;
 	u16 head;
 
+	kick		= queue->kick;
+	queue->kick	= 0;
+
 	while (virt_queue__available(vq)) {
 		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
+		req		= &queue->reqs[head];
 		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out, &req->in, head, kvm);
-		req->vq		= vq;
-
+		req_hdr		= req->iov[0].iov_base;
+		req->type	= req_hdr->type;
+		req->sector	= req_hdr->sector;
+		req->dreq	= (struct disk_image_req) {
+			.kick	= kick,
+			.op	= -1,
+		};
+
+		if (req->type == VIRTIO_BLK_T_IN || req->type == VIRTIO_BLK_T_OUT) {
+			virtio_blk_do_flush(kvm, &flush);
+
+			req->len = 0;
+			for (i = 1; i < req->out + req->in - 1; i++)
+				req->len += req->iov[i].iov_len;
+
+			batch[nr++] = req;
+			continue;
+		}
+
+		/* Anything else, flushes in particular, orders against the batch */
+		virtio_blk_do_batch(kvm, batch, nr);
+		nr = 0;
+		disk_image__submit(queue->bdev->disk);
+
+		if (req->type == VIRTIO_BLK_T_FLUSH) {
+			req->len	= 0;
+			req->next	= flush;
+			flush		= req;
+			continue;
+		}
+
+		virtio_blk_do_flush(kvm, &flush);
 		virtio_blk_do_io_request(kvm, req);
 	}
+
+	virtio_blk_do_batch(kvm, batch, nr);
+
+	/* Hand everything we have queued to the disk in one go */
+	disk_image__submit(queue->bdev->disk);
+
+	virtio_blk_do_flush(kvm, &flush);
+}
+
+/*
+ * Each queue is drained from a dedicated thread, so that a slow disk only
+ * stalls its own requests and not the ioeventfd thread, which is shared by
+ * every virtio device in the guest.
+ */
+static void *virtio_blk_thread(void *arg)
+{
+	struct blk_dev_queue *queue = arg;
+	u64 data;
+	int r;
+
+	while (1) {
+		r = read(queue->efd, &data, sizeof(u64));
+		if (r < 0)
+			continue;
+		virtio_blk_do_io(queue->bdev->kvm, queue);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
 }
 
 static void set_config(struct kvm *kvm, void *dev, u8 data, u32 offset)
 {
 	struct blk_dev *bdev = dev;
 
+	if (offset >= sizeof(bdev->blk_config))
+		return;
+
 	((u8 *)(&bdev->blk_config))[offset] = data;
 }
 
@@ -141,15 +466,30 @@ static u8 get_config(struct kvm *kvm, void *dev, u32 offset)
 {
 	struct blk_dev *bdev = dev;
 
+	if (offset >= sizeof(bdev->blk_config))
+		return 0;
+
 	return ((u8 *)(&bdev->blk_config))[offset];
 }
 
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
-	return	1UL << VIRTIO_BLK_F_SEG_MAX
+	struct blk_dev *bdev = dev;
+	u32 features;
+
+	features = 1UL << VIRTIO_BLK_F_SEG_MAX
+		| 1UL << VIRTIO_BLK_F_BLK_SIZE
 		| 1UL << VIRTIO_BLK_F_FLUSH
+		| 1UL << VIRTIO_BLK_F_MQ
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+
+	if (bdev->disk->ops->discard)
+		features |= 1UL << VIRTIO_BLK_F_DISCARD;
+	if (bdev->disk->ops->write_zeroes)
+		features |= 1UL << VIRTIO_BLK_F_WRITE_ZEROES;
+
+	return features;
 }
 
 static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
@@ -165,9 +505,12 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 	struct virt_queue *queue;
 	void *p;
 
+	if (vq >= bdev->nr_queues)
+		return -EINVAL;
+
 	compat__remove_message(compat_id);
 
-	queue			= &bdev->vqs[vq];
+	queue			= &bdev->queues[vq].vq;
 	queue->pfn		= pfn;
 	p			= guest_pfn_to_host(kvm, queue->pfn);
 
@@ -179,8 +522,18 @@ static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	u64 data = 1;
+	int r;
+
+	if (vq >= bdev->nr_queues)
+		return -EINVAL;
 
-	virtio_blk_do_io(kvm, &bdev->vqs[vq], bdev);
+	if (!bdev->queues[vq].kick)
+		bdev->queues[vq].kick = disk_image__time_ns();
+
+	r = write(bdev->queues[vq].efd, &data, sizeof(data));
+	if (r < 0)
+		return r;
 
 	return 0;
 }
@@ -189,11 +542,20 @@ static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return bdev->vqs[vq].pfn;
+	if (vq >= bdev->nr_queues)
+		return 0;
+
+	return bdev->queues[vq].vq.pfn;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct blk_dev *bdev = dev;
+
+	/* A zero sized queue tells the guest that it doesn't exist */
+	if (vq >= bdev->nr_queues)
+		return 0;
+
 	return VIRTIO_BLK_QUEUE_SIZE;
 }
 
@@ -208,28 +570,113 @@ static struct virtio_ops blk_dev_virtio_ops = (struct virtio_ops) {
 	.get_size_vq		= get_size_vq,
 };
 
+static int virtio_blk__start_queue(struct blk_dev *bdev, u32 id)
+{
+	struct blk_dev_queue *queue = &bdev->queues[id];
+	unsigned int i;
+	int r;
+
+	*queue = (struct blk_dev_queue) {
+		.mutex		= PTHREAD_MUTEX_INITIALIZER,
+		.bdev		= bdev,
+		.id		= id,
+	};
+
+	for (i = 0; i < ARRAY_SIZE(queue->reqs); i++) {
+		queue->reqs[i].queue	= queue;
+		queue->reqs[i].bdev	= bdev;
+		queue->reqs[i].kvm	= bdev->kvm;
+	}
+
+	queue->efd = eventfd(0, 0);
+	if (queue->efd < 0)
+		return -errno;
+
+	r = pthread_create(&queue->thread, NULL, virtio_blk_thread, queue);
+	if (r) {
+		close(queue->efd);
+		return -r;
+	}
+
+	return 0;
+}
+
+static void virtio_blk__stop_queue(struct blk_dev_queue *queue)
+{
+	pthread_cancel(queue->thread);
+	pthread_join(queue->thread, NULL);
+	close(queue->efd);
+}
+
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
 	struct blk_dev *bdev;
-	unsigned int i;
+	u32 i, nr_queues;
+	int r;
 
 	if (!disk)
 		return -EINVAL;
 
+	nr_queues = disk->nr_queues ? disk->nr_queues : kvm->nrcpus;
+	if (nr_queues > VIRTIO_BLK_MAX_QUEUES) {
+		pr_warning("virtio-blk supports at most %d queues, using %d",
+			   VIRTIO_BLK_MAX_QUEUES, VIRTIO_BLK_MAX_QUEUES);
+		nr_queues = VIRTIO_BLK_MAX_QUEUES;
+	}
+
 	bdev = calloc(1, sizeof(struct blk_dev));
 	if (bdev == NULL)
 		return -ENOMEM;
 
 	*bdev = (struct blk_dev) {
-		.mutex			= PTHREAD_MUTEX_INITIALIZER,
 		.req_mutex		= PTHREAD_MUTEX_INITIALIZER,
 		.disk			= disk,
-		.blk_config		= (struct virtio_blk_config) {
-			.capacity	= disk->size / SECTOR_SIZE,
-			.seg_max	= DISK_SEG_MAX,
+		.kvm			= kvm,
+		.nr_queues		= nr_queues,
+		.blk_config		= (struct blk_dev_config) {
+			.config		= (struct virtio_blk_config) {
+				.capacity	= disk->size / SECTOR_SIZE,
+				.seg_max	= DISK_SEG_MAX,
+				.blk_size	= disk_direct__block_size(disk),
+			},
+			.num_queues	= nr_queues,
+			.max_discard_sectors		= VIRTIO_BLK_DISCARD_MAX_SECTORS,
+			.max_discard_seg		= VIRTIO_BLK_DISCARD_MAX_SEG,
+			.discard_sector_alignment	= 1,
+			.max_write_zeroes_sectors	= VIRTIO_BLK_DISCARD_MAX_SECTORS,
+			.max_write_zeroes_seg		= VIRTIO_BLK_DISCARD_MAX_SEG,
+			.write_zeroes_may_unmap		= 1,
 		},
 	};
 
+	bdev->queues = calloc(nr_queues, sizeof(struct blk_dev_queue));
+	if (bdev->queues == NULL) {
+		free(bdev);
+		return -ENOMEM;
+	}
+
+	disk_image__set_callback(bdev->disk, virtio_blk_complete);
+
+	r = disk_image__register_mem(bdev->disk, kvm);
+	if (r < 0)
+		goto err_mem;
+
+	/* Every queue may have all of its requests in flight at once */
+	r = disk_image__set_depth(bdev->disk, nr_queues * VIRTIO_BLK_QUEUE_SIZE);
+	if (r < 0)
+		pr_warning("Unable to keep %u requests in flight: %s",
+			   nr_queues * VIRTIO_BLK_QUEUE_SIZE, strerror(-r));
+
+	for (i = 0; i < nr_queues; i++) {
+		r = virtio_blk__start_queue(bdev, i);
+		if (r < 0)
+			goto err_queues;
+	}
+
+	/*
+	 * Only once nothing can fail anymore: the PCI device the transport
+	 * registers points at bdev, and stays registered.
+	 */
 	virtio_trans_init(&bdev->vtrans, VIRTIO_PCI);
 	bdev->vtrans.trans_ops->init(kvm, &bdev->vtrans, bdev, PCI_DEVICE_ID_VIRTIO_BLK,
 					VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
@@ -237,13 +684,6 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 
 	list_add_tail(&bdev->list, &bdevs);
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i].bdev	= bdev;
-		bdev->reqs[i].kvm	= kvm;
-	}
-
-	disk_image__set_callback(bdev->disk, virtio_blk_complete);
-
 	if (compat_id != -1)
 		compat_id = compat__add_message("virtio-blk device was not detected",
 						"While you have requested a virtio-blk device, "
@@ -252,11 +692,25 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 						"compiled with CONFIG_VIRTIO_BLK=y enabled "
 						"in its .config");
 	return 0;
+
+err_queues:
+	while (i--)
+		virtio_blk__stop_queue(&bdev->queues[i]);
+err_mem:
+	free(bdev->queues);
+	free(bdev);
+	return r;
 }
 
 static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 {
+	u32 i;
+
+	for (i = 0; i < bdev->nr_queues; i++)
+		virtio_blk__stop_queue(&bdev->queues[i]);
+
 	list_del(&bdev->list);
+	free(bdev->queues);
 	free(bdev);
 
 	return 0;
@@ -7,21 +7,33 @@
 #include "kvm/kvm.h"
 #include "kvm/virtio.h"
 
-struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
+/*
+ * Fills in the used element offset places past the last one made visible to
+ * the guest, without making it visible yet.
+ */
+struct vring_used_elem *virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
+							    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
+	u16 idx = queue->vring.used->idx + offset;
 
-	used_elem	= &queue->vring.used->ring[queue->vring.used->idx % queue->vring.num];
+	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
 	used_elem->id	= head;
 	used_elem->len	= len;
 
+	return used_elem;
+}
+
+/* Hands the next nr used elements over to the guest, all at once */
+void virt_queue__used_idx_advance(struct virt_queue *queue, u16 nr)
+{
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
 	 * We need a wmb here since we can't advance idx unless we're ready
 	 * to pass the used element to the guest.
 	 */
 	wmb();
-	queue->vring.used->idx++;
+	queue->vring.used->idx += nr;
 
 	/*
 	 * Use wmb to assure used idx has been increased before we signal the guest.
@@ -29,6 +41,14 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 	 * an updated idx.
 	 */
 	wmb();
+}
+
+struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len)
+{
+	struct vring_used_elem *used_elem;
+
+	used_elem = virt_queue__set_used_elem_no_update(queue, head, len, 0);
+	virt_queue__used_idx_advance(queue, 1);
 
 	return used_elem;
 }
@@ -1,4 +1,5 @@
 #include "kvm/virtio-pci-dev.h"
+#include "kvm/virtio-pci.h"
 #include "kvm/virtio-net.h"
 #include "kvm/virtio.h"
 #include "kvm/types.h"
@@ -9,10 +10,15 @@
 #include "kvm/uip.h"
 #include "kvm/guest_compat.h"
 #include "kvm/virtio-trans.h"
+#include "kvm/barrier.h"
 
 #include <linux/vhost.h>
+#include <linux/kernel.h>
 #include <linux/virtio_net.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
 #include <linux/types.h>
 
 #include <arpa/inet.h>
@@ -20,47 +26,172 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #define VIRTIO_NET_QUEUE_SIZE		128
-#define VIRTIO_NET_NUM_QUEUES		2
-#define VIRTIO_NET_RX_QUEUE		0
-#define VIRTIO_NET_TX_QUEUE		1
+
+/*
+ * Queue pairs are laid out as RX 0, TX 0, RX 1, TX 1, ... and followed by the
+ * control queue when there are more than one of them.
+ */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS	((VIRTIO_PCI_MAX_VQ - 1) / 2)
+#define VIRTIO_NET_MAX_QUEUES		(VIRTIO_NET_MAX_QUEUE_PAIRS * 2 + 1)
+
+/*
+ * With mergeable RX buffers, enough of them are gathered for the largest
+ * packet a GSO capable tap device may hand over, VLAN tagged.
+ */
+#define VIRTIO_NET_RX_MAX_PACKET	(sizeof(struct virtio_net_hdr_mrg_rxbuf) + 65536 + 18)
+
+/* Packets handled per wakeup, their used entries are published at once */
+#define VIRTIO_NET_BATCH		64
+
+/*
+ * RX interrupt coalescing defaults: once the packet rate is high enough for
+ * it to matter, the guest is signalled after this many packets, or this long
+ * after the first one it wasn't told about, whichever comes first.
+ */
+#define VIRTIO_NET_COALESCE_USECS	50
+#define VIRTIO_NET_COALESCE_PACKETS	32
+
+/*
+ * AF_PACKET rings. The kernel fills RX blocks with as many packets as fit,
+ * and hands each one over once it is full or has been open for a
+ * millisecond. TX frames hold a packet each, as large as the guest may send.
+ */
+#define VIRTIO_NET_PACKET_BLOCK_SIZE	(256 * 1024)
+#define VIRTIO_NET_PACKET_BLOCKS	16
+#define VIRTIO_NET_PACKET_BLOCK_TOV	1
+#define VIRTIO_NET_PACKET_RX_LEN	(VIRTIO_NET_PACKET_BLOCK_SIZE * VIRTIO_NET_PACKET_BLOCKS)
+
+#define VIRTIO_NET_PACKET_TX_BLOCK_SIZE	(1024 * 1024)
+#define VIRTIO_NET_PACKET_TX_BLOCKS	2
+#define VIRTIO_NET_PACKET_TX_LEN	(VIRTIO_NET_PACKET_TX_BLOCK_SIZE * VIRTIO_NET_PACKET_TX_BLOCKS)
+#define VIRTIO_NET_PACKET_TX_DATA	TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define VIRTIO_NET_PACKET_TX_FRAME	TPACKET_ALIGN(VIRTIO_NET_PACKET_TX_DATA + VIRTIO_NET_RX_MAX_PACKET)
+#define VIRTIO_NET_PACKET_TX_PER_BLOCK	(VIRTIO_NET_PACKET_TX_BLOCK_SIZE / VIRTIO_NET_PACKET_TX_FRAME)
+#define VIRTIO_NET_PACKET_TX_FRAMES	(VIRTIO_NET_PACKET_TX_PER_BLOCK * VIRTIO_NET_PACKET_TX_BLOCKS)
+
+#define VIRTIO_NET_IS_RX_QUEUE(q)	(!((q) & 1))
+#define VIRTIO_NET_QUEUE_PAIR(q)	((q) / 2)
+
+/* Not in our copies of linux/virtio_net.h and linux/if_tun.h yet */
+#define VIRTIO_NET_F_MQ			22
+
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+
+struct virtio_net_ctrl_mq {
+	u16				virtqueue_pairs;
+} __attribute__((packed));
+
+#ifndef IFF_MULTI_QUEUE
+#define IFF_MULTI_QUEUE			0x0100
+#define IFF_ATTACH_QUEUE		0x0200
+#define IFF_DETACH_QUEUE		0x0400
+#define TUNSETQUEUE			_IOW('T', 217, int)
+#endif
+
+/* Nor in those of linux/if_packet.h and linux/filter.h */
+#ifndef PACKET_FANOUT_DATA
+#define PACKET_FANOUT_CBPF		6
+#define PACKET_FANOUT_FLAG_UNIQUEID	0x2000
+#define PACKET_FANOUT_DATA		22
+#define PACKET_IGNORE_OUTGOING		23
+#endif
+
+#ifndef BPF_MOD
+#define BPF_MOD				0x90
+#define BPF_XOR				0xa0
+#endif
 
 struct net_dev;
+struct net_dev_queue;
 
 extern struct kvm *kvm;
 
 struct net_dev_operations {
-	int (*rx)(struct iovec *iov, u16 in, struct net_dev *ndev);
-	int (*tx)(struct iovec *iov, u16 in, struct net_dev *ndev);
+	int (*rx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+	int (*tx)(struct iovec *iov, u16 in, struct net_dev_queue *queue);
+	/* Optional, called once tx was handed a batch of packets */
+	void (*tx_flush)(struct net_dev_queue *queue);
+};
+
+/*
+ * Every RX and TX queue has its own worker thread, besides the ioeventfd and
+ * MSI-X vector virtio-pci gives it. Both queues of a pair share a tap queue
+ * or packet socket.
+ */
+struct net_dev_queue {
+	u32				id;
+	struct virt_queue		vq;
+	struct net_dev			*ndev;
+
+	pthread_t			thread;
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+
+	/* RX only: buffers seen when the guest ran short of them */
+	u16				rx_avail;
+
+	/* RX only: interrupt coalescing state */
+	u32				pending;
+	u64				pending_since;
+	u64				last_batch;
+	u64				rate;
 };
 
+/*
+ * An AF_PACKET socket bound to a host interface, with its RX and TX rings
+ * mapped one after the other. Only the RX worker of the pair touches the RX
+ * side, and only the TX worker the TX side.
+ */
+struct net_dev_packet {
+	int				fd;
+	void				*ring;
+
+	/* RX: the block being read, and what's left of it */
+	u32				rx_block;
+	struct tpacket3_hdr		*rx_pkt;
+	u32				rx_left;
+
+	/* TX: the next frame to fill */
+	u32				tx_frame;
+};
+
+struct net_dev_config {
+	struct virtio_net_config	config;
+	u16				max_virtqueue_pairs;
+} __attribute__((packed));
+
 struct net_dev {
 	pthread_mutex_t			mutex;
 	struct virtio_trans		vtrans;
 	struct list_head		list;
 
-	struct virt_queue		vqs[VIRTIO_NET_NUM_QUEUES];
-	struct virtio_net_config	config;
+	struct net_dev_queue		queues[VIRTIO_NET_MAX_QUEUES];
+	struct net_dev_config		config;
 	u32				features;
 
-	pthread_t			io_rx_thread;
-	pthread_mutex_t			io_rx_lock;
-	pthread_cond_t			io_rx_cond;
+	u32				nr_pairs;
+	u32				active_pairs;
 
-	pthread_t			io_tx_thread;
-	pthread_mutex_t			io_tx_lock;
-	pthread_cond_t			io_tx_cond;
+	u32				coalesce_usecs;
+	u32				coalesce_packets;
 
-	int				vhost_fd;
-	int				tap_fd;
+	bool				vhost;
+	int				vhost_fds[VIRTIO_NET_MAX_QUEUE_PAIRS];
+	int				tap_fds[VIRTIO_NET_MAX_QUEUE_PAIRS];
 	char				tap_name[IFNAMSIZ];
+	struct net_dev_packet		packet[VIRTIO_NET_MAX_QUEUE_PAIRS];
 
 	int				mode;
 
@@ -72,35 +203,310 @@ struct net_dev {
 static LIST_HEAD(ndevs);
 static int compat_id = -1;
 
-static void *virtio_net_rx_thread(void *p)
+static u32 virtio_net__nr_queues(struct net_dev *ndev)
 {
-	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
-	struct virt_queue *vq;
-	struct kvm *kvm;
-	struct net_dev *ndev = p;
-	u16 out, in;
-	u16 head;
+	return ndev->nr_pairs > 1 ? ndev->nr_pairs * 2 + 1 : 2;
+}
+
+static bool virtio_net__is_ctrl_queue(struct net_dev *ndev, u32 vq)
+{
+	return ndev->nr_pairs > 1 && vq == ndev->nr_pairs * 2;
+}
+
+static bool virtio_net__mergeable(struct net_dev *ndev)
+{
+	return ndev->features & (1UL << VIRTIO_NET_F_MRG_RXBUF);
+}
+
+/*
+ * With mergeable RX buffers, the header the guest sees ends with a
+ * num_buffers field which our backends know nothing about. They're handed an
+ * iovec with those bytes cut out of it.
+ */
+static u16 virtio_net__skip_num_buffers(struct iovec *dst, const struct iovec *src, u16 nr)
+{
+	size_t hdr_len = sizeof(struct virtio_net_hdr);
+	size_t mrg_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	u16 n = 0;
+
+	if (!nr || src[0].iov_len < mrg_len) {
+		memcpy(dst, src, nr * sizeof(*src));
+		return nr;
+	}
+
+	dst[n++] = (struct iovec) {
+		.iov_base	= src[0].iov_base,
+		.iov_len	= hdr_len,
+	};
+	if (src[0].iov_len > mrg_len)
+		dst[n++] = (struct iovec) {
+			.iov_base	= src[0].iov_base + mrg_len,
+			.iov_len	= src[0].iov_len - mrg_len,
+		};
+
+	memcpy(dst + n, src + 1, (nr - 1) * sizeof(*src));
+
+	return n + nr - 1;
+}
+
+static inline u64 virtio_net__time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called with nothing to receive into, returns once the guest adds buffers */
+static void virtio_net_rx_wait(struct net_dev_queue *queue, u16 avail_idx)
+{
+	struct virt_queue *vq = &queue->vq;
+
+	mutex_lock(&queue->lock);
+
+	/* Ask to be kicked as soon as anything is added */
+	vring_avail_event(&vq->vring) = avail_idx;
+	mb();
+
+	if (vq->vring.avail->idx == avail_idx)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+
+	mutex_unlock(&queue->lock);
+}
+
+/*
+ * Receives one packet into as many of the guest's buffers as it takes, and
+ * puts the ones it didn't need back. The used entries are filled in offset
+ * places past the last published one. Returns how many buffers were used, 0
+ * if the guest hasn't posted enough of them for the largest packet yet, or
+ * -EAGAIN if there is no packet to receive.
+ */
+static int virtio_net_rx_mergeable(struct net_dev_queue *queue, struct iovec *iov,
+				   struct iovec *rx_iov, u16 offset)
+{
+	struct {
+		u16		head;
+		u32		len;
+	} bufs[VIRTIO_NET_QUEUE_SIZE];
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	u16 start = vq->last_avail_idx;
+	u16 out, in, nr_iov = 0, nr = 0, used, i;
+	u32 total = 0, chunk;
+	int len;
+
+	while (total < VIRTIO_NET_RX_MAX_PACKET && nr_iov < VIRTIO_NET_QUEUE_SIZE &&
+	       vq->vring.avail->idx != vq->last_avail_idx) {
+		bufs[nr].head	= virt_queue__get_iov(vq, iov + nr_iov, &out, &in, ndev->kvm);
+		bufs[nr].len	= 0;
+		for (i = 0; i < out + in; i++)
+			bufs[nr].len += iov[nr_iov + i].iov_len;
+
+		total	+= bufs[nr].len;
+		nr_iov	+= out + in;
+		nr++;
+	}
+
+	/* Unless the ring can't hold any more, wait for the guest to fill it */
+	if (total < VIRTIO_NET_RX_MAX_PACKET && nr_iov < VIRTIO_NET_QUEUE_SIZE &&
+	    (u16)(vq->last_avail_idx - start) < vq->vring.num) {
+		queue->rx_avail = vq->last_avail_idx;
+		vq->last_avail_idx = start;
+		return 0;
+	}
+
+	if (iov[0].iov_len < sizeof(*hdr)) {
+		len = -EINVAL;
+	} else {
+		len = ndev->ops->rx(rx_iov, virtio_net__skip_num_buffers(rx_iov, iov, nr_iov),
+				    queue);
+	}
+
+	if (len == -EAGAIN) {
+		vq->last_avail_idx = start;
+		return -EAGAIN;
+	}
+
+	/* A failed read still uses up a buffer, with nothing in it */
+	if (len < 0) {
+		virt_queue__set_used_elem_no_update(vq, bufs[0].head, 0, offset);
+		vq->last_avail_idx = start + 1;
+		return 1;
+	}
+
+	len += sizeof(hdr->num_buffers);
+
+	for (used = 0; len > 0 && used < nr; used++) {
+		chunk = min((u32)len, bufs[used].len);
+		virt_queue__set_used_elem_no_update(vq, bufs[used].head, chunk, offset + used);
+		len -= chunk;
+	}
+
+	hdr = iov[0].iov_base;
+	hdr->num_buffers = used;
+
+	vq->last_avail_idx = start + used;
+
+	return used;
+}
+
+/* Same as above, one buffer per packet */
+static int virtio_net_rx_one(struct net_dev_queue *queue, struct iovec *iov, u16 offset)
+{
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	u16 out, in, head;
 	int len;
 
-	kvm	= ndev->kvm;
-	vq	= &ndev->vqs[VIRTIO_NET_RX_QUEUE];
+	head = virt_queue__get_iov(vq, iov, &out, &in, ndev->kvm);
+	len = ndev->ops->rx(iov, in, queue);
+	if (len == -EAGAIN) {
+		vq->last_avail_idx--;
+		return -EAGAIN;
+	}
+
+	virt_queue__set_used_elem_no_update(vq, head, max(len, 0), offset);
+
+	return 1;
+}
+
+static void virtio_net_rx_signal(struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+
+	if (!queue->pending)
+		return;
+
+	queue->pending = 0;
+
+	if (virtio_queue__should_signal(&queue->vq))
+		ndev->vtrans.trans_ops->signal_vq(ndev->kvm, &ndev->vtrans, queue->id);
+}
+
+/*
+ * Signalling the guest for every packet is what keeps latency down when
+ * there are few of them, and what costs the most when there are many. The
+ * packet rate is tracked, and only once it is high enough for more than a
+ * couple of packets to arrive within the coalescing time are interrupts held
+ * back, up to the packet and time budgets.
+ */
+static void virtio_net_rx_coalesce(struct net_dev_queue *queue, u32 nr)
+{
+	struct net_dev *ndev = queue->ndev;
+	u64 now = virtio_net__time_ns();
+	u64 interval = max(now - queue->last_batch, 1ULL);
+
+	queue->rate		= (queue->rate * 7 + nr * 1000000000ULL / interval) / 8;
+	queue->last_batch	= now;
+
+	if (!queue->pending)
+		queue->pending_since = now;
+	queue->pending += nr;
+
+	if (!ndev->coalesce_usecs ||
+	    queue->rate * ndev->coalesce_usecs < 2 * 1000000ULL ||
+	    queue->pending >= ndev->coalesce_packets ||
+	    now - queue->pending_since >= ndev->coalesce_usecs * 1000ULL)
+		virtio_net_rx_signal(queue);
+}
+
+/*
+ * Waits for the tap device or packet socket to have a packet for us, or for
+ * the coalescing time of the packets the guest wasn't told about yet to run
+ * out.
+ */
+static void virtio_net_rx_idle(struct net_dev_queue *queue)
+{
+	struct net_dev *ndev = queue->ndev;
+	u32 pair = VIRTIO_NET_QUEUE_PAIR(queue->id);
+	struct pollfd pfd = {
+		.fd	= ndev->mode == NET_MODE_PACKET ?
+			  ndev->packet[pair].fd : ndev->tap_fds[pair],
+		.events	= POLLIN,
+	};
+	struct timespec ts;
+	u64 deadline, now;
+
+	if (queue->pending) {
+		deadline	= queue->pending_since + ndev->coalesce_usecs * 1000ULL;
+		now		= virtio_net__time_ns();
+		if (now >= deadline) {
+			virtio_net_rx_signal(queue);
+		} else {
+			ts.tv_sec	= (deadline - now) / 1000000000ULL;
+			ts.tv_nsec	= (deadline - now) % 1000000000ULL;
+		}
+	}
+
+	if (ppoll(&pfd, 1, queue->pending ? &ts : NULL, NULL) == 0)
+		virtio_net_rx_signal(queue);
+}
+
+/*
+ * Receives up to a batch of packets, and publishes them all at once. Returns
+ * how many there were, 0 if the guest ran short of buffers, or -EAGAIN if
+ * the backend ran out of packets.
+ */
+static int virtio_net_rx_batch(struct net_dev_queue *queue, struct iovec *iov,
+			       struct iovec *rx_iov)
+{
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	u32 batch, nr = 0;
+	u16 used = 0;
+	int r = 1;
+
+	/* uip blocks until it has a packet, so it can't be asked for more */
+	batch = ndev->mode == NET_MODE_USER ? 1 : VIRTIO_NET_BATCH;
+
+	while (nr < batch && virt_queue__available(vq)) {
+		if (virtio_net__mergeable(ndev))
+			r = virtio_net_rx_mergeable(queue, iov, rx_iov, used);
+		else
+			r = virtio_net_rx_one(queue, iov, used);
+		if (r <= 0)
+			break;
+
+		used += r;
+		nr++;
+	}
+
+	if (used) {
+		virt_queue__used_idx_advance(vq, used);
+		virtio_net_rx_coalesce(queue, nr);
+	}
+
+	return r <= 0 ? r : (int)nr;
+}
+
+static void *virtio_net_rx_thread(void *p)
+{
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE * 2];
+	struct iovec rx_iov[VIRTIO_NET_QUEUE_SIZE * 2 + 1];
+	struct net_dev_queue *queue = p;
+	struct virt_queue *vq = &queue->vq;
+	int r;
 
 	while (1) {
-		mutex_lock(&ndev->io_rx_lock);
+		mutex_lock(&queue->lock);
 		if (!virt_queue__available(vq))
-			pthread_cond_wait(&ndev->io_rx_cond, &ndev->io_rx_lock);
-		mutex_unlock(&ndev->io_rx_lock);
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		mutex_unlock(&queue->lock);
 
 		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->rx(iov, in, ndev);
-			virt_queue__set_used_elem(vq, head, len);
-
-			/* We should interrupt guest right now, otherwise latency is huge. */
-			if (virtio_queue__should_signal(&ndev->vqs[VIRTIO_NET_RX_QUEUE]))
-				ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans,
-								VIRTIO_NET_RX_QUEUE);
+			r = virtio_net_rx_batch(queue, iov, rx_iov);
+			if (r == -EAGAIN) {
+				virtio_net_rx_idle(queue);
+			} else if (r == 0) {
+				/* The guest refills its buffers once told about these */
+				virtio_net_rx_signal(queue);
+				virtio_net_rx_wait(queue, queue->rx_avail);
+			}
 		}
+
+		virtio_net_rx_signal(queue);
 	}
 
 	pthread_exit(NULL);
@@ -111,30 +517,42 @@ static void *virtio_net_rx_thread(void *p)
 static void *virtio_net_tx_thread(void *p)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
-	struct virt_queue *vq;
-	struct kvm *kvm;
-	struct net_dev *ndev = p;
-	u16 out, in;
+	struct iovec tx_iov[VIRTIO_NET_QUEUE_SIZE + 1];
+	struct net_dev_queue *queue = p;
+	struct net_dev *ndev = queue->ndev;
+	struct virt_queue *vq = &queue->vq;
+	struct kvm *kvm = ndev->kvm;
+	u16 out, in, used;
 	u16 head;
 	int len;
 
-	kvm	= ndev->kvm;
-	vq	= &ndev->vqs[VIRTIO_NET_TX_QUEUE];
-
 	while (1) {
-		mutex_lock(&ndev->io_tx_lock);
+		mutex_lock(&queue->lock);
 		if (!virt_queue__available(vq))
-			pthread_cond_wait(&ndev->io_tx_cond, &ndev->io_tx_lock);
-		mutex_unlock(&ndev->io_tx_lock);
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		mutex_unlock(&queue->lock);
 
 		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
-			virt_queue__set_used_elem(vq, head, len);
-		}
+			for (used = 0; used < VIRTIO_NET_BATCH && virt_queue__available(vq); used++) {
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				if (virtio_net__mergeable(ndev))
+					len = ndev->ops->tx(tx_iov,
+							    virtio_net__skip_num_buffers(tx_iov, iov, out),
+							    queue);
+				else
+					len = ndev->ops->tx(iov, out, queue);
+				virt_queue__set_used_elem_no_update(vq, head, max(len, 0), used);
+			}
 
-		if (virtio_queue__should_signal(&ndev->vqs[VIRTIO_NET_TX_QUEUE]))
-			ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, VIRTIO_NET_TX_QUEUE);
+			if (ndev->ops->tx_flush)
+				ndev->ops->tx_flush(queue);
+
+			virt_queue__used_idx_advance(vq, used);
+
+			/* Let the guest free what was sent without waiting for the rest */
+			if (virtio_queue__should_signal(vq))
+				ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, queue->id);
+		}
 	}
 
 	pthread_exit(NULL);
@@ -143,22 +561,214 @@ static void *virtio_net_tx_thread(void *p)
 
 }
 
+/*
+ * Packet sockets of a multiqueue device are in a fanout group, which leaves
+ * it to this program which of them gets a packet. It hashes the addresses
+ * and TCP or UDP ports of IP packets to one of the active queue pairs, and
+ * sends the rest to the first one. Out of bounds loads end the program with
+ * 0, which is the first one as well. Unlike socket filters, it sees packets
+ * from their network header on.
+ */
+static int virtio_net__packet_steer(struct net_dev *ndev, u32 pairs)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 11),
+		/* IPv4, which was reassembled if it came in fragments */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 18, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT(BPF_JMP | BPF_JA, 9),
+		/* IPv6, the low words of the addresses do */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 19),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 20),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 36),
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		BPF_STMT(BPF_LDX | BPF_IMM, 40),
+		/* The protocol is in A, the offset of its header in X */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 4),
+		BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ST, 0),
+		/* Mix the bits, and pick a queue pair */
+		BPF_STMT(BPF_LD | BPF_MEM, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, pairs),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len	= ARRAY_SIZE(filter),
+		.filter	= filter,
+	};
+
+	if (ndev->nr_pairs > 1 &&
+	    setsockopt(ndev->packet[0].fd, SOL_PACKET, PACKET_FANOUT_DATA,
+		       &prog, sizeof(prog)) < 0)
+		return -errno;
+
+	ndev->active_pairs = pairs;
+
+	return 0;
+}
+
+/*
+ * Only the first queue pairs the guest asked for get packets from the tap
+ * device, which spreads them over its attached queues by flow.
+ */
+static int virtio_net__set_queue_pairs(struct net_dev *ndev, u32 pairs)
+{
+	struct ifreq ifr;
+	u32 i;
+
+	if (pairs < 1 || pairs > ndev->nr_pairs)
+		return -EINVAL;
+
+	if (ndev->mode == NET_MODE_PACKET)
+		return virtio_net__packet_steer(ndev, pairs);
+
+	if (ndev->mode != NET_MODE_TAP)
+		return 0;
+
+	for (i = 1; i < ndev->nr_pairs; i++) {
+		if ((i < pairs) == (i < ndev->active_pairs))
+			continue;
+
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = i < pairs ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(ndev->tap_fds[i], TUNSETQUEUE, &ifr) < 0)
+			return -errno;
+	}
+
+	ndev->active_pairs = pairs;
+
+	return 0;
+}
+
+static u8 virtio_net__handle_ctrl_cmd(struct net_dev *ndev, struct virtio_net_ctrl_hdr *hdr,
+				      struct iovec *iov, u16 out)
+{
+	struct virtio_net_ctrl_mq mq;
+
+	if (hdr->class != VIRTIO_NET_CTRL_MQ || hdr->cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)
+		return VIRTIO_NET_ERR;
+
+	if (out < 1 || iov[0].iov_len < sizeof(mq))
+		return VIRTIO_NET_ERR;
+
+	memcpy(&mq, iov[0].iov_base, sizeof(mq));
+
+	if (virtio_net__set_queue_pairs(ndev, mq.virtqueue_pairs) < 0)
+		return VIRTIO_NET_ERR;
+
+	return VIRTIO_NET_OK;
+}
+
+/* Control commands are rare and quick, they're handled as they come in */
+static void virtio_net_handle_ctrl(struct kvm *kvm, struct net_dev *ndev, u32 id)
+{
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct virt_queue *vq = &ndev->queues[id].vq;
+	struct virtio_net_ctrl_hdr hdr;
+	u16 out, in, head;
+	u8 ack;
+
+	mutex_lock(&ndev->mutex);
+
+	while (virt_queue__available(vq)) {
+		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+
+		/* The header comes first, the ack last */
+		if (out < 1 || in < 1 || iov[0].iov_len < sizeof(hdr) ||
+		    iov[out + in - 1].iov_len < sizeof(ack)) {
+			virt_queue__set_used_elem(vq, head, 0);
+			continue;
+		}
+
+		memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+		ack = virtio_net__handle_ctrl_cmd(ndev, &hdr, iov + 1, out - 1);
+		memcpy(iov[out + in - 1].iov_base, &ack, sizeof(ack));
+
+		virt_queue__set_used_elem(vq, head, sizeof(ack));
+	}
+
+	mutex_unlock(&ndev->mutex);
+
+	if (virtio_queue__should_signal(vq))
+		ndev->vtrans.trans_ops->signal_vq(kvm, &ndev->vtrans, id);
+}
+
 static void virtio_net_handle_callback(struct kvm *kvm, struct net_dev *ndev, int queue)
 {
-	switch (queue) {
-	case VIRTIO_NET_TX_QUEUE:
-		mutex_lock(&ndev->io_tx_lock);
-		pthread_cond_signal(&ndev->io_tx_cond);
-		mutex_unlock(&ndev->io_tx_lock);
-		break;
-	case VIRTIO_NET_RX_QUEUE:
-		mutex_lock(&ndev->io_rx_lock);
-		pthread_cond_signal(&ndev->io_rx_cond);
-		mutex_unlock(&ndev->io_rx_lock);
-		break;
-	default:
+	struct net_dev_queue *q;
+
+	if ((u32)queue >= virtio_net__nr_queues(ndev)) {
 		pr_warning("Unknown queue index %u", queue);
+		return;
+	}
+
+	if (virtio_net__is_ctrl_queue(ndev, queue)) {
+		virtio_net_handle_ctrl(kvm, ndev, queue);
+		return;
+	}
+
+	q = &ndev->queues[queue];
+
+	mutex_lock(&q->lock);
+	pthread_cond_signal(&q->cond);
+	mutex_unlock(&q->lock);
+}
+
+/*
+ * Every further queue of a multiqueue tap device is another open of
+ * /dev/net/tun, attached to the device by name. Offloads and the vnet header
+ * size are per device, and were set up through the first one.
+ */
+static void virtio_net__tap_add_queues(struct net_dev *ndev)
+{
+	struct ifreq ifr;
+	u32 i;
+	int fd;
+
+	for (i = 1; i < ndev->nr_pairs; i++) {
+		fd = open("/dev/net/tun", O_RDWR);
+		if (fd < 0)
+			break;
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, ndev->tap_name, sizeof(ifr.ifr_name));
+		ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR | IFF_MULTI_QUEUE;
+		if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+			close(fd);
+			break;
+		}
+
+		ndev->tap_fds[i] = fd;
+	}
+
+	if (i < ndev->nr_pairs) {
+		pr_warning("Unable to open tap queue %u, using %u queue pairs", i, i);
+		ndev->nr_pairs = i;
 	}
+
+	/* The guest starts out with a single queue pair */
+	ndev->active_pairs = ndev->nr_pairs;
+	if (virtio_net__set_queue_pairs(ndev, 1) < 0)
+		pr_warning("Unable to detach tap queues");
 }
 
 static bool virtio_net__tap_init(const struct virtio_net_params *params,
@@ -171,36 +781,38 @@ static bool virtio_net__tap_init(const struct virtio_net_params *params,
 
 	/* Did the user already gave us the FD? */
 	if (params->fd) {
-		ndev->tap_fd = params->fd;
+		ndev->tap_fds[0] = params->fd;
 		return 1;
 	}
 
-	ndev->tap_fd = open("/dev/net/tun", O_RDWR);
-	if (ndev->tap_fd < 0) {
+	ndev->tap_fds[0] = open("/dev/net/tun", O_RDWR);
+	if (ndev->tap_fds[0] < 0) {
 		pr_warning("Unable to open /dev/net/tun");
 		goto fail;
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
-	if (ioctl(ndev->tap_fd, TUNSETIFF, &ifr) < 0) {
+	if (ndev->nr_pairs > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (ioctl(ndev->tap_fds[0], TUNSETIFF, &ifr) < 0) {
 		pr_warning("Config tap device error. Are you root?");
 		goto fail;
 	}
 
 	strncpy(ndev->tap_name, ifr.ifr_name, sizeof(ndev->tap_name));
 
-	if (ioctl(ndev->tap_fd, TUNSETNOCSUM, 1) < 0) {
+	if (ioctl(ndev->tap_fds[0], TUNSETNOCSUM, 1) < 0) {
 		pr_warning("Config tap device TUNSETNOCSUM error");
 		goto fail;
 	}
 
 	hdr_len = sizeof(struct virtio_net_hdr);
-	if (ioctl(ndev->tap_fd, TUNSETVNETHDRSZ, &hdr_len) < 0)
+	if (ioctl(ndev->tap_fds[0], TUNSETVNETHDRSZ, &hdr_len) < 0)
 		pr_warning("Config tap device TUNSETVNETHDRSZ error");
 
 	offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_UFO;
-	if (ioctl(ndev->tap_fd, TUNSETOFFLOAD, offload) < 0) {
+	if (ioctl(ndev->tap_fds[0], TUNSETOFFLOAD, offload) < 0) {
 		pr_warning("Config tap device TUNSETOFFLOAD error");
 		goto fail;
 	}
@@ -238,47 +850,385 @@ static bool virtio_net__tap_init(const struct virtio_net_params *params,
 
 	close(sock);
 
+	virtio_net__tap_add_queues(ndev);
+
 	return 1;
 
 fail:
 	if (sock >= 0)
 		close(sock);
-	if (ndev->tap_fd >= 0)
-		close(ndev->tap_fd);
+	if (ndev->tap_fds[0] >= 0)
+		close(ndev->tap_fds[0]);
+
+	return 0;
+}
+
+/*
+ * Frames the guest can't possibly want, neither for its MAC address nor for
+ * a group one, are dropped before they're copied into the ring. The host
+ * interface is promiscuous, so there can be plenty of them.
+ */
+static int virtio_net__packet_filter(struct net_dev *ndev, int fd)
+{
+	u8 *mac = ndev->config.config.mac;
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+			 (u32)mac[0] << 24 | mac[1] << 16 | mac[2] << 8 | mac[3], 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, mac[4] << 8 | mac[5], 2, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len	= ARRAY_SIZE(filter),
+		.filter	= filter,
+	};
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void virtio_net__packet_close(struct net_dev_packet *p)
+{
+	if (p->ring)
+		munmap(p->ring, VIRTIO_NET_PACKET_RX_LEN + VIRTIO_NET_PACKET_TX_LEN);
+	close(p->fd);
+
+	*p = (struct net_dev_packet) {
+		.fd	= -1,
+	};
+}
+
+/*
+ * Packets go through the rings in both directions, with the virtio-net
+ * header in front of them so that checksum and segmentation offloads carry
+ * over. The socket is only bound once its rings are in place, so that no
+ * packet is queued anywhere else.
+ */
+static int virtio_net__packet_open(struct net_dev *ndev, u32 pair, int ifindex)
+{
+	struct net_dev_packet *p = &ndev->packet[pair];
+	struct tpacket_req3 rx = {
+		.tp_block_size		= VIRTIO_NET_PACKET_BLOCK_SIZE,
+		.tp_block_nr		= VIRTIO_NET_PACKET_BLOCKS,
+		.tp_frame_size		= TPACKET_ALIGNMENT << 7,
+		.tp_frame_nr		= VIRTIO_NET_PACKET_RX_LEN / (TPACKET_ALIGNMENT << 7),
+		.tp_retire_blk_tov	= VIRTIO_NET_PACKET_BLOCK_TOV,
+	};
+	struct tpacket_req3 tx = {
+		.tp_block_size		= VIRTIO_NET_PACKET_TX_BLOCK_SIZE,
+		.tp_block_nr		= VIRTIO_NET_PACKET_TX_BLOCKS,
+		.tp_frame_size		= VIRTIO_NET_PACKET_TX_FRAME,
+		.tp_frame_nr		= VIRTIO_NET_PACKET_TX_FRAMES,
+	};
+	struct sockaddr_ll sll = {
+		.sll_family		= AF_PACKET,
+		.sll_protocol		= htons(ETH_P_ALL),
+		.sll_ifindex		= ifindex,
+	};
+	int version = TPACKET_V3, one = 1, r;
+	void *ring;
+
+	p->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (p->fd < 0)
+		return -errno;
+
+	if (setsockopt(p->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+	    setsockopt(p->fd, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) < 0 ||
+	    setsockopt(p->fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one)) < 0 ||
+	    setsockopt(p->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0 ||
+	    setsockopt(p->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) < 0) {
+		r = -errno;
+		goto fail;
+	}
+
+	r = virtio_net__packet_filter(ndev, p->fd);
+	if (r < 0)
+		goto fail;
+
+	/* Only older kernels can't, and then the guest sees what the host sends */
+	setsockopt(p->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+	ring = mmap(NULL, VIRTIO_NET_PACKET_RX_LEN + VIRTIO_NET_PACKET_TX_LEN,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+	if (ring == MAP_FAILED) {
+		r = -errno;
+		goto fail;
+	}
+	p->ring = ring;
+
+	if (bind(p->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		r = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	virtio_net__packet_close(p);
+	return r;
+}
+
+/*
+ * Every queue pair joins the same fanout group, in order, so that the index
+ * the steering program picks is that of the queue pair. The kernel hands out
+ * an unused group id to the first one.
+ */
+static int virtio_net__packet_fanout(struct net_dev *ndev, u32 pair)
+{
+	int type = PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_DEFRAG;
+	socklen_t len = sizeof(int);
+	int arg;
+
+	if (!pair)
+		arg = (type | PACKET_FANOUT_FLAG_UNIQUEID) << 16;
+	else if (getsockopt(ndev->packet[0].fd, SOL_PACKET, PACKET_FANOUT, &arg, &len) < 0)
+		return -errno;
+	else
+		arg = (arg & 0xffff) | type << 16;
+
+	if (setsockopt(ndev->packet[pair].fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int virtio_net__packet_init(const struct virtio_net_params *params,
+				   struct net_dev *ndev)
+{
+	struct packet_mreq mreq;
+	int ifindex, r;
+	u32 i;
+
+	if (!params->ifname)
+		return -EINVAL;
+
+	ifindex = if_nametoindex(params->ifname);
+	if (!ifindex)
+		return -errno;
+
+	for (i = 0; i < ndev->nr_pairs; i++) {
+		r = virtio_net__packet_open(ndev, i, ifindex);
+		if (r < 0 && !i)
+			return r;
+
+		/* Without a fanout group, the first socket still does on its own */
+		if (!r && ndev->nr_pairs > 1) {
+			r = virtio_net__packet_fanout(ndev, i);
+			if (r < 0 && i)
+				virtio_net__packet_close(&ndev->packet[i]);
+		}
+
+		if (r < 0)
+			break;
+	}
+
+	if (i < ndev->nr_pairs) {
+		pr_warning("Unable to set up packet socket %u: %s, using %u queue pairs",
+			   i, strerror(-r), max(i, 1U));
+		ndev->nr_pairs = max(i, 1U);
+	}
+
+	mreq = (struct packet_mreq) {
+		.mr_ifindex	= ifindex,
+		.mr_type	= PACKET_MR_PROMISC,
+	};
+	if (setsockopt(ndev->packet[0].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+		       &mreq, sizeof(mreq)) < 0)
+		pr_warning("Unable to make %s promiscuous", params->ifname);
+
+	/* The guest starts out with a single queue pair */
+	if (virtio_net__set_queue_pairs(ndev, 1) < 0)
+		pr_warning("Unable to steer packets to the first queue pair");
 
 	return 0;
 }
 
 static void virtio_net__io_thread_init(struct kvm *kvm, struct net_dev *ndev)
 {
-	pthread_mutex_init(&ndev->io_tx_lock, NULL);
-	pthread_mutex_init(&ndev->io_rx_lock, NULL);
+	struct net_dev_queue *queue;
+	int flags;
+	u32 i;
+
+	/* RX workers drain the tap device in batches, and poll it once empty */
+	for (i = 0; ndev->mode == NET_MODE_TAP && i < ndev->nr_pairs; i++) {
+		flags = fcntl(ndev->tap_fds[i], F_GETFL);
+		if (flags < 0 || fcntl(ndev->tap_fds[i], F_SETFL, flags | O_NONBLOCK) < 0)
+			die_perror("Unable to make the tap device non-blocking");
+	}
+
+	for (i = 0; i < ndev->nr_pairs * 2; i++) {
+		queue = &ndev->queues[i];
+
+		pthread_create(&queue->thread, NULL, VIRTIO_NET_IS_RX_QUEUE(i) ?
+			       virtio_net_rx_thread : virtio_net_tx_thread, queue);
+	}
+}
+
+static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
+{
+	int r = writev(queue->ndev->tap_fds[VIRTIO_NET_QUEUE_PAIR(queue->id)], iov, out);
+
+	return r < 0 ? -errno : r;
+}
+
+static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
+{
+	int r = readv(queue->ndev->tap_fds[VIRTIO_NET_QUEUE_PAIR(queue->id)], iov, in);
+
+	return r < 0 ? -errno : r;
+}
+
+/*
+ * Copies buf into the iovec. A frame which doesn't fit is dropped rather
+ * than cut short, as its vnet header would no longer match what's left.
+ */
+static int virtio_net__copy_to_iov(struct iovec *iov, u16 n, const void *buf, u32 len)
+{
+	u32 done = 0, chunk;
+	u16 i;
+
+	for (i = 0; i < n && done < len; i++) {
+		chunk = min((u32)iov[i].iov_len, len - done);
+		memcpy(iov[i].iov_base, buf + done, chunk);
+		done += chunk;
+	}
+
+	if (done < len)
+		return -EMSGSIZE;
+
+	return done;
+}
+
+static int virtio_net__copy_from_iov(void *buf, u32 size, const struct iovec *iov, u16 n)
+{
+	u32 done = 0;
+	u16 i;
+
+	for (i = 0; i < n; i++) {
+		if (iov[i].iov_len > size - done)
+			return -EMSGSIZE;
+		memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+		done += iov[i].iov_len;
+	}
+
+	return done;
+}
 
-	pthread_cond_init(&ndev->io_tx_cond, NULL);
-	pthread_cond_init(&ndev->io_rx_cond, NULL);
+static void packet_rx_release_block(struct net_dev_packet *p, struct tpacket_block_desc *block)
+{
+	/* Done reading it before the kernel may write it again */
+	mb();
+	block->hdr.bh1.block_status = TP_STATUS_KERNEL;
 
-	pthread_create(&ndev->io_tx_thread, NULL, virtio_net_tx_thread, ndev);
-	pthread_create(&ndev->io_rx_thread, NULL, virtio_net_rx_thread, ndev);
+	p->rx_block = (p->rx_block + 1) % VIRTIO_NET_PACKET_BLOCKS;
 }
 
-static inline int tap_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+/*
+ * Packets are read out of the block the kernel handed over until there are
+ * none left, and only then is the block given back. No system call is
+ * involved until the ring runs empty, and the RX worker polls the socket.
+ */
+static int packet_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
 {
-	return writev(ndev->tap_fd, iov, out);
+	struct net_dev_packet *p = &queue->ndev->packet[VIRTIO_NET_QUEUE_PAIR(queue->id)];
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *hdr;
+	int len;
+
+	block = p->ring + p->rx_block * VIRTIO_NET_PACKET_BLOCK_SIZE;
+
+	while (!p->rx_left) {
+		if (!(ACCESS_ONCE(block->hdr.bh1.block_status) & TP_STATUS_USER))
+			return -EAGAIN;
+		rmb();
+
+		p->rx_pkt	= (void *)block + block->hdr.bh1.offset_to_first_pkt;
+		p->rx_left	= block->hdr.bh1.num_pkts;
+		if (!p->rx_left) {
+			packet_rx_release_block(p, block);
+			block = p->ring + p->rx_block * VIRTIO_NET_PACKET_BLOCK_SIZE;
+		}
+	}
+
+	hdr = p->rx_pkt;
+
+	/* Cut short for lack of room in the block, which can't really happen */
+	if (hdr->tp_snaplen < hdr->tp_len)
+		len = -EMSGSIZE;
+	else
+		len = virtio_net__copy_to_iov(iov, in, (void *)hdr + hdr->tp_mac -
+					      sizeof(struct virtio_net_hdr),
+					      sizeof(struct virtio_net_hdr) + hdr->tp_snaplen);
+
+	if (--p->rx_left)
+		p->rx_pkt = (void *)hdr + hdr->tp_next_offset;
+	else
+		packet_rx_release_block(p, block);
+
+	return len;
 }
 
-static inline int tap_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+static struct tpacket3_hdr *packet_tx_frame(struct net_dev_packet *p)
 {
-	return readv(ndev->tap_fd, iov, in);
+	u32 i = p->tx_frame;
+
+	return p->ring + VIRTIO_NET_PACKET_RX_LEN +
+		i / VIRTIO_NET_PACKET_TX_PER_BLOCK * VIRTIO_NET_PACKET_TX_BLOCK_SIZE +
+		i % VIRTIO_NET_PACKET_TX_PER_BLOCK * VIRTIO_NET_PACKET_TX_FRAME;
 }
 
-static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev *ndev)
+/* Packets are only queued up here, tx_flush has the kernel send them */
+static int packet_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
 {
-	return uip_tx(iov, out, &ndev->info);
+	struct net_dev_packet *p = &queue->ndev->packet[VIRTIO_NET_QUEUE_PAIR(queue->id)];
+	struct tpacket3_hdr *hdr = packet_tx_frame(p);
+	int len;
+
+	if (ACCESS_ONCE(hdr->tp_status) != TP_STATUS_AVAILABLE) {
+		/* The ring is full, wait for what's in it to be sent */
+		send(p->fd, NULL, 0, 0);
+		if (ACCESS_ONCE(hdr->tp_status) != TP_STATUS_AVAILABLE)
+			return -ENOBUFS;
+	}
+
+	len = virtio_net__copy_from_iov((void *)hdr + VIRTIO_NET_PACKET_TX_DATA,
+					VIRTIO_NET_PACKET_TX_FRAME - VIRTIO_NET_PACKET_TX_DATA,
+					iov, out);
+	if (len < 0)
+		return len;
+
+	hdr->tp_len		= len;
+	hdr->tp_next_offset	= 0;
+	wmb();
+	hdr->tp_status		= TP_STATUS_SEND_REQUEST;
+
+	p->tx_frame = (p->tx_frame + 1) % VIRTIO_NET_PACKET_TX_FRAMES;
+
+	return len;
 }
 
-static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev *ndev)
+static void packet_ops_tx_flush(struct net_dev_queue *queue)
 {
-	return uip_rx(iov, in, &ndev->info);
+	struct net_dev_packet *p = &queue->ndev->packet[VIRTIO_NET_QUEUE_PAIR(queue->id)];
+
+	/* One call sends the whole batch, without waiting for it to be gone */
+	send(p->fd, NULL, 0, MSG_DONTWAIT);
+}
+
+static inline int uip_ops_tx(struct iovec *iov, u16 out, struct net_dev_queue *queue)
+{
+	return uip_tx(iov, out, &queue->ndev->info);
+}
+
+static inline int uip_ops_rx(struct iovec *iov, u16 in, struct net_dev_queue *queue)
+{
+	return uip_rx(iov, in, &queue->ndev->info);
 }
 
 static struct net_dev_operations tap_ops = {
@@ -286,6 +1236,12 @@ static struct net_dev_operations tap_ops = {
 	.tx	= tap_ops_tx,
 };
 
+static struct net_dev_operations packet_ops = {
+	.rx		= packet_ops_rx,
+	.tx		= packet_ops_tx,
+	.tx_flush	= packet_ops_tx_flush,
+};
+
 static struct net_dev_operations uip_ops = {
 	.rx	= uip_ops_rx,
 	.tx	= uip_ops_tx,
@@ -295,6 +1251,9 @@ static void set_config(struct kvm *kvm, void *dev, u8 data, u32 offset)
 {
 	struct net_dev *ndev = dev;
 
+	if (offset >= sizeof(ndev->config))
+		return;
+
 	((u8 *)(&ndev->config))[offset] = data;
 }
 
@@ -302,21 +1261,58 @@ static u8 get_config(struct kvm *kvm, void *dev, u32 offset)
 {
 	struct net_dev *ndev = dev;
 
+	if (offset >= sizeof(ndev->config))
+		return 0;
+
 	return ((u8 *)(&ndev->config))[offset];
 }
 
 static u32 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1UL << VIRTIO_NET_F_MAC
+	struct net_dev *ndev = dev;
+	u32 features;
+
+	features = 1UL << VIRTIO_NET_F_MAC
 		| 1UL << VIRTIO_NET_F_CSUM
+		| 1UL << VIRTIO_NET_F_GUEST_CSUM
 		| 1UL << VIRTIO_NET_F_HOST_UFO
 		| 1UL << VIRTIO_NET_F_HOST_TSO4
 		| 1UL << VIRTIO_NET_F_HOST_TSO6
 		| 1UL << VIRTIO_NET_F_GUEST_UFO
 		| 1UL << VIRTIO_NET_F_GUEST_TSO4
 		| 1UL << VIRTIO_NET_F_GUEST_TSO6
+		| 1UL << VIRTIO_NET_F_MRG_RXBUF
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC;
+
+	if (ndev->nr_pairs > 1)
+		features |= 1UL << VIRTIO_NET_F_CTRL_VQ | 1UL << VIRTIO_NET_F_MQ;
+
+	return features;
+}
+
+/*
+ * Unlike our own workers, vhost passes the whole header on to the tap device,
+ * which has to be told how large it is.
+ */
+static void virtio_net__vhost_set_features(struct net_dev *ndev)
+{
+	u64 features = 1UL << VIRTIO_RING_F_EVENT_IDX;
+	int hdr_len = sizeof(struct virtio_net_hdr);
+	u32 i;
+
+	if (virtio_net__mergeable(ndev)) {
+		features |= 1UL << VIRTIO_NET_F_MRG_RXBUF;
+		hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	}
+
+	if (ndev->mode == NET_MODE_TAP &&
+	    ioctl(ndev->tap_fds[0], TUNSETVNETHDRSZ, &hdr_len) < 0)
+		pr_warning("Config tap device TUNSETVNETHDRSZ error");
+
+	for (i = 0; i < ndev->nr_pairs; i++)
+		if (ioctl(ndev->vhost_fds[i], VHOST_SET_FEATURES, &features) < 0)
+			die_perror("VHOST_SET_FEATURES failed");
 }
 
 static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
@@ -324,45 +1320,74 @@ static void set_guest_features(struct kvm *kvm, void *dev, u32 features)
 	struct net_dev *ndev = dev;
 
 	ndev->features = features;
+
+	ndev->info.guest_csum = features & (1UL << VIRTIO_NET_F_GUEST_CSUM);
+	ndev->info.guest_tso4 = ndev->info.guest_csum &&
+				features & (1UL << VIRTIO_NET_F_GUEST_TSO4);
+
+	if (ndev->vhost)
+		virtio_net__vhost_set_features(ndev);
+}
+
+/*
+ * With vhost, each queue pair is a vhost-net device of its own, whose queues
+ * are numbered 0 (RX) and 1 (TX). The control queue stays with us.
+ */
+static bool virtio_net__vhost_vq(struct net_dev *ndev, u32 vq, int *fd, u32 *index)
+{
+	if (!ndev->vhost || virtio_net__is_ctrl_queue(ndev, vq))
+		return false;
+
+	*fd	= ndev->vhost_fds[VIRTIO_NET_QUEUE_PAIR(vq)];
+	*index	= vq & 1;
+
+	return true;
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq, u32 pfn)
 {
-	struct vhost_vring_state state = { .index = vq };
+	struct vhost_vring_state state;
 	struct vhost_vring_addr addr;
 	struct net_dev *ndev = dev;
 	struct virt_queue *queue;
+	u32 index;
 	void *p;
-	int r;
+	int r, fd;
+
+	if (vq >= virtio_net__nr_queues(ndev))
+		return -EINVAL;
 
 	compat__remove_message(compat_id);
 
-	queue		= &ndev->vqs[vq];
+	queue		= &ndev->queues[vq].vq;
 	queue->pfn	= pfn;
 	p		= guest_pfn_to_host(kvm, queue->pfn);
 
 	vring_init(&queue->vring, VIRTIO_NET_QUEUE_SIZE, p, VIRTIO_PCI_VRING_ALIGN);
 
-	if (ndev->vhost_fd == 0)
+	if (!virtio_net__vhost_vq(ndev, vq, &fd, &index))
 		return 0;
 
-	state.num = queue->vring.num;
-	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_NUM, &state);
+	state = (struct vhost_vring_state) {
+		.index	= index,
+		.num	= queue->vring.num,
+	};
+	r = ioctl(fd, VHOST_SET_VRING_NUM, &state);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_NUM failed");
 	state.num = 0;
-	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_BASE, &state);
+	r = ioctl(fd, VHOST_SET_VRING_BASE, &state);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_BASE failed");
 
 	addr = (struct vhost_vring_addr) {
-		.index = vq,
+		.index = index,
 		.desc_user_addr = (u64)(unsigned long)queue->vring.desc,
 		.avail_user_addr = (u64)(unsigned long)queue->vring.avail,
 		.used_user_addr = (u64)(unsigned long)queue->vring.used,
 	};
 
-	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_ADDR, &addr);
+	r = ioctl(fd, VHOST_SET_VRING_ADDR, &addr);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_ADDR failed");
 
@@ -374,9 +1399,10 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	struct net_dev *ndev = dev;
 	struct kvm_irqfd irq;
 	struct vhost_vring_file file;
-	int r;
+	u32 index;
+	int r, fd;
 
-	if (ndev->vhost_fd == 0)
+	if (!virtio_net__vhost_vq(ndev, vq, &fd, &index))
 		return;
 
 	irq = (struct kvm_irqfd) {
@@ -384,7 +1410,7 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 		.fd	= eventfd(0, 0),
 	};
 	file = (struct vhost_vring_file) {
-		.index	= vq,
+		.index	= index,
 		.fd	= irq.fd,
 	};
 
@@ -392,11 +1418,11 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 	if (r < 0)
 		die_perror("KVM_IRQFD failed");
 
-	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_CALL, &file);
+	r = ioctl(fd, VHOST_SET_VRING_CALL, &file);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_CALL failed");
-	file.fd = ndev->tap_fd;
-	r = ioctl(ndev->vhost_fd, VHOST_NET_SET_BACKEND, &file);
+	file.fd = ndev->tap_fds[VIRTIO_NET_QUEUE_PAIR(vq)];
+	r = ioctl(fd, VHOST_NET_SET_BACKEND, &file);
 	if (r != 0)
 		die("VHOST_NET_SET_BACKEND failed %d", errno);
 
@@ -405,16 +1431,19 @@ static void notify_vq_gsi(struct kvm *kvm, void *dev, u32 vq, u32 gsi)
 static void notify_vq_eventfd(struct kvm *kvm, void *dev, u32 vq, u32 efd)
 {
 	struct net_dev *ndev = dev;
-	struct vhost_vring_file file = {
-		.index	= vq,
-		.fd	= efd,
-	};
-	int r;
+	struct vhost_vring_file file;
+	u32 index;
+	int r, fd;
 
-	if (ndev->vhost_fd == 0)
+	if (!virtio_net__vhost_vq(ndev, vq, &fd, &index))
 		return;
 
-	r = ioctl(ndev->vhost_fd, VHOST_SET_VRING_KICK, &file);
+	file = (struct vhost_vring_file) {
+		.index	= index,
+		.fd	= efd,
+	};
+
+	r = ioctl(fd, VHOST_SET_VRING_KICK, &file);
 	if (r < 0)
 		die_perror("VHOST_SET_VRING_KICK failed");
 }
@@ -432,11 +1461,20 @@ static int get_pfn_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct net_dev *ndev = dev;
 
-	return ndev->vqs[vq].pfn;
+	if (vq >= virtio_net__nr_queues(ndev))
+		return 0;
+
+	return ndev->queues[vq].vq.pfn;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
 {
+	struct net_dev *ndev = dev;
+
+	/* A zero sized queue tells the guest that it doesn't exist */
+	if (vq >= virtio_net__nr_queues(ndev))
+		return 0;
+
 	return VIRTIO_NET_QUEUE_SIZE;
 }
 
@@ -453,16 +1491,34 @@ static struct virtio_ops net_dev_virtio_ops = (struct virtio_ops) {
 	.notify_vq_eventfd	= notify_vq_eventfd,
 };
 
-static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
+static int virtio_net__vhost_open(struct kvm *kvm, struct vhost_memory *mem)
 {
 	u64 features = 1UL << VIRTIO_RING_F_EVENT_IDX;
-	struct vhost_memory *mem;
-	int r;
+	int fd, r;
 
-	ndev->vhost_fd = open("/dev/vhost-net", O_RDWR);
-	if (ndev->vhost_fd < 0)
+	fd = open("/dev/vhost-net", O_RDWR);
+	if (fd < 0)
 		die_perror("Failed openning vhost-net device");
 
+	r = ioctl(fd, VHOST_SET_OWNER);
+	if (r != 0)
+		die_perror("VHOST_SET_OWNER failed");
+
+	r = ioctl(fd, VHOST_SET_FEATURES, &features);
+	if (r != 0)
+		die_perror("VHOST_SET_FEATURES failed");
+	r = ioctl(fd, VHOST_SET_MEM_TABLE, mem);
+	if (r != 0)
+		die_perror("VHOST_SET_MEM_TABLE failed");
+
+	return fd;
+}
+
+static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
+{
+	struct vhost_memory *mem;
+	u32 i;
+
 	mem = malloc(sizeof(*mem) + sizeof(struct vhost_memory_region));
 	if (mem == NULL)
 		die("Failed allocating memory for vhost memory map");
@@ -474,23 +1530,45 @@ static void virtio_net__vhost_init(struct kvm *kvm, struct net_dev *ndev)
 		.userspace_addr		= (unsigned long)kvm->ram_start,
 	};
 
-	r = ioctl(ndev->vhost_fd, VHOST_SET_OWNER);
-	if (r != 0)
-		die_perror("VHOST_SET_OWNER failed");
+	for (i = 0; i < ndev->nr_pairs; i++)
+		ndev->vhost_fds[i] = virtio_net__vhost_open(kvm, mem);
+
+	ndev->vhost = true;
 
-	r = ioctl(ndev->vhost_fd, VHOST_SET_FEATURES, &features);
-	if (r != 0)
-		die_perror("VHOST_SET_FEATURES failed");
-	r = ioctl(ndev->vhost_fd, VHOST_SET_MEM_TABLE, mem);
-	if (r != 0)
-		die_perror("VHOST_SET_MEM_TABLE failed");
 	free(mem);
 }
 
+/* One queue pair per vCPU, unless told otherwise */
+static u32 virtio_net__get_nr_pairs(const struct virtio_net_params *params)
+{
+	u32 nr_pairs;
+
+	nr_pairs = params->queues > 0 ? params->queues : params->kvm->nrcpus;
+
+	/* Multiqueue needs a tap device we open ourselves, or packet sockets */
+	if (params->mode == NET_MODE_USER || (params->mode == NET_MODE_TAP && params->fd)) {
+		if (params->queues > 1)
+			pr_warning("virtio-net only supports multiple queues with tap devices"
+				   " and packet sockets");
+		return 1;
+	}
+
+	if (nr_pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+		if (params->queues)
+			pr_warning("virtio-net supports at most %d queue pairs, using %d",
+				   VIRTIO_NET_MAX_QUEUE_PAIRS, VIRTIO_NET_MAX_QUEUE_PAIRS);
+		nr_pairs = VIRTIO_NET_MAX_QUEUE_PAIRS;
+	}
+
+	return max(nr_pairs, 1U);
+}
+
 void virtio_net__init(const struct virtio_net_params *params)
 {
-	int i;
+	struct net_dev_queue *queue;
 	struct net_dev *ndev;
+	u32 i;
+	int r;
 
 	if (!params)
 		return;
@@ -504,35 +1582,69 @@ void virtio_net__init(const struct virtio_net_params *params)
 	ndev->kvm = params->kvm;
 
 	mutex_init(&ndev->mutex);
-	ndev->config.status = VIRTIO_NET_S_LINK_UP;
+	ndev->config.config.status = VIRTIO_NET_S_LINK_UP;
 
 	for (i = 0 ; i < 6 ; i++) {
-		ndev->config.mac[i]		= params->guest_mac[i];
+		ndev->config.config.mac[i]	= params->guest_mac[i];
 		ndev->info.guest_mac.addr[i]	= params->guest_mac[i];
 		ndev->info.host_mac.addr[i]	= params->host_mac[i];
 	}
 
+	ndev->nr_pairs		= virtio_net__get_nr_pairs(params);
+	ndev->active_pairs	= 1;
+
+	ndev->coalesce_usecs	= params->coalesce_usecs > 0 ?
+				  params->coalesce_usecs : VIRTIO_NET_COALESCE_USECS;
+	ndev->coalesce_packets	= params->coalesce_packets > 0 ?
+				  params->coalesce_packets : VIRTIO_NET_COALESCE_PACKETS;
+	if (params->mode == NET_MODE_USER)
+		ndev->coalesce_usecs = 0;
+
 	ndev->mode = params->mode;
 	if (ndev->mode == NET_MODE_TAP) {
 		if (!virtio_net__tap_init(params, ndev))
 			die_perror("You have requested a TAP device, but creation of one has"
 					"failed because:");
 		ndev->ops = &tap_ops;
+	} else if (ndev->mode == NET_MODE_PACKET) {
+		r = virtio_net__packet_init(params, ndev);
+		if (r == -EINVAL)
+			die("Packet sockets need a host interface, given with ifname=<name>");
+		if (r < 0)
+			die("Unable to set up a packet socket on %s: %s", params->ifname,
+			    strerror(-r));
+		ndev->ops = &packet_ops;
 	} else {
 		ndev->info.host_ip		= ntohl(inet_addr(params->host_ip));
 		ndev->info.guest_ip		= ntohl(inet_addr(params->guest_ip));
 		ndev->info.guest_netmask	= ntohl(inet_addr("255.255.255.0"));
-		ndev->info.buf_nr		= 20,
-		uip_init(&ndev->info);
+		ndev->info.buf_nr		= max(params->buffers, 0);
+		if (uip_init(&ndev->info) < 0)
+			die("Unable to set up user mode networking");
 		ndev->ops = &uip_ops;
 	}
 
+	ndev->config.max_virtqueue_pairs = ndev->nr_pairs;
+
+	for (i = 0; i < virtio_net__nr_queues(ndev); i++) {
+		queue = &ndev->queues[i];
+
+		queue->id	= i;
+		queue->ndev	= ndev;
+		pthread_mutex_init(&queue->lock, NULL);
+		pthread_cond_init(&queue->cond, NULL);
+	}
+
 	virtio_trans_init(&ndev->vtrans, VIRTIO_PCI);
 	ndev->vtrans.trans_ops->init(kvm, &ndev->vtrans, ndev, PCI_DEVICE_ID_VIRTIO_NET,
 					VIRTIO_ID_NET, PCI_CLASS_NET);
 	ndev->vtrans.virtio_ops = &net_dev_virtio_ops;
 
-	if (params->vhost)
+	/* vhost-net reads and writes sockets, it knows nothing of their rings */
+	if (params->vhost && ndev->mode == NET_MODE_PACKET)
+		pr_warning("vhost doesn't support packet sockets, not using it");
+
+	if (params->vhost && ndev->mode != NET_MODE_PACKET)
 		virtio_net__vhost_init(params->kvm, ndev);
 	else
 		virtio_net__io_thread_init(params->kvm, ndev);
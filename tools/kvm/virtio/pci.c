@@ -81,7 +81,10 @@ static bool virtio_pci__specific_io_in(struct kvm *kvm, struct virtio_trans *vtr
 			ioport__write16(data, vpci->config_vector);
 			break;
 		case VIRTIO_MSI_QUEUE_VECTOR:
-			ioport__write16(data, vpci->vq_vector[vpci->queue_selector]);
+			if (vpci->queue_selector < VIRTIO_PCI_MAX_VQ)
+				ioport__write16(data, vpci->vq_vector[vpci->queue_selector]);
+			else
+				ioport__write16(data, VIRTIO_MSI_NO_VECTOR);
 			break;
 		};
 
@@ -142,22 +145,53 @@ static bool virtio_pci__specific_io_out(struct kvm *kvm, struct virtio_trans *vt
 					void *data, int size, int offset)
 {
 	struct virtio_pci *vpci = vtrans->virtio;
-	u32 config_offset, gsi, vec;
+	u32 config_offset, vec;
+	int gsi;
 	int type = virtio__get_dev_specific_field(offset - 20, virtio_pci__msix_enabled(vpci),
 							&config_offset);
 	if (type == VIRTIO_PCI_O_MSIX) {
 		switch (offset) {
 		case VIRTIO_MSI_CONFIG_VECTOR:
-			vec = vpci->config_vector = ioport__read16(data);
+			vec = ioport__read16(data);
+			if (vec >= VIRTIO_PCI_MAX_MSIX) {
+				/* Out of range vectors read back as no vector at all */
+				vpci->config_vector = VIRTIO_MSI_NO_VECTOR;
+				break;
+			}
+
+			vpci->config_vector = vec;
 
 			gsi = irq__add_msix_route(kvm, &vpci->msix_table[vec].msg);
+			if (gsi < 0) {
+				vpci->config_vector = VIRTIO_MSI_NO_VECTOR;
+				break;
+			}
 
 			vpci->config_gsi = gsi;
 			break;
 		case VIRTIO_MSI_QUEUE_VECTOR:
-			vec = vpci->vq_vector[vpci->queue_selector] = ioport__read16(data);
-
+			if (vpci->queue_selector >= VIRTIO_PCI_MAX_VQ)
+				break;
+
+			vec = ioport__read16(data);
+			if (vec >= VIRTIO_PCI_MAX_MSIX) {
+				vpci->vq_vector[vpci->queue_selector] = VIRTIO_MSI_NO_VECTOR;
+				break;
+			}
+
+			vpci->vq_vector[vpci->queue_selector] = vec;
+
+			/*
+			 * Tell the guest we ran out of routes by reading back
+			 * VIRTIO_MSI_NO_VECTOR, so it can fall back to sharing
+			 * vectors between queues.
+			 */
 			gsi = irq__add_msix_route(kvm, &vpci->msix_table[vec].msg);
+			if (gsi < 0) {
+				vpci->vq_vector[vpci->queue_selector] = VIRTIO_MSI_NO_VECTOR;
+				break;
+			}
+
 			vpci->gsis[vpci->queue_selector] = gsi;
 			if (vtrans->virtio_ops->notify_vq_gsi)
 				vtrans->virtio_ops->notify_vq_gsi(kvm, vpci->dev,
@@ -194,6 +228,8 @@ static bool virtio_pci__io_out(struct ioport *ioport, struct kvm *kvm, u16 port,
 		break;
 	case VIRTIO_PCI_QUEUE_PFN:
 		val = ioport__read32(data);
+		if (vpci->queue_selector >= VIRTIO_PCI_MAX_VQ)
+			break;
 		virtio_pci__init_ioeventfd(kvm, vtrans, vpci->queue_selector);
 		vtrans->virtio_ops->init_vq(kvm, vpci->dev, vpci->queue_selector, val);
 		break;
@@ -226,10 +262,14 @@ static void callback_mmio_table(u64 addr, u8 *data, u32 len, u8 is_write, void *
 	void *table;
 	u32 offset;
 
-	if (addr > vpci->msix_io_block + PCI_IO_SIZE) {
+	if (addr >= vpci->msix_io_block + VIRTIO_PCI_MSIX_TABLE_SIZE) {
 		table	= &vpci->msix_pba;
-		offset	= vpci->msix_io_block + PCI_IO_SIZE;
+		offset	= vpci->msix_io_block + VIRTIO_PCI_MSIX_TABLE_SIZE;
+		if (addr + len > offset + sizeof(vpci->msix_pba))
+			return;
 	} else {
+		if (addr + len > vpci->msix_io_block + sizeof(vpci->msix_table))
+			return;
 		table	= &vpci->msix_table;
 		offset	= vpci->msix_io_block;
 	}
@@ -246,10 +286,14 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_trans *vtrans, u32 vq)
 	int tbl = vpci->vq_vector[vq];
 
 	if (virtio_pci__msix_enabled(vpci)) {
+		/* The guest didn't assign a vector, or we couldn't route it */
+		if (tbl >= VIRTIO_PCI_MAX_MSIX)
+			return 0;
+
 		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
 		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
 
-			vpci->msix_pba |= 1 << tbl;
+			vpci->msix_pba |= 1ULL << tbl;
 			return 0;
 		}
 
@@ -267,10 +311,14 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_trans *vtrans)
 	int tbl = vpci->config_vector;
 
 	if (virtio_pci__msix_enabled(vpci)) {
+		/* The guest didn't assign a vector, or we couldn't route it */
+		if (tbl >= VIRTIO_PCI_MAX_MSIX)
+			return 0;
+
 		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
 		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
 
-			vpci->msix_pba |= 1 << tbl;
+			vpci->msix_pba |= 1ULL << tbl;
 			return 0;
 		}
 
@@ -291,14 +339,15 @@ int virtio_pci__init(struct kvm *kvm, struct virtio_trans *vtrans, void *dev,
 	int r;
 
 	vpci->dev = dev;
-	vpci->msix_io_block = pci_get_io_space_block(PCI_IO_SIZE * 2);
+	vpci->msix_io_block = pci_get_io_space_block(VIRTIO_PCI_MSIX_BAR_SIZE);
 
 	r = ioport__register(IOPORT_EMPTY, &virtio_pci__io_ops, IOPORT_SIZE, vtrans);
 	if (r < 0)
 		return r;
 
 	vpci->base_addr = (u16)r;
-	r = kvm__register_mmio(kvm, vpci->msix_io_block, PCI_IO_SIZE, false, callback_mmio_table, vpci);
+	r = kvm__register_mmio(kvm, vpci->msix_io_block, VIRTIO_PCI_MSIX_BAR_SIZE, false,
+				callback_mmio_table, vpci);
 	if (r < 0)
 		goto free_ioport;
 
@@ -319,8 +368,7 @@ int virtio_pci__init(struct kvm *kvm, struct virtio_trans *vtrans, void *dev,
 		.status			= cpu_to_le16(PCI_STATUS_CAP_LIST),
 		.capabilities		= (void *)&vpci->pci_hdr.msix - (void *)&vpci->pci_hdr,
 		.bar_size[0]		= IOPORT_SIZE,
-		.bar_size[1]		= PCI_IO_SIZE,
-		.bar_size[3]		= PCI_IO_SIZE,
+		.bar_size[1]		= VIRTIO_PCI_MSIX_BAR_SIZE,
 	};
 
 	vpci->pci_hdr.msix.cap = PCI_CAP_ID_MSIX;
@@ -336,14 +384,11 @@ int virtio_pci__init(struct kvm *kvm, struct virtio_trans *vtrans, void *dev,
 	 * For example, a returned value of "00000000011"
 	 * indicates a table size of 4.
 	 */
-	vpci->pci_hdr.msix.ctrl = cpu_to_le16(VIRTIO_PCI_MAX_VQ + VIRTIO_PCI_MAX_CONFIG - 1);
+	vpci->pci_hdr.msix.ctrl = cpu_to_le16(VIRTIO_PCI_MAX_MSIX - 1);
 
-	/*
-	 * Both table and PBA could be mapped on the same BAR, but for now
-	 * we're not in short of BARs
-	 */
-	vpci->pci_hdr.msix.table_offset = cpu_to_le32(1); /* Use BAR 1 */
-	vpci->pci_hdr.msix.pba_offset = cpu_to_le32(1 | PCI_IO_SIZE); /* Use BAR 3 */
+	/* Both the table and the PBA live in BAR 1 */
+	vpci->pci_hdr.msix.table_offset = cpu_to_le32(1);
+	vpci->pci_hdr.msix.pba_offset = cpu_to_le32(1 | VIRTIO_PCI_MSIX_TABLE_SIZE);
 	vpci->config_vector = 0;
 
 	r = irq__register_device(subsys_id, &ndev, &pin, &line);
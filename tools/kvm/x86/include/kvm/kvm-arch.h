@@ -6,6 +6,7 @@
 
 #include <stdbool.h>
 #include <linux/types.h>
+#include <linux/list.h>
 #include <time.h>
 
 /*
@@ -30,6 +31,7 @@ struct kvm {
 	int			nrcpus;		/* Number of cpus to run */
 
 	u32			mem_slots;	/* for KVM_SET_USER_MEMORY_REGION */
+	struct list_head	mem_banks;
 
 	u64			ram_size;
 	void			*ram_start;
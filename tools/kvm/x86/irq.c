@@ -1,5 +1,6 @@
 #include "kvm/irq.h"
 #include "kvm/kvm.h"
+#include "kvm/pci.h"
 #include "kvm/util.h"
 
 #include <linux/types.h>
@@ -11,13 +12,19 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-#define IRQ_MAX_GSI			64
+#define IRQ_MAX_GSI			4096
 #define IRQCHIP_MASTER			0
 #define IRQCHIP_SLAVE			1
 #define IRQCHIP_IOAPIC			2
 
-static u8		next_line	= 5;
-static u8		next_dev	= 1;
+/* Legacy lines given out to PCI devices, shared once they run out */
+#define IRQ_PCI_LINE_FIRST		5
+#define IRQ_PCI_LINE_LAST		23
+
+static u8		next_line	= IRQ_PCI_LINE_FIRST;
+static u32		next_dev	= 1;
+/* Every function of a slot shares the INTA# line of its function 0 */
+static u8		slot_line[PCI_MAX_SLOTS];
 static struct rb_root	pci_tree	= RB_ROOT;
 
 /* First 24 GSIs are routed between IRQCHIPs and IOAPICs */
@@ -121,14 +128,29 @@ int irq__register_device(u32 dev, u8 *num, u8 *pin, u8 *line)
 
 	if (node) {
 		/* This device already has a pin assigned, give out a new line and device id */
-		struct irq_line *new = malloc(sizeof(*new));
+		struct irq_line *new;
+
+		/* Slot 0 has no function 0, so its other functions would go unseen */
+		if (next_dev % PCI_MAX_SLOTS == 0)
+			next_dev++;
+		if (next_dev >= PCI_MAX_DEVICES)
+			return -ENOSPC;
+
+		new = malloc(sizeof(*new));
 		if (new == NULL)
 			return -ENOMEM;
 
-		new->line	= next_line++;
+		if (next_dev < PCI_MAX_SLOTS) {
+			slot_line[next_dev] = next_line;
+			next_line = next_line == IRQ_PCI_LINE_LAST ?
+				IRQ_PCI_LINE_FIRST : next_line + 1;
+		}
+
+		new->line	= slot_line[next_dev % PCI_MAX_SLOTS];
+		new->num	= next_dev++;
 		*line		= new->line;
 		*pin		= node->pin;
-		*num		= next_dev++;
+		*num		= new->num;
 
 		list_add(&new->node, &node->lines);
 
@@ -207,6 +229,9 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 {
 	int r;
 
+	if (gsi >= IRQ_MAX_GSI)
+		return -ENOSPC;
+
 	irq_routing->entries[irq_routing->nr++] =
 		(struct kvm_irq_routing_entry) {
 			.gsi = gsi,
@@ -217,8 +242,10 @@ int irq__add_msix_route(struct kvm *kvm, struct msi_msg *msg)
 		};
 
 	r = ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, irq_routing);
-	if (r)
-		return r;
+	if (r) {
+		irq_routing->nr--;
+		return -errno;
+	}
 
 	return gsi++;
 }
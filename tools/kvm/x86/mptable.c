@@ -4,6 +4,7 @@
 #include "kvm/mptable.h"
 #include "kvm/util.h"
 #include "kvm/irq.h"
+#include "kvm/pci.h"
 
 #include <linux/kernel.h>
 #include <string.h>
@@ -188,7 +189,11 @@ int mptable__init(struct kvm *kvm)
 		list_for_each_entry(irq_line, &dev->lines, node) {
 			unsigned char srcbusirq;
 
-			srcbusirq = (dev->id << 2) | (dev->pin - 1);
+			/* Further functions share the entry of the slot */
+			if (irq_line->num >= PCI_MAX_SLOTS)
+				continue;
+
+			srcbusirq = (irq_line->num << 2) | (dev->pin - 1);
 
 			mpc_intsrc = last_addr;
 